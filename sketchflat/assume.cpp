@@ -25,34 +25,202 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-// The Jacobian for our entire system. This is never actually solved--not
-// efficient, and asking for numerical surprises--but is used to determine
-// how we should make assumptions and partition the system.
-static struct {
-    int      eq[MAX_UNKNOWNS_AT_ONCE];
-    hParam   param[MAX_UNKNOWNS_AT_ONCE];
+// These are used to find the constraints to blame when the Jacobian doesn't
+// have full rank. The rows of the Jacobian get sorted by the constraint that
+// they came from, so that we can find a constraint's rows quickly.
+typedef struct {
+    hConstraint     hc;
+    int             row;
+} ConstraintRow;
+
+// A constraint writes at most this many equations, since that's all that
+// the equation handles leave room for.
+#define MAX_ROWS_FOR_CONSTRAINT 16
+
+// Each constraint gets tested separately, and in parallel if there's enough
+// work; so the scratch space for that is one of these per thread.
+typedef struct {
+    double  s[MAX_ROWS_FOR_CONSTRAINT][MAX_ROWS_FOR_CONSTRAINT];
+} RankScratch;
+
+// A row of a sparse matrix, as its nonzero entries in order of column.
+typedef struct {
+    int     col;
+    double  v;
+} RowEntry;
+typedef struct {
+    RowEntry    *e;
+    int         n;
+    int         alloc;
+} SparseRow;
 
-    Expr    *sym[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
-    double   num[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
-    int      M;
-    int      N;
-
-    BOOL    solvedFor[MAX_UNKNOWNS_AT_ONCE];
-    BOOL    assumed[MAX_UNKNOWNS_AT_ONCE];
-} J;
+//-----------------------------------------------------------------------------
+// Our state, which belongs to the solver context; so a solve on one thread
+// doesn't touch what a solve on another is using.
+//-----------------------------------------------------------------------------
+struct AssumeStateTag {
+    // The Jacobian for our entire system. This is never actually solved--
+    // not efficient, and asking for numerical surprises--but is used to
+    // determine how we should make assumptions and partition the system.
+    struct {
+        int     *eq;
+        int     eqAlloc;
+        hParam  *param;
+        int     paramAlloc;
+
+        // Stored by rows: the nonzero entries in row i are at rowStart[i]
+        // up to rowStart[i+1], in no particular order.
+        int     *rowStart;
+        int     rowStartAlloc;
+        int     *col;
+        int     colAlloc;
+        double  *v;
+        int     vAlloc;
+        int     nonzeros;
+
+        int     M;
+        int     N;
+
+        BOOL    *solvedFor;
+        int     solvedForAlloc;
+        BOOL    *assumed;
+        int     assumedAlloc;
+    }       jac;
+
+    // These are used in the least-squares type assumption heuristic.
+    struct {
+        double  A[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
+        double  AAt[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
+
+        double  b[MAX_UNKNOWNS_AT_ONCE];
+        double  z[MAX_UNKNOWNS_AT_ONCE];
+        double  x[MAX_UNKNOWNS_AT_ONCE];
+
+        int     rows;
+        int     cols;
+    }       ah;
+
+    // The Jacobian gets factored here, as A = Q*R. r[j] is the row of R
+    // whose first entry is in column j, if there is one. If we're finding
+    // the left null space, then q[j] is the row of Q' that goes with it,
+    // and each row of A that depends on the ones before it leaves its row
+    // of Q' in z[], as a column of the null space, M entries long.
+    struct {
+        SparseRow   *r;
+        int         rAlloc;
+        SparseRow   *q;
+        int         qAlloc;
+        int         rank;
+
+        // The row of A that we're rotating in, and its row of Q'; and
+        // the rows that the rotations get written to.
+        SparseRow   row;
+        SparseRow   rowQ;
+        SparseRow   t;
+        SparseRow   u;
+
+        double      *z;
+        int         zAlloc;
+        int         nulls;
+
+        ConstraintRow   *byConstraint;
+        int             byConstraintAlloc;
+    }       rq;
+
+    // The per-thread scratch for testing the constraints, and the results,
+    // in the same order as SK->constraint[].
+    RankScratch *scratch;
+    int         scratches;
+    BOOL        *removable;
+    int         removableAlloc;
+
+    // While we write the Jacobian, the column for each parameter, and so
+    // on; see WriteJacobian().
+    int         *colForParam;
+    int         colForParamAlloc;
+    int         *posInRow;
+    int         posInRowAlloc;
+    double      *paramValue;
+    int         paramValueAlloc;
+
+    // And the sensitivity to each column, and where it's moving to; see
+    // MostSensitiveCoordinateFirst().
+    double      *colSens;
+    int         colSensAlloc;
+    int         *newCol;
+    int         newColAlloc;
+};
+#define J                   (SC->assume->jac)
+#define AH                  (SC->assume->ah)
+#define RQ                  (SC->assume->rq)
+#define Scratch             (SC->assume->scratch)
+#define Scratches           (SC->assume->scratches)
+#define Removable           (SC->assume->removable)
+#define RemovableAlloc      (SC->assume->removableAlloc)
+#define ColForParam         (SC->assume->colForParam)
+#define ColForParamAlloc    (SC->assume->colForParamAlloc)
+#define PosInRow            (SC->assume->posInRow)
+#define PosInRowAlloc       (SC->assume->posInRowAlloc)
+#define ParamValue          (SC->assume->paramValue)
+#define ParamValueAlloc     (SC->assume->paramValueAlloc)
+#define ColSens             (SC->assume->colSens)
+#define ColSensAlloc        (SC->assume->colSensAlloc)
+#define NewCol              (SC->assume->newCol)
+#define NewColAlloc         (SC->assume->newColAlloc)
+
+void AssumeAllocState(SolverContext *sc)
+{
+    sc->assume = (struct AssumeStateTag *)DAlloc(sizeof(*(sc->assume)));
+    if(!sc->assume) oops();
+    memset(sc->assume, 0, sizeof(*(sc->assume)));
+}
 
-// These are used in the least-squares type assumption heuristic.
-struct {
-    double  A[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
-    double  AAt[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
+static void FreeSparseRows(SparseRow *rows, int n)
+{
+    int i;
+    for(i = 0; i < n; i++) {
+        UNRESERVE(rows[i].e, rows[i].alloc);
+    }
+}
 
-    double  b[MAX_UNKNOWNS_AT_ONCE];
-    double  z[MAX_UNKNOWNS_AT_ONCE];
-    double  x[MAX_UNKNOWNS_AT_ONCE];
+void AssumeFreeState(SolverContext *sc)
+{
+    struct AssumeStateTag *a = sc->assume;
+
+    UNRESERVE(a->jac.eq, a->jac.eqAlloc);
+    UNRESERVE(a->jac.param, a->jac.paramAlloc);
+    UNRESERVE(a->jac.rowStart, a->jac.rowStartAlloc);
+    UNRESERVE(a->jac.col, a->jac.colAlloc);
+    UNRESERVE(a->jac.v, a->jac.vAlloc);
+    UNRESERVE(a->jac.solvedFor, a->jac.solvedForAlloc);
+    UNRESERVE(a->jac.assumed, a->jac.assumedAlloc);
+
+    FreeSparseRows(a->rq.r, a->rq.rAlloc);
+    FreeSparseRows(a->rq.q, a->rq.qAlloc);
+    UNRESERVE(a->rq.r, a->rq.rAlloc);
+    UNRESERVE(a->rq.q, a->rq.qAlloc);
+    FreeSparseRows(&(a->rq.row), 1);
+    FreeSparseRows(&(a->rq.rowQ), 1);
+    FreeSparseRows(&(a->rq.t), 1);
+    FreeSparseRows(&(a->rq.u), 1);
+    UNRESERVE(a->rq.z, a->rq.zAlloc);
+    UNRESERVE(a->rq.byConstraint, a->rq.byConstraintAlloc);
+
+    if(a->scratch) DFree(a->scratch);
+    UNRESERVE(a->removable, a->removableAlloc);
+    UNRESERVE(a->colForParam, a->colForParamAlloc);
+    UNRESERVE(a->posInRow, a->posInRowAlloc);
+    UNRESERVE(a->paramValue, a->paramValueAlloc);
+    UNRESERVE(a->colSens, a->colSensAlloc);
+    UNRESERVE(a->newCol, a->newColAlloc);
+
+    DFree(a);
+    sc->assume = NULL;
+}
 
-    int     rows;
-    int     cols;
-} AH;
+// Handing work to the other threads isn't free, so it's not worth it
+// unless there's enough, counted in operations of the elimination.
+#define MIN_PARALLEL_RANK_WORK  50000
 
 //-----------------------------------------------------------------------------
 // Return a string that describes some parameter. This is needed when we
@@ -92,8 +260,14 @@ static char *StringForParam(hParam p)
 //-----------------------------------------------------------------------------
 static void NotifyUserThatWeAssumed(hParam p)
 {
-    if(SK->eqnsDirty) {
+    if(!SK->eqnsDirty) return;
+
+    if(SC->ui) {
         uiAddToAssumptionsList(StringForParam(p));
+    } else if(SC->report) {
+        SolverReport *r = SC->report;
+        RESERVE(r->assumed, r->assumedAlloc, r->assumeds + 1);
+        r->assumed[r->assumeds++] = p;
     }
 }
 
@@ -160,13 +334,30 @@ static void pm(double mat[][MAX_UNKNOWNS_AT_ONCE], int m, int n)
         OutputDebugString(buf);
     }
 }
+static double JacobianAt(int i, int j)
+{
+    int k;
+    for(k = J.rowStart[i]; k < J.rowStart[i+1]; k++) {
+        if(J.col[k] == j) return J.v[k];
+    }
+    return 0;
+}
 static void pmJ(void)
 {
-    pm(J.num, J.M, J.N);
+    int i, j;
+    char buf[1024];
+    for(i = 0; i < J.M; i++) {
+        OutputDebugString(" ");
+        for(j = 0; j < J.N; j++) {
+            double v = JacobianAt(i, j);
+            sprintf(buf, "%s%g ", v < 0 ? "" : " ", v);
+            OutputDebugString(buf);
+        }
+        sprintf(buf, ";\n");
+        OutputDebugString(buf);
+    }
 
-    int j;
     for(j = 0; j < J.N; j++) {
-        char buf[1024];
         sprintf(buf, "col %d: p%08x\n", j, J.param[j]);
         OutputDebugString(buf);
     }
@@ -210,41 +401,38 @@ static void pmAH(void)
 // matrix. I have a better method that's too slow; see
 // LeastSquaresXSensitivity().
 //-----------------------------------------------------------------------------
-static double SensitivityTo(hParam hp, int *jpos)
+static void MostSensitiveCoordinateFirst(void)
 {
-    int j;
+    int a, j, k;
+
+    // The sensitivity to each column, all in one pass over the nonzeros.
+    // The choice of a square here, in addition to looking theoretically
+    // sound, makes us nearly ignore angle constraints (dimensionless) when
+    // distance constraints (microns) are present. This is good; the
+    // distance constraints are most likely to end up unsatisfiable, so
+    // they should win.
+    RESERVE(ColSens, ColSensAlloc, J.N);
+    RESERVE(NewCol, NewColAlloc, J.N);
     for(j = 0; j < J.N; j++) {
-        if(J.param[j] == hp) {
-            double v = 0;
-            int i;
-            for(i = 0; i < J.M; i++) {
-                // The choice of a square here, in addition to looking
-                // theoretically sound, makes us nearly ignore angle
-                // constraints (dimensionless) when distance constraints
-                // (microns) are present. This is good; the distance
-                // constraints are most likely to end up unsatisfiable,
-                // so they should win.
-                double u = J.num[i][j];
-                v += u*u;
-            }
-            *jpos = j;
-            return v;
-        }
+        ColSens[j] = 0;
+        NewCol[j] = j;
     }
-    return VERY_NEGATIVE;
-}
-static void MostSensitiveCoordinateFirst(void)
-{
-    int a;
+    for(k = 0; k < J.nonzeros; k++) {
+        ColSens[J.col[k]] += J.v[k]*J.v[k];
+    }
+
     for(a = 0; a < SK->points; a++) {
         hPoint pt = SK->point[a];
-        hParam hpx = X_COORD_FOR_PT(pt);
-        hParam hpy = Y_COORD_FOR_PT(pt);
+        int ix = ParamSlot(X_COORD_FOR_PT(pt));
+        int iy = ParamSlot(Y_COORD_FOR_PT(pt));
+        if(ix < 0 || iy < 0) continue;
+
+        int jx = ColForParam[ix];
+        int jy = ColForParam[iy];
+        if(jx < 0 || jy < 0) continue;
 
-        int jx, jy;
-        double sx = SensitivityTo(hpx, &jx);
-        double sy = SensitivityTo(hpy, &jy);
-        if(sx < 0 || sy < 0) continue;
+        double sx = ColSens[jx];
+        double sy = ColSens[jy];
 
         BOOL swap;
         // A bit of hysteresis, to stop us from flitting back and forth
@@ -253,8 +441,8 @@ static void MostSensitiveCoordinateFirst(void)
         if(sx/sy < rat && sy/sx < rat) {
             swap = FALSE;
             // Almost the same; do whatever we did last time.
-            BOOL xas = (ParamById(hpx))->assumedLastTime;
-            BOOL yas = (ParamById(hpy))->assumedLastTime;
+            BOOL xas = SK->param[ix].assumedLastTime;
+            BOOL yas = SK->param[iy].assumedLastTime;
             if(xas && jx < jy) swap = TRUE;
             if(yas && jy < jx) swap = TRUE;
         } else {
@@ -268,200 +456,325 @@ static void MostSensitiveCoordinateFirst(void)
             J.param[jx] = J.param[jy];
             J.param[jy] = thp;
 
-            int i;
-            for(i = 0; i < J.M; i++) {
-                double tn = J.num[i][jx];
-                J.num[i][jx] = J.num[i][jy];
-                J.num[i][jy] = tn;
-
-                Expr *ts = J.sym[i][jx];
-                J.sym[i][jx] = J.sym[i][jy];
-                J.sym[i][jy] = ts;
-            }
+            ColForParam[ix] = jy;
+            ColForParam[iy] = jx;
+            NewCol[jx] = jy;
+            NewCol[jy] = jx;
         }
     }
+
+    // And move the entries, all at once.
+    for(k = 0; k < J.nonzeros; k++) {
+        J.col[k] = NewCol[J.col[k]];
+    }
 }
 
 //-----------------------------------------------------------------------------
-// Use Gauss-Jordan elimination to put our Jacobian in row-reduced echelon
-// form. This is used to determine which variables are bound vs. free.
+// If there's anything we're very insensitive to, then treat that as
+// completely insensitive. We will make these decisions in relative terms,
+// with respect to the magnitude of the row in which an entry appears;
+// otherwise, the threshold would change if the constraint equation were
+// multiplied by a constant.
 //-----------------------------------------------------------------------------
-static void GaussJordan(void)
+static void DropInsensitive(void)
 {
-    int i, j;
-
-//    dbp("before:");
-//    pmJ();
+    int i, k;
+    int nonzeros = 0;
 
-    // Initially, no variables are bound.
-    for(j = 0; j < J.N; j++) {
-        J.solvedFor[j] = FALSE;
-        J.assumed[j] = FALSE;
-    }
-
-    // If there's anything we're very insensitive to, then treat that as
-    // completely insensitive. We will make these decisions in relative
-    // terms, with respect to the magnitude of the row in which an entry
-    // appears; otherwise, the threshold would change if the constraint
-    // equation were multiplied by a constant.
     double angleFudge = 10000;
     for(i = 0; i < J.M; i++) {
+        int start = J.rowStart[i];
+        int end = J.rowStart[i+1];
+
         double mag = 0;
-        for(j = 0; j < J.N; j++) {
-            double v = J.num[i][j];
+        for(k = start; k < end; k++) {
+            double v = J.v[k];
             // Lengths are typically around 1 cm, or 10 000 um. Angles are
             // typically between 0 and 3.14. The angle parameter will cause
             // trouble because it's of a different order of magnitude, and
             // its sensitivities should therefore be fudged.
-            if(J.param[j] & THETA_FOR_LINE(0)) v /= angleFudge;
+            if(J.param[J.col[k]] & THETA_FOR_LINE(0)) v /= angleFudge;
 
             mag += v*v;
         }
         mag = sqrt(mag);
         // If a given unknown contributes no more than 1/200th of the
         // total sensitivity of this constraint, then we will treat it
-        // as completely insensitive.
+        // as completely insensitive. What's left gets packed down over
+        // what we dropped.
         double threshold = mag/200;
-        for(j = 0; j < J.N; j++) {
-            double v = J.num[i][j];
-            if(J.param[j] & THETA_FOR_LINE(0)) v /= angleFudge;
+        J.rowStart[i] = nonzeros;
+        for(k = start; k < end; k++) {
+            double v = J.v[k];
+            if(J.param[J.col[k]] & THETA_FOR_LINE(0)) v /= angleFudge;
 
-            if(fabs(v) < threshold) {
-                J.num[i][j] = 0;
-            }
+            if(fabs(v) < threshold) continue;
+
+            J.col[nonzeros] = J.col[k];
+            J.v[nonzeros] = J.v[k];
+            nonzeros++;
+        }
+    }
+    J.rowStart[J.M] = nonzeros;
+    J.nonzeros = nonzeros;
+}
+
+//-----------------------------------------------------------------------------
+// Set row a to c*a + s*b, and row b to c*b - s*a, merging the two by column.
+// The entry of b in column skip is the one that we're rotating away, so
+// that's left out, as exactly zero.
+//-----------------------------------------------------------------------------
+static void RotateRows(SparseRow *a, SparseRow *b, double c, double s,
+                            int skip)
+{
+    SparseRow *t = &(RQ.t);
+    SparseRow *u = &(RQ.u);
+    RESERVE(t->e, t->alloc, a->n + b->n);
+    RESERVE(u->e, u->alloc, a->n + b->n);
+    t->n = 0;
+    u->n = 0;
+
+    int i = 0, j = 0;
+    while(i < a->n || j < b->n) {
+        int col;
+        double va = 0, vb = 0;
+        if(j >= b->n || (i < a->n && a->e[i].col < b->e[j].col)) {
+            col = a->e[i].col;
+            va = a->e[i].v;
+            i++;
+        } else if(i >= a->n || b->e[j].col < a->e[i].col) {
+            col = b->e[j].col;
+            vb = b->e[j].v;
+            j++;
+        } else {
+            col = a->e[i].col;
+            va = a->e[i].v;
+            vb = b->e[j].v;
+            i++;
+            j++;
+        }
+
+        double vt = c*va + s*vb;
+        double vu = c*vb - s*va;
+        if(vt != 0) {
+            t->e[t->n].col = col;
+            t->e[t->n].v = vt;
+            (t->n)++;
+        }
+        if(vu != 0 && col != skip) {
+            u->e[u->n].col = col;
+            u->e[u->n].v = vu;
+            (u->n)++;
         }
     }
 
-    // Now eliminate.
-    i = 0;
+    SparseRow x;
+    x = *a; *a = *t; *t = x;
+    x = *b; *b = *u; *u = x;
+}
+
+//-----------------------------------------------------------------------------
+// Factor the Jacobian as A = Q*R, by Givens rotations. We take the rows of A
+// one at a time, and rotate each one against the rows of R that we have so
+// far, to zero its entries from the left, until either its first entry is in
+// a column that has no row of R, and it becomes that row of R; or nothing's
+// left of it, so it depended on the rows before it. That gives us the rank,
+// and which unknowns are bound: R is in echelon form, with the same row
+// space, so its first entries are where the pivots of the row-reduced
+// echelon form would be. All of that's done on the nonzeros, and the
+// rotations fill in only where two rows already overlap, so it's about as
+// sparse as the sketch is.
+//
+// If nullSpace is set, then we also apply the rotations to the rows of the
+// identity, to get Q'. The rows of that for the rows of A that rotated down
+// to nothing are an orthonormal basis for the left null space.
+//-----------------------------------------------------------------------------
+static void FactorJacobian(BOOL nullSpace)
+{
+    int i, j, k;
+    SparseRow *a = &(RQ.row);
+    SparseRow *aq = &(RQ.rowQ);
+
+    RESERVE(RQ.r, RQ.rAlloc, J.N);
+    if(nullSpace) RESERVE(RQ.q, RQ.qAlloc, J.N);
     for(j = 0; j < J.N; j++) {
-        // First, seek a pivot in our column.
-        int ip, imax;
-        double max = 0;
-        for(ip = i; ip < J.M; ip++) {
-            double v = fabs(J.num[ip][j]);
-            if(v > max) {
-                imax = ip;
-                max = v;
+        RQ.r[j].n = 0;
+        if(nullSpace) RQ.q[j].n = 0;
+
+        J.solvedFor[j] = FALSE;
+        J.assumed[j] = FALSE;
+    }
+    RQ.rank = 0;
+    RQ.nulls = 0;
+
+    for(i = 0; i < J.M; i++) {
+        // Get this row in order by column. The rows are short, so sort
+        // them by insertion.
+        RESERVE(a->e, a->alloc, J.rowStart[i+1] - J.rowStart[i]);
+        a->n = 0;
+        for(k = J.rowStart[i]; k < J.rowStart[i+1]; k++) {
+            if(J.v[k] == 0) continue;
+
+            int p = a->n;
+            while(p > 0 && a->e[p-1].col > J.col[k]) {
+                a->e[p] = a->e[p-1];
+                p--;
             }
+            a->e[p].col = J.col[k];
+            a->e[p].v = J.v[k];
+            (a->n)++;
+        }
+        if(nullSpace) {
+            RESERVE(aq->e, aq->alloc, 1);
+            aq->e[0].col = i;
+            aq->e[0].v = 1;
+            aq->n = 1;
         }
-        if(!ntol(max, 0)) {
-            // There's a usable pivot in this column. Swap it in:
-            int js;
-            for(js = j; js < J.N; js++) {
-                double temp;
-                temp = J.num[imax][js];
-                J.num[imax][js] = J.num[i][js];
-                J.num[i][js] = temp;
-            }
 
-            // Get a 1 as the leading entry in the row we're working on.
-            double v = J.num[i][j];
-            for(js = 0; js < J.N; js++) {
-                J.num[i][js] /= v;
+        BOOL independent = FALSE;
+        while(a->n > 0) {
+            j = a->e[0].col;
+            SparseRow *r = &(RQ.r[j]);
+
+            if(r->n > 0) {
+                // Rotate this row against that row of R, so as to zero
+                // its entry in column j.
+                double x = r->e[0].v, y = a->e[0].v;
+                double rho = sqrt(x*x + y*y);
+                RotateRows(r, a, x/rho, y/rho, j);
+                if(nullSpace) RotateRows(&(RQ.q[j]), aq, x/rho, y/rho, -1);
+                continue;
             }
 
-            // Eliminate this column from rows except this one.
-            int is;
-            for(is = 0; is < J.M; is++) {
-                if(is == i) continue;
-
-                // We're trying to drive J.num[is][j] to zero. We know
-                // that J.num[i][j] is 1, so we want to subtract off
-                // J.num[is][j] times our present row.
-                double v = J.num[is][j];
-                for(js = 0; js < J.N; js++) {
-                    J.num[is][js] -= v*J.num[i][js];
-                }
-                J.num[is][j] = 0;
+            // If what's left of the row is that small, then it's nothing.
+            double mag = 0;
+            for(k = 0; k < a->n; k++) {
+                mag += (a->e[k].v)*(a->e[k].v);
+            }
+            if(ntol(sqrt(mag), 0)) break;
+
+            if(ntol(a->e[0].v, 0)) {
+                // Too small to pivot on, so no unknown gets bound here;
+                // treat it as zero, and look at the rest of the row.
+                memmove(&(a->e[0]), &(a->e[1]), (a->n - 1)*sizeof(a->e[0]));
+                (a->n)--;
+                continue;
             }
 
-            // And mark this as a bound variable.
+            // This row is independent of those before it, so it becomes
+            // a row of R, and binds that unknown.
+            SparseRow x;
+            x = *r; *r = *a; *a = x;
+            if(nullSpace) {
+                x = RQ.q[j]; RQ.q[j] = *aq; *aq = x;
+            }
             J.solvedFor[j] = TRUE;
-
-            // Move on to the next row, since we just used this one to
-            // eliminate from column j.
-            i++;
-            if(i >= J.M) break;
+            (RQ.rank)++;
+            independent = TRUE;
+            break;
         }
+        if(independent) continue;
+
+        // The row depends on those before it; so its row of Q' is in the
+        // left null space. We only need those when there are few enough
+        // for one constraint to account for them; see
+        // RemovingRestoresRank().
+        if(nullSpace && RQ.nulls < MAX_ROWS_FOR_CONSTRAINT) {
+            RESERVE(RQ.z, RQ.zAlloc, (RQ.nulls + 1)*J.M);
+            double *z = &(RQ.z[(RQ.nulls)*J.M]);
+            for(k = 0; k < J.M; k++) {
+                z[k] = 0;
+            }
+            for(k = 0; k < aq->n; k++) {
+                z[aq->e[k].col] = aq->e[k].v;
+            }
+        }
+        (RQ.nulls)++;
     }
-
-//    dbp("all done:");
-//    pmJ();
 }
 
 //-----------------------------------------------------------------------------
-// Write the Jacobian matrix, and then put it in rref. We use those parameters
+// Write the Jacobian matrix, by rows of nonzeros. We use those parameters
 // that are marked as unknown, and those equations that are not yet assigned
-// to a subsystem.
+// to a subsystem. What gets done with it after that is up to the caller.
 //-----------------------------------------------------------------------------
-static void WriteJacobian(BOOL skipOne, hConstraint toSkip)
+static void WriteJacobian(void)
 {
-
-    int i, j;
+    int i, j, k;
 
     // Write our list of equations
+    RESERVE(J.eq, J.eqAlloc, EQ->eqns);
     J.M = 0;
     for(i = 0; i < EQ->eqns; i++) {
         if(EQ->eqn[i].subSys >= 0) continue;
-        if(skipOne) {
-            if(CONSTRAINT_FOR_EQUATION(EQ->eqn[i].he) == toSkip) continue;
-        }
 
-        if(J.M >= MAX_UNKNOWNS_AT_ONCE) return;
         J.eq[J.M] = i;
         (J.M)++;
     }
 
     // And then our list of unknowns
+    RESERVE(J.param, J.paramAlloc, SK->params);
+    RESERVE(J.solvedFor, J.solvedForAlloc, SK->params);
+    RESERVE(J.assumed, J.assumedAlloc, SK->params);
+    RESERVE(ColForParam, ColForParamAlloc, SK->params);
+    RESERVE(PosInRow, PosInRowAlloc, SK->params);
+    RESERVE(ParamValue, ParamValueAlloc, SK->params);
+    for(i = 0; i < SK->params; i++) {
+        ColForParam[i] = -1;
+    }
     J.N = 0;
     for(i = SK->params - 1; i >= 0; i--) {
         if(SK->param[i].known) continue;
 
-        if(J.N >= MAX_UNKNOWNS_AT_ONCE) return;
         J.param[J.N] = SK->param[i].id;
+        ColForParam[i] = J.N;
+        PosInRow[J.N] = -1;
         (J.N)++;
     }
 
-    // Write the Jacobian, first symbolically then numerically (about the 
-    // current guessed solution).
+    // Write the Jacobian numerically, about the current guessed solution.
+    // Each row is the gradient of one equation, so we can get the whole
+    // row with a single reverse-mode pass over that equation, instead of
+    // differentiating once per unknown.
+    GetParamValues(ParamValue);
+    RESERVE(J.rowStart, J.rowStartAlloc, J.M + 1);
+    J.nonzeros = 0;
     for(i = 0; i < J.M; i++) {
-        for(j = 0; j < J.N; j++) {
-            int eq = J.eq[i];
-            hParam p = J.param[j];
-
-            if(EIndependentOf(EQ->eqn[eq].e, p)) {
-                J.sym[i][j] = EConstant(0);
-                J.num[i][j] = 0;
-            } else {
-                J.sym[i][j] = EPartial(EQ->eqn[eq].e, p);
-                J.num[i][j] = EEval(J.sym[i][j]);
+        ExprArenaMark m = EArenaMark();
+
+        J.rowStart[i] = J.nonzeros;
+
+        ExprTape t;
+        ECompileTape(&t, &(EQ->eqn[J.eq[i]].e), 1);
+        t.value = ParamValue;
+        EEvalTapeReverse(&t);
+
+        // At most one nonzero per instruction, so make room for that.
+        RESERVE(J.col, J.colAlloc, J.nonzeros + t.instrs);
+        RESERVE(J.v, J.vAlloc, J.nonzeros + t.instrs);
+        for(k = 0; k < t.instrs; k++) {
+            if(t.instr[k].op != EXPR_PARAM) continue;
+
+            j = ColForParam[t.instr[k].a];
+            if(j < 0) continue;
+
+            int pos = PosInRow[j];
+            if(pos < 0) {
+                pos = J.nonzeros;
+                J.col[pos] = j;
+                J.v[pos] = 0;
+                PosInRow[j] = pos;
+                (J.nonzeros)++;
             }
+            J.v[pos] += t.grad[k];
         }
-    }
-
-    MostSensitiveCoordinateFirst();
-
-    GaussJordan();
-}
-
-//-----------------------------------------------------------------------------
-// Is there a row of all zeros in the Jacobian? This means that some set of
-// constraint equations was linearly dependent, which means that those
-// constraints are either redundant or inconsistent. In either case, this
-// is an error that we wish to flag.
-//-----------------------------------------------------------------------------
-static BOOL RowOfAllZeros(void)
-{
-    int i, j;
-    for(i = 0; i < J.M; i++) {
-        for(j = 0; j < J.N; j++) {
-            if(!ntol(J.num[i][j], 0)) break;
+        for(k = J.rowStart[i]; k < J.nonzeros; k++) {
+            PosInRow[J.col[k]] = -1;
         }
-        if(j >= J.N) return TRUE;
-    }
 
-    return FALSE;
+        EArenaRelease(m);
+    }
+    J.rowStart[J.M] = J.nonzeros;
 }
 
 //-----------------------------------------------------------------------------
@@ -523,9 +836,89 @@ static void DescribeConstraint(hConstraint hc)
     memcpy(desc, s, strlen(s));
     uiAddToConstraintsList(desc);
 }
+static int ByConstraint(const void *a, const void *b)
+{
+    hConstraint ha = ((ConstraintRow *)a)->hc;
+    hConstraint hb = ((ConstraintRow *)b)->hc;
+
+    if(ha < hb) return -1;
+    if(ha > hb) return 1;
+    return ((ConstraintRow *)a)->row - ((ConstraintRow *)b)->row;
+}
+
+//-----------------------------------------------------------------------------
+// Would removing the equations of this constraint make the others
+// independent? Any dependency among the others would be a vector in the
+// left null space that's zero for this constraint's equations; so that's
+// if this constraint's part of the null space has full rank. This only
+// reads the factors, so it can run on any thread.
+//-----------------------------------------------------------------------------
+static BOOL RemovingRestoresRank(hConstraint hc, RankScratch *w)
+{
+    int i, j, k;
+    int n = RQ.nulls;
+
+    // Find the first of this constraint's rows.
+    int lo = 0, hi = J.M;
+    while(lo < hi) {
+        int mid = (lo + hi)/2;
+        if(RQ.byConstraint[mid].hc < hc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int m = 0;
+    for(; lo < J.M && RQ.byConstraint[lo].hc == hc; lo++) {
+        if(m >= MAX_ROWS_FOR_CONSTRAINT) oops();
+
+        int row = RQ.byConstraint[lo].row;
+        for(j = 0; j < n; j++) {
+            w->s[m][j] = RQ.z[j*J.M + row];
+        }
+        m++;
+    }
+    // A constraint that's not in the Jacobian can't help.
+    if(m == 0 || m < n) return FALSE;
+
+    // Eliminate, with partial pivoting, to find its rank.
+    for(j = 0; j < n; j++) {
+        int imax = j;
+        for(i = j; i < m; i++) {
+            if(fabs(w->s[i][j]) > fabs(w->s[imax][j])) imax = i;
+        }
+        if(fabs(w->s[imax][j]) < 1e-6) return FALSE;
+
+        for(k = j; k < n; k++) {
+            double t = w->s[imax][k];
+            w->s[imax][k] = w->s[j][k];
+            w->s[j][k] = t;
+        }
+        for(i = j + 1; i < m; i++) {
+            double v = w->s[i][j]/w->s[j][j];
+            for(k = j; k < n; k++) {
+                w->s[i][k] -= v*w->s[j][k];
+            }
+        }
+    }
+    return TRUE;
+}
+
+static void RemovalJob(int job, int worker)
+{
+    Removable[job] =
+        RemovingRestoresRank(SK->constraint[job].id, &Scratch[worker]);
+}
+
 static void FindConstraintsToRemoveForConsistency(void)
 {
-    uiClearConstraintsList();
+    if(SC->ui) {
+        uiClearConstraintsList();
+    } else {
+        SC->report->inconsistent = TRUE;
+        SC->report->removables = 0;
+    }
 
     // We must regenerate the equations, because we got them with the
     // forward-substitutions already made. We should ignore those, or
@@ -534,16 +927,89 @@ static void FindConstraintsToRemoveForConsistency(void)
     GenerateEquationsToSolve();
     MarkUnknowns();
 
+    // Then factor the Jacobian once, instead of writing and reducing it
+    // again without each constraint in turn. We don't care which unknowns
+    // are bound here, so there's no need to reorder the columns for that.
+    WriteJacobian();
+    DropInsensitive();
+    FactorJacobian(TRUE);
+    dbp2("jacobian has rank %d, %d dependencies", RQ.rank, RQ.nulls);
+    // Without the substitutions, the equations might be independent after
+    // all; then there's no one constraint to blame, so list none. And if
+    // there are more dependencies than any one constraint has equations,
+    // then removing any one constraint can't fix them all.
+    if(RQ.nulls == 0) return;
+    if(RQ.nulls > MAX_ROWS_FOR_CONSTRAINT) return;
+
     int i;
+    RESERVE(RQ.byConstraint, RQ.byConstraintAlloc, J.M);
+    for(i = 0; i < J.M; i++) {
+        RQ.byConstraint[i].hc = CONSTRAINT_FOR_EQUATION(EQ->eqn[J.eq[i]].he);
+        RQ.byConstraint[i].row = i;
+    }
+    qsort(RQ.byConstraint, J.M, sizeof(RQ.byConstraint[0]), ByConstraint);
+
+    // Every constraint can be tested independently, so share those out
+    // among the threads; the results are listed in order afterwards, so
+    // they come out the same either way.
+    int workers = WorkerThreads();
+    if(Scratches < workers) {
+        DFree(Scratch);
+        Scratch = (RankScratch *)DAlloc(workers*sizeof(RankScratch));
+        if(!Scratch) oops();
+        Scratches = workers;
+    }
+    RESERVE(Removable, RemovableAlloc, SK->constraints);
+
+    int work = J.M*RQ.nulls*RQ.nulls;
+    if(workers > 1 && work >= MIN_PARALLEL_RANK_WORK) {
+        RunInParallel(RemovalJob, SK->constraints);
+    } else {
+        for(i = 0; i < SK->constraints; i++) {
+            RemovalJob(i, 0);
+        }
+    }
+
     for(i = 0; i < SK->constraints; i++) {
-        hConstraint hc = SK->constraint[i].id;
+        if(!Removable[i]) continue;
+
+        // This one fixes the problem.
+        if(SC->ui) {
+            DescribeConstraint(SK->constraint[i].id);
+        } else {
+            SolverReport *r = SC->report;
+            RESERVE(r->removable, r->removableAlloc, r->removables + 1);
+            r->removable[r->removables++] = SK->constraint[i].id;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Show the user what a solve of their sketch in the background found, just
+// as it would have shown them if it had run here.
+//-----------------------------------------------------------------------------
+void ShowSolverReport(SolverReport *r)
+{
+    int i;
 
-        WriteJacobian(TRUE, hc);
-        if(!RowOfAllZeros()) {
-            // This one fixes the problem.
-            DescribeConstraint(hc);
+    if(r->newLists) {
+        uiClearAssumptionsList();
+        for(i = 0; i < r->assumeds; i++) {
+            uiAddToAssumptionsList(StringForParam(r->assumed[i]));
+        }
+    }
+    if(r->newLists || r->inconsistent) {
+        uiClearConstraintsList();
+        for(i = 0; i < r->removables; i++) {
+            DescribeConstraint(r->removable[i]);
         }
     }
+    if(r->status) {
+        uiSetConsistencyStatusText(r->status, r->statusBk);
+    }
+    if(r->stop) {
+        StopSolving();
+    }
 }
 
 //-----------------------------------------------------------------------------
@@ -559,11 +1025,10 @@ static void FindConstraintsToRemoveForConsistency(void)
 static double LeastSquaresXSensitivity(int jsens)
 {
     int i, j, r, c;
-    // Get the Jacobian again, in un-row-reduced numerical form.
-    for(i = 0; i < J.M; i++) {
-        for(j = 0; j < J.N; j++) {
-            J.num[i][j] = EEval(J.sym[i][j]);
-        }
+    // We need the Jacobian again, in un-row-reduced numerical form. This
+    // writes it dense, so it's no good for big systems anyways.
+    if(J.M > MAX_UNKNOWNS_AT_ONCE || J.N > MAX_UNKNOWNS_AT_ONCE) {
+        return VERY_POSITIVE;
     }
 
     // Imagine that a small change occurs in the parameter corresponding to
@@ -574,7 +1039,7 @@ static double LeastSquaresXSensitivity(int jsens)
     
     AH.rows = J.M;
     for(r = 0; r < J.M; r++) {
-        AH.b[r] = -J.num[r][jsens];
+        AH.b[r] = -JacobianAt(r, jsens);
     }
 
     for(r = 0; r < J.M; r++) {
@@ -583,7 +1048,7 @@ static double LeastSquaresXSensitivity(int jsens)
             if(J.assumed[j]) continue;
             if(j == jsens) continue;
 
-            AH.A[r][c] = J.num[r][j];
+            AH.A[r][c] = JacobianAt(r, j);
             c++;
         }
     }
@@ -593,14 +1058,12 @@ static double LeastSquaresXSensitivity(int jsens)
     // solve. This gives us x such that A*x = b, with the smallest possible
     // norm(x).
 
-    // Write A*A'
+    // Write A*A', which is symmetric.
     for(r = 0; r < AH.rows; r++) {
-        for(c = 0; c < AH.rows; c++) {  // yes, AAt is square
-            double sum = 0;
-            for(i = 0; i < AH.cols; i++) {
-                sum += AH.A[r][i]*AH.A[c][i];
-            }
+        for(c = r; c < AH.rows; c++) {  // yes, AAt is square
+            double sum = VecDot(AH.A[r], AH.A[c], AH.cols);
             AH.AAt[r][c] = sum;
+            AH.AAt[c][r] = sum;
         }
     }
 
@@ -631,20 +1094,10 @@ static void AssumeForCompletelyUnconstrained(int *assumed)
 {
     int i;
     
-    for(i = 0; i < SK->params; i++) {
-        SK->param[i].mark = 0;
-    }
-
-    for(i = 0; i < EQ->eqns; i++) {
-        // If an equation has already been solved by substitution, then we
-        // shouldn't consider that.
-        if(EQ->eqn[i].subSys < 0) {
-            EMark(EQ->eqn[i].e, 1);
-        }
-    }
     for(i = 0; i < SK->params; i++) {
         SketchParam *p = &(SK->param[i]);
-        if(p->mark == 0 && !(p->known)) {
+        // Equations that were already solved by substitution don't count.
+        if(!(p->known) && !ParamAppearsInUnsolvedEquation(i)) {
             // We've never seen it, so it appears in none of the equations,
             // so we should assume something for it and mark it as known.
             p->known = TRUE;
@@ -661,15 +1114,25 @@ BOOL Assume(int *assumed)
 {
     AssumeForCompletelyUnconstrained(assumed);
 
-    WriteJacobian(FALSE, 0);
-
-    if(J.M > MAX_UNKNOWNS_AT_ONCE || J.N > MAX_UNKNOWNS_AT_ONCE) return FALSE;
+    // Put the more sensitive coordinate of each point first, so that it's
+    // the one that gets solved for, and then factor to see which unknowns
+    // are bound.
+    WriteJacobian();
+    MostSensitiveCoordinateFirst();
+    DropInsensitive();
+    FactorJacobian(FALSE);
 
-    if(RowOfAllZeros()) {
+    // If the equations are linearly dependent, then the constraints are
+    // either redundant or inconsistent. In either case, this is an error
+    // that we wish to flag.
+    if(RQ.rank < J.M) {
         dbp((char*)"jacobian does not have full rank (%d eqs by %d params)", J.M,
             J.N);
-        FindConstraintsToRemoveForConsistency();
-        StopSolving();
+        // Only a sketch that someone's looking at has a user to tell.
+        if(SC->ui || SC->report) {
+            FindConstraintsToRemoveForConsistency();
+            ReportStopSolving();
+        }
         return FALSE;
     }
 
@@ -27,18 +27,11 @@
 
 static void ModifyConstraintToReflectSketch(SketchConstraint *c);
 
-Equations EQalloc;
-Equations *EQ = (Equations *)&EQalloc;
-
 static void AddConstraint(SketchConstraint *c)
 {
     SK->eqnsDirty = TRUE;
     UndoRemember();
 
-    if(SK->constraints >= MAX_CONSTRAINTS_IN_SKETCH) {
-        uiError("Too many constraints!");
-        return;
-    }
 
     hConstraint max = 0;
     int i;
@@ -48,6 +41,8 @@ static void AddConstraint(SketchConstraint *c)
         }
     }
 
+    RESERVE(SK->constraint, SK->constraintsAlloc, SK->constraints + 1);
+
     memcpy(&(SK->constraint[SK->constraints]), c, sizeof(*c));
     SK->constraint[SK->constraints].id = (max + 1);
     SK->constraint[SK->constraints].layer = GetCurrentLayer();
@@ -102,11 +97,11 @@ SketchConstraint *ConstraintById(hConstraint hc)
 }
 
 //-----------------------------------------------------------------------------
-// Change the numerical value associated with certain types of constraints
-// (e.g. distances and lengths). If we're solving, then we will do this in
-// multiple steps, to decrease the odds of numerical disaster.
+// Work out the numerical value for certain types of constraints (e.g.
+// distances and lengths) from a string, as the user would type it. Returns
+// FALSE if this constraint doesn't have a value.
 //-----------------------------------------------------------------------------
-void ChangeConstraintValue(SketchConstraint *c, char *str)
+BOOL ConstraintValueFromString(SketchConstraint *c, char *str, double *v)
 {
     double nv;
 
@@ -144,6 +139,35 @@ void ChangeConstraintValue(SketchConstraint *c, char *str)
     {
         nv = fabs(atof(str));
     } else {
+        return FALSE;
+    }
+
+    *v = nv;
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// How many steps to take when changing a value from cv0 to nv, so that each
+// solve starts close to its solution.
+//-----------------------------------------------------------------------------
+int ConstraintValueSteps(double cv0, double nv)
+{
+    int n = toint(fabs((nv - cv0)) / 5000);
+    if(n > 15) n = 15;
+    if(n < 5) n = 5;
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Change the numerical value associated with a constraint. If we're
+// solving, then we will do this in multiple steps, to decrease the odds of
+// numerical disaster.
+//-----------------------------------------------------------------------------
+void ChangeConstraintValue(SketchConstraint *c, char *str)
+{
+    double nv;
+
+    if(!ConstraintValueFromString(c, str, &nv)) {
         oopsnf();
         return;
     }
@@ -151,14 +175,15 @@ void ChangeConstraintValue(SketchConstraint *c, char *str)
     double cv0 = c->v;
 
     int i;
-    int n = toint(fabs((nv - cv0)) / 5000);
-    if(n > 15) n = 15;
-    if(n < 5) n = 5;
+    int n = ConstraintValueSteps(cv0, nv);
 
-    // Step the dimension to the requested value.
+    // Step the dimension to the requested value. The equations read the
+    // dimension when they're evaluated, so if we're solving then nothing
+    // else changed, and the solver can re-use its last solution as though
+    // we were dragging.
     for(i = n; i >= 0; i--) {
         c->v = nv + (i*(cv0 - nv))/n;
-        SolvePerMode(FALSE);
+        SolvePerMode(SolvingState == SOLVING_AUTOMATICALLY);
     }
 }
 
@@ -778,10 +803,11 @@ static Expr *EDistanceFromPointToLine(hPoint pt, hLine ln, hEntity e)
 
 static void AddEquation(hConstraint hc, int k, Expr *e)
 {
-    if(EQ->eqns >= arraylen(EQ->eqn)) oops();
+    RESERVE(EQ->eqn, EQ->eqnsAlloc, EQ->eqns + 1);
 
     EQ->eqn[EQ->eqns].e  = e;
     EQ->eqn[EQ->eqns].he = EQUATION_FOR_CONSTRAINT(hc, k);
+    EQ->eqn[EQ->eqns].fingerprintValid = FALSE;
 
     (EQ->eqns)++;
 }
@@ -809,7 +835,7 @@ static void Make_PtPtDistance(SketchConstraint *c)
     } else {
         Expr *d = EDistance(c->ptA, c->ptB);
 
-        AddEquation(c->id, 0, EMinus(d, EConstant(c->v)));
+        AddEquation(c->id, 0, EMinus(d, EDimension(c->id)));
     }
 }
 
@@ -817,7 +843,7 @@ static void Make_PtLineDistance(SketchConstraint *c)
 {
     Expr *d = EDistanceFromPointToLine(c->ptA, c->lineB, c->entityB);
 
-    AddEquation(c->id, 0, EMinus(d, EConstant(c->v)));
+    AddEquation(c->id, 0, EMinus(d, EDimension(c->id)));
 }
 
 static void Make_LineLineDistance(SketchConstraint *c)
@@ -841,7 +867,7 @@ static void Make_LineLineDistance(SketchConstraint *c)
         d = EDistanceFromExprPointToLine(x0, y0, c->lineB, 0);
     }
 
-    AddEquation(c->id, 0, EMinus(d, EConstant(c->v)));
+    AddEquation(c->id, 0, EMinus(d, EDimension(c->id)));
 }
 
 static void Make_Angle(SketchConstraint *c)
@@ -854,12 +880,13 @@ static void Make_Angle(SketchConstraint *c)
 
 
     // Rotate one of the vectors by the desired angle
-    double theta = (c->v)*PI/180;
+    Expr *theta = EDiv(ETimes(EDimension(c->id), EConstant(PI)),
+                       EConstant(180));
     Expr *dxr, *dyr;
-    dxr = EPlus(ETimes(EConstant( cos(theta)), dxA),
-                ETimes(EConstant( sin(theta)), dyA));
-    dyr = EPlus(ETimes(EConstant(-sin(theta)), dxA),
-                ETimes(EConstant( cos(theta)), dyA));
+    dxr = EPlus(ETimes(ECos(theta), dxA),
+                ETimes(ESin(theta), dyA));
+    dyr = EPlus(ETimes(ENegate(ESin(theta)), dxA),
+                ETimes(ECos(theta), dyA));
 
     // And we are trying to make them parallel, i.e. to cause
     //     [  dxr   dyr  ]
@@ -939,7 +966,7 @@ static void Make_Radius(SketchConstraint *c)
     // We work with the radius internally, but the user enters the diameter;
     // so the radii that we get from the sketch get multiplied by two before
     // we compare them.
-    AddEquation(c->id, 0, EMinus(ETimes(EConstant(2), r), EConstant(c->v)));
+    AddEquation(c->id, 0, EMinus(ETimes(EConstant(2), r), EDimension(c->id)));
 }
 
 static void Make_EqualRadius(SketchConstraint *c)
@@ -1073,12 +1100,12 @@ static void Make_Scale(SketchConstraint *c)
         oopsnf();
         return;
     }
-    dy *= c->v;
 
     hPoint pA = POINT_FOR_ENTITY(c->entityA, 0);
     hPoint pB = POINT_FOR_ENTITY(c->entityA, 1);
 
-    AddEquation(c->id, 0, EMinus(EDistance(pA, pB), EConstant(dy)));
+    AddEquation(c->id, 0, EMinus(EDistance(pA, pB),
+                                 ETimes(EConstant(dy), EDimension(c->id))));
 }
 
 void MakeConstraintEquations(SketchConstraint *c)
@@ -64,10 +64,9 @@ static void AddCurve(SketchCurve *c)
     c->construction = e->construction;
 
     int i = SK->curves;
-    if(i < (MAX_CURVES_IN_SKETCH-1)) {
-        memcpy(&(SK->curve[i]), c, sizeof(*c));
-        SK->curves = i + 1;
-    }
+    RESERVE(SK->curve, SK->curvesAlloc, i + 1);
+    memcpy(&(SK->curve[i]), c, sizeof(*c));
+    SK->curves = i + 1;
 }
 
 static void AddBezierCubic(hEntity he, double *x, double *y)
@@ -593,7 +592,7 @@ static void AddPwl(hEntity id, hLayer layer, BOOL construction,
 {
     int i = SK->pwls;
     
-    if(i >= (MAX_PWLS_IN_SKETCH-1)) return;
+    RESERVE(SK->pwl, SK->pwlsAlloc, i + 1);
 
     SketchPwl *p = &(SK->pwl[i]);
 
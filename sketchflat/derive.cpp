@@ -647,13 +647,14 @@ void ButtonHideAllDerivedItems(void)
 // Erase DL->poly[], freeing anything that was allocated dynamically and then
 // zeroing it back out.
 //-----------------------------------------------------------------------------
-static void EraseAllPolys(void)
+void EraseAllPolys(void)
 {
     int i, j;
     for(i = 0; i < DL->polys; i++) {
         for(j = 0; j < DL->poly[i].p.curves; j++) {
             DFree(DL->poly[i].p.curve[j].pt);
         }
+        if(DL->poly[i].p.curve) DFree(DL->poly[i].p.curve);
     }
 
     memset(DL->poly, 0, sizeof(DL->poly));
@@ -28,11 +28,12 @@ typedef struct {
 } DClosedCurve;
 
 // A polygon contains one or more closed curves. (It's not necessarily
-// simple, so not just one.)
-#define MAX_CLOSED_CURVES_IN_POLYGON 2048
+// simple, so not just one.) The curve array grows as needed, and is freed
+// along with the points when the derived polygons are erased.
 typedef struct {
-    DClosedCurve     curve[MAX_CLOSED_CURVES_IN_POLYGON];
+    DClosedCurve    *curve;
     int              curves;
+    int              curvesAlloc;
 } DPolygon;
 
 // Types of derived elements.
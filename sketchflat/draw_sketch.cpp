@@ -95,12 +95,24 @@ static void CheckHover(int xPixels, int yPixels, DWORD mask);
 //-----------------------------------------------------------------------------
 void SolvePerMode(BOOL dragging)
 {
+    if(!dragging) {
+        // Something other than the parameters might have changed, so the
+        // solver can't re-use its last solution.
+        ForgetDragPlan();
+    }
     if(SolvingState == NOT_SOLVING_AFTER_PROBLEM && !dragging) {
         SolvingState = SOLVING_AUTOMATICALLY;
         UpdateStatusBar();
     }
     if(SolvingState == SOLVING_AUTOMATICALLY) {
-        Solve();
+        // In the background if we can, drawing what we've got until that's
+        // done. Else while dragging (or stepping a dimension), only what
+        // depends on what moved changes, so try to solve just that.
+        if(!SolveInBackground(dragging)) {
+            if(!dragging || !SolveDragged()) {
+                Solve();
+            }
+        }
     }
     uiRepaint();
 }
@@ -1334,7 +1346,10 @@ void SketchLeftButtonDown(int x, int y)
             break;
 
         case OPERATION_DRAGGING_PT_ON_SPLINE:
-            SketchAddPointToCubicSpline(Dragging.entity);
+            if(!SketchAddPointToCubicSpline(Dragging.entity)) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             Dragging.i += 2;
             Dragging.point = POINT_FOR_ENTITY(Dragging.entity, Dragging.i+3);
             // And we're still dragging.
@@ -1353,6 +1368,10 @@ void SketchLeftButtonDown(int x, int y)
             {
                 // Let's make it easy to draw polylines.
                 he = SketchAddEntity(ENTITY_LINE_SEGMENT);
+                if(!he) {
+                    CurrentOperation = OPERATION_NONE;
+                    break;
+                }
                 ForcePoint(POINT_FOR_ENTITY(he, 0),
                                             toMicronsX(x), toMicronsY(y));
                 ConstrainCoincident(POINT_FOR_ENTITY(he, 0), Dragging.point);
@@ -1373,12 +1392,20 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_DATUM_POINT:
             he = SketchAddEntity(ENTITY_DATUM_POINT);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_NONE;
             break;
 
         case MNU_DRAW_DATUM_LINE:
             he = SketchAddEntity(ENTITY_DATUM_LINE);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             CurrentOperation = OPERATION_DRAGGING_LINE;
             Dragging.ref.x = toMicronsX(x);
             Dragging.ref.y = toMicronsY(y);
@@ -1387,6 +1414,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_LINE_SEGMENT:
             he = SketchAddEntity(ENTITY_LINE_SEGMENT);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_DRAGGING_PT;
             Dragging.point = POINT_FOR_ENTITY(he, 1);
@@ -1394,6 +1425,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_CIRCLE:
             he = SketchAddEntity(ENTITY_CIRCLE);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_DRAGGING_RADIUS;
             Dragging.param = PARAM_FOR_ENTITY(he, 0);
@@ -1403,6 +1438,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_ARC:
             he = SketchAddEntity(ENTITY_CIRCULAR_ARC);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_DRAGGING_PT_ON_ARC;
             Dragging.point = POINT_FOR_ENTITY(he, 1);
@@ -1411,6 +1450,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_CUBIC_SPLINE:
             he = SketchAddEntity(ENTITY_CUBIC_SPLINE);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_DRAGGING_PT_ON_SPLINE;
             Dragging.point = POINT_FOR_ENTITY(he, 3);
@@ -1420,6 +1463,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_TEXT:
             he = SketchAddEntity(ENTITY_TTF_TEXT);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             CurrentOperation = OPERATION_DRAGGING_PT;
             Dragging.point = POINT_FOR_ENTITY(he, 1);
@@ -1427,6 +1474,10 @@ void SketchLeftButtonDown(int x, int y)
 
         case MNU_DRAW_FROM_IMPORTED:
             he = SketchAddEntity(ENTITY_IMPORTED);
+            if(!he) {
+                CurrentOperation = OPERATION_NONE;
+                break;
+            }
             PlacePoint(POINT_FOR_ENTITY(he, 0), x, y);
             // Now let the user choose the file to import.
             ChooseFileForImported(EntityById(he));
@@ -266,3 +266,259 @@ void MenuExport(int id)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Export a file without asking anything, with the type of file chosen from
+// its extension. G code needs the depths and feeds, so that's not possible.
+//-----------------------------------------------------------------------------
+static int ExportByExtension(char *file)
+{
+    char *ext = strrchr(file, '.');
+    if(!ext) return RESULT_FAILED;
+
+    if(stricmp(ext, ".dxf") == 0) {
+        return ExportAsDxf(file);
+    } else if(stricmp(ext, ".plt") == 0 || stricmp(ext, ".hpgl") == 0) {
+        return ExportAsHpgl(file);
+    } else {
+        return RESULT_FAILED;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// The rows of a design table, and what solving them gave. The rows are
+// solved in runs of consecutive rows, one run per worker thread, each on a
+// copy of the sketch in its own solver context; within a run, each row
+// starts from the solution for the one before, so the solver only has to
+// solve again the blocks that read a changed dimension.
+//-----------------------------------------------------------------------------
+typedef struct {
+    char        file[MAX_PATH];
+    // FALSE if the row couldn't be read, so there's nothing to solve.
+    BOOL        read;
+    BOOL        solved;
+} TableRow;
+typedef struct {
+    SolverContext   *sc;
+    // The values of the dimensions before the row being solved.
+    double          *from;
+    int             fromAlloc;
+} TableRun;
+static struct {
+    hConstraint     *column;
+    int             columnAlloc;
+    int             columns;
+
+    TableRow        *row;
+    int             rowAlloc;
+    int             rows;
+    // The value of column j in row r is v[r*columns + j].
+    double          *v;
+    int             vAlloc;
+    // And once that row has solved, its parameter i is param[r*params + i].
+    double          *param;
+    int             paramAlloc;
+    int             params;
+
+    TableRun        *run;
+    int             runAlloc;
+    int             runs;
+} Table;
+
+//-----------------------------------------------------------------------------
+// Solve one row of the table, in whatever solver context is current; step
+// all of the dimensions together, as ChangeConstraintValue() does for just
+// one. If that fails, then go back to the last row that worked, so that the
+// next one can carry on from there.
+//-----------------------------------------------------------------------------
+static BOOL SolveTableRow(int r, TableRun *run)
+{
+    double *nv = &(Table.v[r*Table.columns]);
+    int i, j;
+
+    RESERVE(run->from, run->fromAlloc, Table.columns);
+    int n = 0;
+    for(j = 0; j < Table.columns; j++) {
+        run->from[j] = ConstraintById(Table.column[j])->v;
+        int steps = ConstraintValueSteps(run->from[j], nv[j]);
+        if(steps > n) n = steps;
+    }
+    for(i = n; i >= 0; i--) {
+        for(j = 0; j < Table.columns; j++) {
+            ConstraintById(Table.column[j])->v =
+                                nv[j] + (i*(run->from[j] - nv[j]))/n;
+        }
+        if(!SolveDragged() && !Solve()) break;
+    }
+    if(i >= 0 || SK->params != Table.params) {
+        for(j = 0; j < Table.columns; j++) {
+            ConstraintById(Table.column[j])->v = run->from[j];
+        }
+        Solve();
+        return FALSE;
+    }
+
+    double *dest = &(Table.param[r*Table.params]);
+    for(i = 0; i < SK->params; i++) {
+        dest[i] = SK->param[i].v;
+    }
+    return TRUE;
+}
+
+static void SolveTableRun(int k, int worker)
+{
+    TableRun *run = &(Table.run[k]);
+    SolverContext *was = UseSolverContext(run->sc);
+
+    int first = (k*Table.rows)/Table.runs;
+    int last = ((k + 1)*Table.rows)/Table.runs;
+    int r;
+    for(r = first; r < last; r++) {
+        TableRow *tr = &(Table.row[r]);
+        if(!tr->read) continue;
+
+        tr->solved = SolveTableRow(r, run);
+    }
+
+    UseSolverContext(was);
+}
+
+//-----------------------------------------------------------------------------
+// Solve and export a family of parts, one for each row of a design table,
+// without any interaction. The table is a text file. Its first line lists
+// the constraints to change, by their ids as in the .skf file. Each line
+// after that names a file to export, and gives a value for each of those
+// constraints, in the form that the user would type it:
+//
+//      constraints     00000003    00000007
+//      small.dxf       10          25
+//      large.plt       20          50
+//
+// Blank lines and lines starting with # are ignored. The rows are all read
+// first, and then solved in parallel as above; the curves and the exported
+// files are made here afterwards, in order, since that's not safe to do on
+// any thread but this one. Returns the number of rows that couldn't be
+// exported, or -1 if the table itself is no good.
+//-----------------------------------------------------------------------------
+int ExportDesignTable(char *table)
+{
+    int i, j, k, r;
+    int failed = 0;
+    char line[MAX_STRING*4];
+
+    FILE *f = fopen(table, "r");
+    if(!f) return -1;
+
+    // Start from a solution, so that there's something to solve from.
+    if(!Solve()) {
+        fclose(f);
+        return -1;
+    }
+
+    Table.columns = -1;
+    Table.rows = 0;
+    while(fgets(line, sizeof(line), f)) {
+        char *tok = strtok(line, " \t\r\n");
+        if(!tok || *tok == '#') continue;
+
+        if(Table.columns < 0) {
+            // The header, with the constraints.
+            if(strcmp(tok, "constraints") != 0) goto badTable;
+
+            Table.columns = 0;
+            while((tok = strtok(NULL, " \t\r\n"))) {
+                hConstraint hc = 0;
+                sscanf(tok, "%x", &hc);
+                SketchConstraint *c = NULL;
+                for(i = 0; i < SK->constraints; i++) {
+                    if(SK->constraint[i].id == hc) {
+                        c = &(SK->constraint[i]);
+                    }
+                }
+                if(!c || !ConstraintHasLabelAssociated(c)) {
+                    dbp("design table: no dimension %s", tok);
+                    goto badTable;
+                }
+                RESERVE(Table.column, Table.columnAlloc, Table.columns + 1);
+                Table.column[Table.columns++] = hc;
+            }
+            continue;
+        }
+
+        r = Table.rows;
+        RESERVE(Table.row, Table.rowAlloc, r + 1);
+        RESERVE(Table.v, Table.vAlloc, (r + 1)*Table.columns);
+        Table.rows = r + 1;
+
+        TableRow *tr = &(Table.row[r]);
+        strncpy(tr->file, tok, sizeof(tr->file) - 1);
+        tr->file[sizeof(tr->file) - 1] = '\0';
+        tr->solved = FALSE;
+        for(j = 0; j < Table.columns; j++) {
+            tok = strtok(NULL, " \t\r\n");
+            if(!tok) break;
+            SketchConstraint *c = ConstraintById(Table.column[j]);
+            if(!ConstraintValueFromString(c, tok,
+                                    &(Table.v[r*Table.columns + j])))
+            {
+                break;
+            }
+        }
+        tr->read = (j >= Table.columns && !strtok(NULL, " \t\r\n"));
+    }
+    fclose(f);
+    if(Table.columns < 0) return -1;
+
+    // Make the copies, now that we know how many we can use.
+    Table.params = SK->params;
+    RESERVE(Table.param, Table.paramAlloc, Table.rows*Table.params);
+    Table.runs = WorkerThreads();
+    if(Table.runs > Table.rows) Table.runs = Table.rows;
+    RESERVE(Table.run, Table.runAlloc, Table.runs);
+    for(k = 0; k < Table.runs; k++) {
+        Table.run[k].sc = NewSolverContext();
+        CopySolverContext(Table.run[k].sc, SC);
+    }
+
+    RunInParallel(SolveTableRun, Table.runs);
+
+    for(k = 0; k < Table.runs; k++) {
+        FreeSolverContext(Table.run[k].sc);
+        Table.run[k].sc = NULL;
+    }
+
+    for(r = 0; r < Table.rows; r++) {
+        TableRow *tr = &(Table.row[r]);
+        if(!tr->read) {
+            dbp("design table: row %d has the wrong number of values", r+1);
+            failed++;
+            continue;
+        }
+        if(!tr->solved) {
+            dbp("design table: row %d (%s) didn't solve", r+1, tr->file);
+            failed++;
+            continue;
+        }
+
+        // Our sketch is the same as the copies, so take the row's solution
+        // as is.
+        double *v = &(Table.param[r*Table.params]);
+        for(i = 0; i < SK->params; i++) {
+            SK->param[i].v = v[i];
+        }
+        for(j = 0; j < Table.columns; j++) {
+            ConstraintById(Table.column[j])->v = Table.v[r*Table.columns + j];
+        }
+
+        GenerateCurvesAndPwls(-1);
+        GenerateDeriveds();
+        if(ExportByExtension(tr->file) != RESULT_OKAY) {
+            dbp("design table: row %d couldn't export to %s", r+1, tr->file);
+            failed++;
+        }
+    }
+    return failed;
+
+badTable:
+    fclose(f);
+    return -1;
+}
@@ -25,56 +25,282 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-#define MAX_EXPRS_ALLOCATED (1024*10)
+//-----------------------------------------------------------------------------
+// The allocator for expressions (and other solver scratch, like the tapes).
+// A solve makes tens of thousands of small nodes, none of which outlive
+// the solve, so it's a bump allocator: we take memory from the end of the
+// current block, and free by moving back to a previously marked position.
+// The solver marks at the start of the solve, of each subsystem, and of each
+// Newton's method, and releases back to the mark when it's done. Blocks are
+// kept once allocated, so that the next solve will reuse them.
+//-----------------------------------------------------------------------------
+static void EUninternAbove(int nodes);
+
+#define ARENA_BLOCK_SIZE    (1024*1024)
+#define MAX_ARENA_BLOCKS    1024
+typedef struct {
+    struct {
+        char    *mem;
+        int      size;
+    }               block[MAX_ARENA_BLOCKS];
+    int             blocks;
+
+    // Where we're allocating now.
+    int             cur;
+    int             used;
+
+    // Statistics, for debugging and tuning.
+    int             nodes;
+    int             bytes;
+    int             peakBytes;
+} ExprArena;
+
+// Expressions are hash-consed: if we're asked for a node that is identical
+// (same op, same operands, same param or value) to one that we've already
+// made, then we return that one. So identical subexpressions are shared,
+// which saves memory and lets the tape compiler evaluate them just once.
+// When the allocator is released, the nodes made since the mark have to
+// leave the table, but the ones made before it are still good. New nodes
+// go on the front of their chains, so we log the chain that each one went
+// into, and unwind that log back to the mark.
+#define EXPR_HASH 16381
+typedef struct {
+    Expr            *head[EXPR_HASH];
+
+    // The chain of every interned node, in the order that they were made;
+    // so there's one entry per node in the arena.
+    int             *chainOf;
+    int              chainOfAlloc;
+} ExprInterned;
+
+// Each solver context has its own expressions, so all of that belongs to
+// the context; and so does our scratch for printing and compiling.
+struct ExprStateTag {
+    ExprArena       arena;
+    ExprInterned    interned;
+    char            printBuf[1024*40];
+    int             tapeTag;
+};
+#define Arena       (SC->expr->arena)
+#define Interned    (SC->expr->interned)
+#define EPrintBuf   (SC->expr->printBuf)
+#define TapeTag     (SC->expr->tapeTag)
+
+void ExprAllocState(SolverContext *sc)
+{
+    sc->expr = (struct ExprStateTag *)DAlloc(sizeof(*(sc->expr)));
+    if(!sc->expr) oops();
+    memset(sc->expr, 0, sizeof(*(sc->expr)));
+}
 
-static Expr *AllocExpr(void)
+void ExprFreeState(SolverContext *sc)
 {
-    return (Expr *)Alloc(sizeof(Expr));
+    int i;
+    for(i = 0; i < sc->expr->arena.blocks; i++) {
+        DFree(sc->expr->arena.block[i].mem);
+    }
+    UNRESERVE(sc->expr->interned.chainOf, sc->expr->interned.chainOfAlloc);
+    DFree(sc->expr);
+    sc->expr = NULL;
 }
 
-void EWipeAllocated(void)
+void *EArenaAlloc(int bytes)
 {
+    // Keep everything aligned for doubles and pointers.
+    bytes = (bytes + 15) & ~15;
+
+    while(Arena.cur < Arena.blocks &&
+        Arena.used + bytes > Arena.block[Arena.cur].size)
+    {
+        // Doesn't fit in this block; so the rest of it is wasted, and we
+        // move on to the next.
+        Arena.bytes += Arena.block[Arena.cur].size - Arena.used;
+        (Arena.cur)++;
+        Arena.used = 0;
+
+        // A block that's kept from earlier might be too small for an
+        // unusually large request; if so, then replace it.
+        if(Arena.cur < Arena.blocks && bytes > Arena.block[Arena.cur].size) {
+            DFree(Arena.block[Arena.cur].mem);
+            Arena.block[Arena.cur].mem = (char *)DAlloc(bytes);
+            if(!Arena.block[Arena.cur].mem) oops();
+            Arena.block[Arena.cur].size = bytes;
+        }
+    }
+    if(Arena.cur >= Arena.blocks) {
+        if(Arena.blocks >= MAX_ARENA_BLOCKS) oops();
+        int size = (bytes > ARENA_BLOCK_SIZE) ? bytes : ARENA_BLOCK_SIZE;
+
+        Arena.block[Arena.blocks].mem = (char *)DAlloc(size);
+        if(!Arena.block[Arena.blocks].mem) oops();
+        Arena.block[Arena.blocks].size = size;
+        (Arena.blocks)++;
+
+        Arena.cur = Arena.blocks - 1;
+        Arena.used = 0;
+    }
+
+    void *v = Arena.block[Arena.cur].mem + Arena.used;
+    Arena.used += bytes;
+    Arena.bytes += bytes;
+    if(Arena.bytes > Arena.peakBytes) Arena.peakBytes = Arena.bytes;
 
+    memset(v, 0, bytes);
+    return v;
 }
 
-Expr *EParam(hParam p)
+ExprArenaMark EArenaMark(void)
 {
-    Expr *e = AllocExpr();
-    e->op = EXPR_PARAM;
-    e->param = p;
+    ExprArenaMark m;
+    m.block = Arena.cur;
+    m.used = Arena.used;
+    m.nodes = Arena.nodes;
+    m.bytes = Arena.bytes;
+    return m;
+}
 
-    return e;
+void EArenaRelease(ExprArenaMark m)
+{
+    // The interned expressions made since the mark are about to be freed,
+    // so take them out of the table first.
+    EUninternAbove(m.nodes);
+
+    Arena.cur = m.block;
+    Arena.used = m.used;
+    Arena.nodes = m.nodes;
+    Arena.bytes = m.bytes;
 }
 
-Expr *EConstant(double v)
+void EArenaStats(int *bytes, int *nodes, int *peakBytes)
 {
-    Expr *e = AllocExpr();
-    e->op = EXPR_CONSTANT;
-    e->v = v;
+    *bytes = Arena.bytes;
+    *nodes = Arena.nodes;
+    *peakBytes = Arena.peakBytes;
+}
 
-    return e;
+static Expr *AllocExpr(void)
+{
+    (Arena.nodes)++;
+    return (Expr *)EArenaAlloc(sizeof(Expr));
 }
 
-Expr *EOfTwo(int op, Expr *e0, Expr *e1)
+//-----------------------------------------------------------------------------
+// Take every node after the first nodes that we made out of the table of
+// interned expressions. Those are the newest, so they're at the front of
+// their chains, and we unlink them newest first.
+//-----------------------------------------------------------------------------
+static void EUninternAbove(int nodes)
+{
+    int i;
+    for(i = Arena.nodes - 1; i >= nodes; i--) {
+        int h = Interned.chainOf[i];
+        Interned.head[h] = Interned.head[h]->next;
+    }
+}
+
+static Expr *EIntern(int op, Expr *e0, Expr *e1, hParam param, double v)
 {
-    Expr *e = AllocExpr();
+    DWORD h = (DWORD)op;
+    h = h*31 + (DWORD)((size_t)e0 >> 3);
+    h = h*31 + (DWORD)((size_t)e1 >> 3);
+    h = h*31 + param;
+    if(op == EXPR_CONSTANT) {
+        DWORD w[2];
+        memcpy(w, &v, sizeof(w));
+        h = h*31 + w[0];
+        h = h*31 + w[1];
+    }
+    h %= EXPR_HASH;
+
+    Expr *e;
+    for(e = Interned.head[h]; e; e = e->next) {
+        if(e->op == op && e->e0 == e0 && e->e1 == e1 && e->param == param &&
+            e->v == v)
+        {
+            return e;
+        }
+    }
+
+    RESERVE(Interned.chainOf, Interned.chainOfAlloc, Arena.nodes + 1);
+    Interned.chainOf[Arena.nodes] = (int)h;
+
+    e = AllocExpr();
     e->op = op;
     e->e0 = e0;
     e->e1 = e1;
+    e->param = param;
+    e->v = v;
+    if(op == EXPR_PARAM) e->slot = ParamSlot(param);
+    if(op == EXPR_DIMENSION) e->slot = -1;
+
+    e->next = Interned.head[h];
+    Interned.head[h] = e;
 
     return e;
 }
 
-Expr *EOfOne(int op, Expr *e0)
+Expr *EParam(hParam p)
 {
-    Expr *e = AllocExpr();
-    e->op = op;
-    e->e0 = e0;
+    return EIntern(EXPR_PARAM, NULL, NULL, p, 0);
+}
 
-    return e;
+//-----------------------------------------------------------------------------
+// The index of a parameter expression's parameter in SK->param[]. That's
+// resolved when the expression is created, and only looked up again if the
+// table of parameters has changed under us since then.
+//-----------------------------------------------------------------------------
+int EParamSlot(Expr *e)
+{
+    int i = e->slot;
+    if(i >= 0 && i < SK->params && SK->param[i].id == e->param) return i;
+
+    i = ParamSlot(e->param);
+    if(i < 0) oops();
+    e->slot = i;
+    return i;
+}
+
+Expr *EConstant(double v)
+{
+    return EIntern(EXPR_CONSTANT, NULL, NULL, 0, v);
+}
+
+//-----------------------------------------------------------------------------
+// The value of a constraint (a distance, angle, etc.), read from the
+// constraint whenever we evaluate, so that changing the dimension doesn't
+// mean writing the equations again. The constraint gets found the same
+// way as a parameter's slot.
+//-----------------------------------------------------------------------------
+Expr *EDimension(hConstraint hc)
+{
+    return EIntern(EXPR_DIMENSION, NULL, NULL, hc, 0);
+}
+double EDimensionValue(Expr *e)
+{
+    int i = e->slot;
+    if(i >= 0 && i < SK->constraints && SK->constraint[i].id == e->param) {
+        return SK->constraint[i].v;
+    }
+
+    for(i = 0; i < SK->constraints; i++) {
+        if(SK->constraint[i].id == e->param) {
+            e->slot = i;
+            return SK->constraint[i].v;
+        }
+    }
+    oops();
+}
+
+Expr *EOfTwo(int op, Expr *e0, Expr *e1)
+{
+    return EIntern(op, e0, e1, 0, 0);
+}
+
+Expr *EOfOne(int op, Expr *e0)
+{
+    return EIntern(op, e0, NULL, 0, 0);
 }
 
-static char EPrintBuf[1024*40];
 static void dbps(const char *str, ...)
 {
     va_list f;
@@ -94,6 +320,10 @@ static void EPrintWorker(Expr *e)
             dbps("{const %.2f}", e->v);
             return;
 
+        case EXPR_DIMENSION:
+            dbps("{dimension %08x (now %.2f)}", e->param, EDimensionValue(e));
+            return;
+
         case EXPR_DIV:
         case EXPR_TIMES:
         case EXPR_MINUS:
@@ -159,11 +389,14 @@ double EEval(Expr *e)
 {
     switch(e->op) {
         case EXPR_PARAM:
-            return EvalParam(e->param);
+            return SK->param[EParamSlot(e)].v;
 
         case EXPR_CONSTANT:
             return e->v;
 
+        case EXPR_DIMENSION:
+            return EDimensionValue(e);
+
         case EXPR_PLUS:
             return EEval(e->e0) + EEval(e->e1);
             
@@ -198,6 +431,379 @@ double EEval(Expr *e)
     oops();
 }
 
+//-----------------------------------------------------------------------------
+// Compile a list of expressions to a tape, for the Newton's method. The
+// tree walk and the parameter lookups happen once, here; after that, the
+// whole list can be evaluated by a single pass over a flat array.
+//-----------------------------------------------------------------------------
+static int ECountNodes(Expr *e)
+{
+    // Shared subexpressions get a single instruction, so count them once.
+    if(e->tag == TapeTag) return 0;
+    e->tag = TapeTag;
+
+    switch(e->op) {
+        case EXPR_PARAM:
+        case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
+            return 1;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            return 1 + ECountNodes(e->e0) + ECountNodes(e->e1);
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            return 1 + ECountNodes(e->e0);
+
+        default:
+            oops();
+    }
+    oops();
+}
+static int ECompileWorker(ExprTape *t, Expr *e)
+{
+    int a = 0, b = 0;
+
+    // If this node is shared, and we've already emitted it, then just
+    // reuse that register.
+    if(e->tag == TapeTag) return e->reg;
+
+    switch(e->op) {
+        case EXPR_PARAM:
+            a = EParamSlot(e);
+            break;
+
+        case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
+            break;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            a = ECompileWorker(t, e->e0);
+            b = ECompileWorker(t, e->e1);
+            break;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            a = ECompileWorker(t, e->e0);
+            break;
+
+        default:
+            oops();
+    }
+
+    int i = t->instrs;
+    t->instr[i].op = e->op;
+    t->instr[i].a = a;
+    t->instr[i].b = b;
+    t->instr[i].v = e->v;
+    if(e->op == EXPR_DIMENSION) {
+        // A tape doesn't outlive the solve, and the dimensions don't change
+        // during one, so that's just a constant.
+        t->instr[i].op = EXPR_CONSTANT;
+        t->instr[i].v = EDimensionValue(e);
+    }
+    t->instrs = i + 1;
+
+    e->tag = TapeTag;
+    e->reg = i;
+
+    return i;
+}
+void ECompileTape(ExprTape *t, Expr **e, int n)
+{
+    int i;
+
+    int nodes = 0;
+    TapeTag++;
+    for(i = 0; i < n; i++) {
+        nodes += ECountNodes(e[i]);
+    }
+
+    t->instr = (ExprInstr *)EArenaAlloc(nodes*sizeof(ExprInstr));
+    t->reg = (double *)EArenaAlloc(nodes*sizeof(double));
+    t->out = (int *)EArenaAlloc(n*sizeof(int));
+    t->instrs = 0;
+    t->grad = NULL;
+    t->unknowns = 0;
+    t->value = NULL;
+
+    TapeTag++;
+    for(i = 0; i < n; i++) {
+        t->out[i] = ECompileWorker(t, e[i]);
+    }
+    t->outs = n;
+}
+
+//-----------------------------------------------------------------------------
+// Evaluate every expression on a compiled tape, given the current values
+// of the parameters, and write the results to dest[].
+//-----------------------------------------------------------------------------
+void EEvalTape(ExprTape *t, double *dest)
+{
+    ExprInstr *in = t->instr;
+    double *r = t->reg;
+    double *value = t->value;
+    int i;
+
+    for(i = 0; i < t->instrs; i++, in++) {
+        switch(in->op) {
+            case EXPR_PARAM:    r[i] = value[in->a]; break;
+            case EXPR_CONSTANT: r[i] = in->v; break;
+
+            case EXPR_PLUS:     r[i] = r[in->a] + r[in->b]; break;
+            case EXPR_MINUS:    r[i] = r[in->a] - r[in->b]; break;
+            case EXPR_TIMES:    r[i] = r[in->a] * r[in->b]; break;
+            case EXPR_DIV:      r[i] = NumDiv(r[in->a], r[in->b]); break;
+
+            case EXPR_NEGATE:   r[i] = -r[in->a]; break;
+            case EXPR_SQRT:     r[i] = sqrt(r[in->a]); break;
+            case EXPR_SQUARE:   r[i] = r[in->a]*r[in->a]; break;
+            case EXPR_SIN:      r[i] = sin(r[in->a]); break;
+            case EXPR_COS:      r[i] = cos(r[in->a]); break;
+
+            default:
+                oops();
+        }
+    }
+
+    for(i = 0; i < t->outs; i++) {
+        dest[i] = r[t->out[i]];
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Prepare a tape for forward-mode automatic differentiation, with respect
+// to the n unknowns whose indices in SK->param[] are given in slot[]. Each
+// parameter instruction gets the column of its unknown, or -1 if it's a
+// parameter that we're not differentiating with respect to.
+//-----------------------------------------------------------------------------
+void ETapeSetUnknowns(ExprTape *t, int *slot, int n)
+{
+    int i, j;
+    for(i = 0; i < t->instrs; i++) {
+        ExprInstr *in = &(t->instr[i]);
+        if(in->op != EXPR_PARAM) continue;
+
+        in->b = -1;
+        for(j = 0; j < n; j++) {
+            if(slot[j] == in->a) {
+                in->b = j;
+                break;
+            }
+        }
+    }
+
+    t->grad = (double *)EArenaAlloc(t->instrs*n*sizeof(double));
+    t->unknowns = n;
+}
+
+//-----------------------------------------------------------------------------
+// Evaluate every expression on the tape, like EEvalTape(), but carry a
+// gradient along with each value (i.e., evaluate over dual numbers), so
+// that we get the values and the full gradients in a single pass. The
+// gradient of expression k is written to grad[k*unknowns ...]. This gives
+// the same numbers as evaluating the EPartial() derivatives, without ever
+// writing those.
+//-----------------------------------------------------------------------------
+void EEvalTapeWithGradient(ExprTape *t, double *dest, double *grad)
+{
+    ExprInstr *in = t->instr;
+    double *r = t->reg;
+    double *value = t->value;
+    int n = t->unknowns;
+    int i, j;
+
+    for(i = 0; i < t->instrs; i++, in++) {
+        double *g = &(t->grad[i*n]);
+        double *ga = NULL, *gb = NULL;
+        double a, b, d;
+
+        if(in->op != EXPR_PARAM && in->op != EXPR_CONSTANT) {
+            ga = &(t->grad[(in->a)*n]);
+            gb = &(t->grad[(in->b)*n]);
+        }
+
+        switch(in->op) {
+            case EXPR_PARAM:
+                r[i] = value[in->a];
+                for(j = 0; j < n; j++) g[j] = 0;
+                if(in->b >= 0) g[in->b] = 1;
+                break;
+
+            case EXPR_CONSTANT:
+                r[i] = in->v;
+                for(j = 0; j < n; j++) g[j] = 0;
+                break;
+
+            case EXPR_PLUS:
+                r[i] = r[in->a] + r[in->b];
+                for(j = 0; j < n; j++) g[j] = ga[j] + gb[j];
+                break;
+
+            case EXPR_MINUS:
+                r[i] = r[in->a] - r[in->b];
+                for(j = 0; j < n; j++) g[j] = ga[j] - gb[j];
+                break;
+
+            case EXPR_TIMES:
+                a = r[in->a];
+                b = r[in->b];
+                r[i] = a*b;
+                for(j = 0; j < n; j++) g[j] = a*gb[j] + b*ga[j];
+                break;
+
+            case EXPR_DIV:
+                a = r[in->a];
+                b = r[in->b];
+                r[i] = NumDiv(a, b);
+                for(j = 0; j < n; j++) {
+                    g[j] = NumDiv(ga[j]*b - a*gb[j], b*b);
+                }
+                break;
+
+            case EXPR_NEGATE:
+                r[i] = -r[in->a];
+                for(j = 0; j < n; j++) g[j] = -ga[j];
+                break;
+
+            case EXPR_SQRT:
+                r[i] = sqrt(r[in->a]);
+                d = NumDiv(0.5, r[i]);
+                for(j = 0; j < n; j++) g[j] = d*ga[j];
+                break;
+
+            case EXPR_SQUARE:
+                a = r[in->a];
+                r[i] = a*a;
+                for(j = 0; j < n; j++) g[j] = 2*a*ga[j];
+                break;
+
+            case EXPR_SIN:
+                a = r[in->a];
+                r[i] = sin(a);
+                d = cos(a);
+                for(j = 0; j < n; j++) g[j] = d*ga[j];
+                break;
+
+            case EXPR_COS:
+                a = r[in->a];
+                r[i] = cos(a);
+                d = sin(a);
+                for(j = 0; j < n; j++) g[j] = -(d*ga[j]);
+                break;
+
+            default:
+                oops();
+        }
+    }
+
+    for(i = 0; i < t->outs; i++) {
+        dest[i] = r[t->out[i]];
+        memcpy(&(grad[i*n]), &(t->grad[(t->out[i])*n]), n*sizeof(double));
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Reverse-mode differentiation of a tape with a single expression on it.
+// We evaluate forwards as usual, and then sweep backwards, propagating the
+// derivative of the output with respect to each register (its adjoint).
+// Afterwards, t->grad[i] for each EXPR_PARAM instruction i is the partial
+// with respect to the parameter SK->param[t->instr[i].a]; if a parameter
+// appears in more than one instruction, then its partial is the sum. This
+// costs about two evaluations, however many parameters there are.
+// Returns the value of the expression.
+//-----------------------------------------------------------------------------
+double EEvalTapeReverse(ExprTape *t)
+{
+    double v;
+    int i;
+
+    if(t->outs != 1) oops();
+    EEvalTape(t, &v);
+
+    if(!t->grad) {
+        t->grad = (double *)EArenaAlloc(t->instrs*sizeof(double));
+    }
+    double *adj = t->grad;
+    double *r = t->reg;
+    for(i = 0; i < t->instrs; i++) {
+        adj[i] = 0;
+    }
+    adj[t->out[0]] = 1;
+
+    for(i = t->instrs - 1; i >= 0; i--) {
+        ExprInstr *in = &(t->instr[i]);
+        double d = adj[i];
+        double a, b;
+        if(d == 0) continue;
+
+        switch(in->op) {
+            case EXPR_PARAM:
+            case EXPR_CONSTANT:
+                break;
+
+            case EXPR_PLUS:
+                adj[in->a] += d;
+                adj[in->b] += d;
+                break;
+
+            case EXPR_MINUS:
+                adj[in->a] += d;
+                adj[in->b] -= d;
+                break;
+
+            case EXPR_TIMES:
+                adj[in->a] += d*r[in->b];
+                adj[in->b] += d*r[in->a];
+                break;
+
+            case EXPR_DIV:
+                a = r[in->a];
+                b = r[in->b];
+                adj[in->a] += d*NumDiv(1, b);
+                adj[in->b] += d*NumDiv(-a, b*b);
+                break;
+
+            case EXPR_NEGATE:
+                adj[in->a] -= d;
+                break;
+
+            case EXPR_SQRT:
+                adj[in->a] += d*NumDiv(0.5, r[i]);
+                break;
+
+            case EXPR_SQUARE:
+                adj[in->a] += d*2*r[in->a];
+                break;
+
+            case EXPR_SIN:
+                adj[in->a] += d*cos(r[in->a]);
+                break;
+
+            case EXPR_COS:
+                adj[in->a] -= d*sin(r[in->a]);
+                break;
+
+            default:
+                oops();
+        }
+    }
+
+    return v;
+}
+
 //-----------------------------------------------------------------------------
 // Is an expression entirely independent of param? This is a useful
 // optimisation, because it saves calculating and evaluating trivial
@@ -210,6 +816,7 @@ BOOL EIndependentOf(Expr *e, hParam param)
             return (e->param != param);
 
         case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
             return TRUE;
 
         case EXPR_PLUS:
@@ -249,6 +856,7 @@ Expr *EPartial(Expr *e, hParam param)
             }
 
         case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
             return EConstant(0);
 
         case EXPR_PLUS:
@@ -304,17 +912,21 @@ Expr *EEvalKnown(Expr *e)
     Expr *e0, *e1;
 
     switch(e->op) {
-        case EXPR_PARAM:
-            if(ParamById(e->param)->known) {
-                return EConstant(EvalParam(e->param));
+        case EXPR_PARAM: {
+            SketchParam *p = &(SK->param[EParamSlot(e)]);
+            if(p->known) {
+                return EConstant(p->v);
             } else {
                 return EParam(e->param);
             }
-            oops();
+        }
 
         case EXPR_CONSTANT:
             return EConstant(e->v);
 
+        case EXPR_DIMENSION:
+            return EConstant(EDimensionValue(e));
+
         case EXPR_PLUS:
         case EXPR_MINUS:
         case EXPR_DIV:
@@ -392,23 +1004,98 @@ Expr *EEvalKnown(Expr *e)
 }
 
 //-----------------------------------------------------------------------------
-// Adjust all of the SK->param[i].mark terms by the given 
+// Find the unknowns that would be left in EEvalKnown(e), without building
+// it. Their slots get appended to param[], maybe more than once each, and
+// counted in *n; if that goes past max, then we keep counting but stop
+// writing, so the caller can make room and try again. Returns TRUE if the
+// expression would reduce to a constant, with that constant in *v.
 //-----------------------------------------------------------------------------
-void EMark(Expr *e, int delta)
+BOOL EKnownUnknowns(Expr *e, int *param, int max, int *n, double *v)
 {
+    double v0, v1;
+    BOOL c0, c1;
+    int n0 = *n;
+
     switch(e->op) {
         case EXPR_PARAM: {
-            int i;
-            for(i = 0; i < SK->params; i++) {
-                if(SK->param[i].id == e->param) {
-                    (SK->param[i].mark) += delta;
-                    return;
+            int i = EParamSlot(e);
+            if(SK->param[i].known) {
+                *v = SK->param[i].v;
+                return TRUE;
+            }
+            if(*n < max) param[*n] = i;
+            (*n)++;
+            return FALSE;
+        }
+
+        case EXPR_CONSTANT:
+            *v = e->v;
+            return TRUE;
+
+        case EXPR_DIMENSION:
+            *v = EDimensionValue(e);
+            return TRUE;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_DIV:
+        case EXPR_TIMES:
+            c0 = EKnownUnknowns(e->e0, param, max, n, &v0);
+            c1 = EKnownUnknowns(e->e1, param, max, n, &v1);
+
+            if(c0 && c1) {
+                switch(e->op) {
+                    case EXPR_PLUS:  *v = v0 + v1; break;
+                    case EXPR_MINUS: *v = v0 - v1; break;
+                    case EXPR_TIMES: *v = v0 * v1; break;
+                    case EXPR_DIV:   *v = NumDiv(v0, v1); break;
                 }
+                return TRUE;
+            }
+            if(e->op == EXPR_TIMES &&
+                ((c0 && tol(v0, 0)) || (c1 && tol(v1, 0))))
+            {
+                // Multiplied by zero, so the other side's unknowns go.
+                *n = n0;
+                *v = 0;
+                return TRUE;
+            }
+            return FALSE;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            if(!EKnownUnknowns(e->e0, param, max, n, &v0)) return FALSE;
+
+            switch(e->op) {
+                case EXPR_SQRT:     *v = sqrt(v0);  break;
+                case EXPR_SQUARE:   *v = v0*v0;     break;
+                case EXPR_NEGATE:   *v = -v0;       break;
+                case EXPR_SIN:      *v = sin(v0);   break;
+                case EXPR_COS:      *v = cos(v0);   break;
             }
+            return TRUE;
+
+        default:
             oops();
-        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Adjust all of the SK->param[i].mark terms by the given 
+//-----------------------------------------------------------------------------
+void EMark(Expr *e, int delta)
+{
+    switch(e->op) {
+        case EXPR_PARAM:
+            (SK->param[EParamSlot(e)].mark) += delta;
+            return;
+
 
         case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
             return;
 
         case EXPR_PLUS:
@@ -433,48 +1120,392 @@ void EMark(Expr *e, int delta)
     oops();
 }
 
-BOOL EExprMarksTwoParamsEqual(Expr *e, hParam *pA, hParam *pB)
+//-----------------------------------------------------------------------------
+// Return a hash of the structure of an expression, including the values of
+// its constants and the parameters that it references. Two expressions
+// with different hashes are certainly different.
+//-----------------------------------------------------------------------------
+DWORD EHash(Expr *e)
 {
-    if(e->op != EXPR_MINUS) return FALSE;
+    DWORD h = 2166136261u ^ (DWORD)e->op;
+    h *= 16777619;
 
-    if(e->e0->op != EXPR_PARAM) return FALSE;
-    if(e->e1->op != EXPR_PARAM) return FALSE;
+    switch(e->op) {
+        case EXPR_PARAM:
+        case EXPR_DIMENSION:
+            // Just which constraint, not its value; so the partials that
+            // we cache survive a change to the dimension.
+            return (h ^ e->param)*16777619;
+
+        case EXPR_CONSTANT: {
+            DWORD w[2];
+            memcpy(w, &(e->v), sizeof(w));
+            h = (h ^ w[0])*16777619;
+            return (h ^ w[1])*16777619;
+        }
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            h = (h ^ EHash(e->e0))*16777619;
+            return (h ^ EHash(e->e1))*16777619;
 
-    *pA = e->e0->param;
-    *pB = e->e1->param;
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            return (h ^ EHash(e->e0))*16777619;
 
-    return TRUE;
+        default:
+            oops();
+    }
+    oops();
 }
 
-void EReplaceParameter(Expr *e, hParam replacement, hParam toReplace)
+//-----------------------------------------------------------------------------
+// Make a deep copy of an expression, with the nodes coming from the given
+// allocator instead of from the usual (per-solve) one. The copy is not
+// interned.
+//-----------------------------------------------------------------------------
+Expr *ECopy(Expr *e, Expr *(*alloc)(void))
 {
+    Expr *n = alloc();
+    n->op = e->op;
+    n->param = e->param;
+    n->v = e->v;
+    n->slot = e->slot;
+
     switch(e->op) {
         case EXPR_PARAM:
-            if(e->param == toReplace) {
-                e->param = replacement;
-            }
-            return;
+        case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
+            break;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            n->e0 = ECopy(e->e0, alloc);
+            n->e1 = ECopy(e->e1, alloc);
+            break;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            n->e0 = ECopy(e->e0, alloc);
+            break;
+
+        default:
+            oops();
+    }
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Replace every parameter in the expression by its substitute, which is
+// subst[i] for the parameter in SK->param[i] (or itself, if subst[i] is
+// NULL). The nodes are shared, so they can't be changed in place; we return
+// the new expression, which is interned like any other, and which re-uses
+// whatever parts of the old one didn't change.
+//-----------------------------------------------------------------------------
+Expr *ESubstituteParameters(Expr *e, Expr **subst)
+{
+    Expr *e0, *e1;
+
+    switch(e->op) {
+        case EXPR_PARAM: {
+            int i = EParamSlot(e);
+            return subst[i] ? subst[i] : e;
+        }
 
         case EXPR_CONSTANT:
-            return;
+        case EXPR_DIMENSION:
+            return e;
 
         case EXPR_PLUS:
         case EXPR_MINUS:
         case EXPR_TIMES:
         case EXPR_DIV:
-            EReplaceParameter(e->e0, replacement, toReplace);
-            EReplaceParameter(e->e1, replacement, toReplace);
-            return;
+            e0 = ESubstituteParameters(e->e0, subst);
+            e1 = ESubstituteParameters(e->e1, subst);
+            if(e0 == e->e0 && e1 == e->e1) return e;
+            return EOfTwo(e->op, e0, e1);
 
         case EXPR_SQRT:
         case EXPR_SQUARE:
         case EXPR_NEGATE:
         case EXPR_SIN:
         case EXPR_COS:
-            EReplaceParameter(e->e0, replacement, toReplace);
-            return;
+            e0 = ESubstituteParameters(e->e0, subst);
+            if(e0 == e->e0) return e;
+            return EOfOne(e->op, e0);
 
         default:
             oops();
     }
 }
+
+//-----------------------------------------------------------------------------
+// Work out whether the expression is of the form a*p + b, for a single
+// parameter p that's not known yet; the known parameters count as constants,
+// at their current values. If so, return TRUE with p's slot in *slot (or -1,
+// if the expression doesn't depend on any unknown at all). Nothing gets
+// allocated, so this is cheap enough to try on every equation.
+//-----------------------------------------------------------------------------
+static BOOL ELinear(Expr *e, int *slot, double *a, double *b)
+{
+    int s0, s1;
+    double a0, b0, a1, b1;
+
+    switch(e->op) {
+        case EXPR_PARAM: {
+            int i = EParamSlot(e);
+            if(SK->param[i].known) {
+                *slot = -1; *a = 0; *b = SK->param[i].v;
+            } else {
+                *slot = i; *a = 1; *b = 0;
+            }
+            return TRUE;
+        }
+        case EXPR_CONSTANT:
+            *slot = -1; *a = 0; *b = e->v;
+            return TRUE;
+
+        case EXPR_DIMENSION:
+            *slot = -1; *a = 0; *b = EDimensionValue(e);
+            return TRUE;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+            if(!ELinear(e->e0, &s0, &a0, &b0)) return FALSE;
+            if(!ELinear(e->e1, &s1, &a1, &b1)) return FALSE;
+            if(s0 >= 0 && s1 >= 0 && s0 != s1) return FALSE;
+            if(e->op == EXPR_MINUS) {
+                a1 = -a1; b1 = -b1;
+            }
+            *slot = (s0 >= 0) ? s0 : s1;
+            *a = a0 + a1;
+            *b = b0 + b1;
+            return TRUE;
+
+        case EXPR_TIMES:
+            if(!ELinear(e->e0, &s0, &a0, &b0)) return FALSE;
+            if(!ELinear(e->e1, &s1, &a1, &b1)) return FALSE;
+            if(s0 >= 0 && s1 >= 0) return FALSE;
+            *slot = (s0 >= 0) ? s0 : s1;
+            *a = a0*b1 + a1*b0;
+            *b = b0*b1;
+            return TRUE;
+
+        case EXPR_DIV:
+            if(!ELinear(e->e0, &s0, &a0, &b0)) return FALSE;
+            if(!ELinear(e->e1, &s1, &a1, &b1)) return FALSE;
+            if(s1 >= 0 || b1 == 0) return FALSE;
+            *slot = s0;
+            *a = a0 / b1;
+            *b = b0 / b1;
+            return TRUE;
+
+        case EXPR_NEGATE:
+            if(!ELinear(e->e0, slot, a, b)) return FALSE;
+            *a = -*a;
+            *b = -*b;
+            return TRUE;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            // Fine as long as the argument is constant, in which case we
+            // can just evaluate it.
+            if(!ELinear(e->e0, &s0, &a0, &b0)) return FALSE;
+            if(s0 >= 0) return FALSE;
+            *slot = -1;
+            *a = 0;
+            switch(e->op) {
+                case EXPR_SQRT:     *b = sqrt(b0);  break;
+                case EXPR_SQUARE:   *b = b0*b0;     break;
+                case EXPR_SIN:      *b = sin(b0);   break;
+                case EXPR_COS:      *b = cos(b0);   break;
+            }
+            return TRUE;
+
+        default:
+            oops();
+    }
+}
+
+BOOL ELinearInOne(Expr *e, int *slot, double *a, double *b)
+{
+    return ELinear(e, slot, a, b) && *slot >= 0;
+}
+
+//-----------------------------------------------------------------------------
+// Work out whether the expression is of the form a0*p0 + a1*p1 + c, for two
+// different parameters, where the a are numbers and c doesn't depend on
+// any parameter. Unlike ELinear(), every parameter counts, known or not,
+// and the dimensions stay symbolic, since the caller writes the result into
+// the equations, and those read the dimensions as they're evaluated; so c
+// is an expression, of the dimensions and numbers. That only gets built if
+// c isn't NULL, so it's cheap to ask first without.
+//-----------------------------------------------------------------------------
+typedef struct {
+    int     n;
+    int     slot[2];
+    double  a[2];
+    // The part that doesn't depend on the unknowns is v, plus c if that
+    // depends on a dimension (and if we're building it).
+    double  v;
+    BOOL    symbolic;
+    Expr   *c;
+} ELinearForm;
+
+static Expr *EFormConstant(ELinearForm *f)
+{
+    if(!f->symbolic) return EConstant(f->v);
+    if(f->v == 0) return f->c;
+    return EPlus(f->c, EConstant(f->v));
+}
+
+static void EFormScale(ELinearForm *f, double k, BOOL build)
+{
+    int i, n = 0;
+    for(i = 0; i < f->n; i++) {
+        if(f->a[i]*k == 0) continue;
+        f->slot[n] = f->slot[i];
+        f->a[n] = f->a[i]*k;
+        n++;
+    }
+    f->n = n;
+    f->v *= k;
+    if(f->symbolic && build) f->c = ETimes(EConstant(k), f->c);
+}
+
+static BOOL ELinearTwo(Expr *e, ELinearForm *f, BOOL build)
+{
+    ELinearForm g;
+    int i, j;
+
+    switch(e->op) {
+        case EXPR_PARAM:
+            f->n = 1; f->slot[0] = EParamSlot(e); f->a[0] = 1; f->v = 0;
+            f->symbolic = FALSE; f->c = NULL;
+            return TRUE;
+
+        case EXPR_CONSTANT:
+            f->n = 0; f->v = e->v; f->symbolic = FALSE; f->c = NULL;
+            return TRUE;
+
+        case EXPR_DIMENSION:
+            f->n = 0; f->v = 0; f->symbolic = TRUE; f->c = build ? e : NULL;
+            return TRUE;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+            if(!ELinearTwo(e->e0, f, build)) return FALSE;
+            if(!ELinearTwo(e->e1, &g, build)) return FALSE;
+            if(e->op == EXPR_MINUS) EFormScale(&g, -1, build);
+
+            for(i = 0; i < g.n; i++) {
+                for(j = 0; j < f->n; j++) {
+                    if(f->slot[j] == g.slot[i]) break;
+                }
+                if(j == f->n) {
+                    if(f->n >= 2) return FALSE;
+                    f->slot[j] = g.slot[i];
+                    f->a[j] = 0;
+                    (f->n)++;
+                }
+                f->a[j] += g.a[i];
+            }
+            f->v += g.v;
+            if(g.symbolic) {
+                if(build) f->c = f->symbolic ? EPlus(f->c, g.c) : g.c;
+                f->symbolic = TRUE;
+            }
+            // Drop anything that cancelled out.
+            EFormScale(f, 1, FALSE);
+            return TRUE;
+
+        case EXPR_TIMES:
+            if(!ELinearTwo(e->e0, f, build)) return FALSE;
+            if(!ELinearTwo(e->e1, &g, build)) return FALSE;
+            if(g.n == 0 && !g.symbolic) {
+                EFormScale(f, g.v, build);
+                return TRUE;
+            }
+            if(f->n == 0 && !f->symbolic) {
+                double k = f->v;
+                *f = g;
+                EFormScale(f, k, build);
+                return TRUE;
+            }
+            // A dimension times a parameter doesn't have a number for its
+            // coefficient, but a dimension times a constant is fine.
+            if(f->n > 0 || g.n > 0) return FALSE;
+            if(build) f->c = ETimes(EFormConstant(f), EFormConstant(&g));
+            f->v = 0;
+            f->symbolic = TRUE;
+            return TRUE;
+
+        case EXPR_DIV:
+            if(!ELinearTwo(e->e0, f, build)) return FALSE;
+            if(!ELinearTwo(e->e1, &g, build)) return FALSE;
+            if(g.n > 0) return FALSE;
+            if(!g.symbolic) {
+                if(g.v == 0) return FALSE;
+                EFormScale(f, 1/g.v, build);
+                return TRUE;
+            }
+            if(f->n > 0) return FALSE;
+            if(build) f->c = EDiv(EFormConstant(f), EFormConstant(&g));
+            f->v = 0;
+            f->symbolic = TRUE;
+            return TRUE;
+
+        case EXPR_NEGATE:
+            if(!ELinearTwo(e->e0, f, build)) return FALSE;
+            EFormScale(f, -1, build);
+            return TRUE;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            if(!ELinearTwo(e->e0, f, build)) return FALSE;
+            if(f->n > 0) return FALSE;
+            if(f->symbolic) {
+                if(build) f->c = EOfOne(e->op, EFormConstant(f));
+                f->v = 0;
+                return TRUE;
+            }
+            switch(e->op) {
+                case EXPR_SQRT:     f->v = sqrt(f->v);  break;
+                case EXPR_SQUARE:   f->v = f->v*f->v;   break;
+                case EXPR_SIN:      f->v = sin(f->v);   break;
+                case EXPR_COS:      f->v = cos(f->v);   break;
+            }
+            return TRUE;
+
+        default:
+            oops();
+    }
+}
+
+BOOL ELinearInTwo(Expr *e, int *slot0, double *a0, int *slot1, double *a1,
+                                                                    Expr **c)
+{
+    ELinearForm f;
+    if(!ELinearTwo(e, &f, c != NULL)) return FALSE;
+    if(f.n != 2) return FALSE;
+
+    *slot0 = f.slot[0];
+    *a0 = f.a[0];
+    *slot1 = f.slot[1];
+    *a1 = f.a[1];
+    if(c) *c = (f.symbolic || f.v != 0) ? EFormConstant(&f) : NULL;
+    return TRUE;
+}
@@ -22,6 +22,7 @@
 
 #define EXPR_PARAM          0x000
 #define EXPR_CONSTANT       0x001
+#define EXPR_DIMENSION      0x002
 
 #define EXPR_PLUS           0x010
 #define EXPR_MINUS          0x011
@@ -42,10 +43,34 @@ struct ExprTag {
     Expr            *e1;
     hParam          param;
     double          v;
+    // For a parameter, where we last found it in SK->param[]; see
+    // EParamSlot(). For a dimension, which has the constraint in param,
+    // the same in SK->constraint[].
+    int             slot;
+
+    // Chain in the table of interned expressions.
+    Expr            *next;
+    // Scratch, used while compiling to a tape.
+    int             tag;
+    int             reg;
 };
 
+typedef struct {
+    int             block;
+    int             used;
+    int             nodes;
+    int             bytes;
+} ExprArenaMark;
+void *EArenaAlloc(int bytes);
+ExprArenaMark EArenaMark(void);
+void EArenaRelease(ExprArenaMark m);
+void EArenaStats(int *bytes, int *nodes, int *peakBytes);
+
 Expr *EParam(hParam p);
+int EParamSlot(Expr *e);
 Expr *EConstant(double v);
+Expr *EDimension(hConstraint hc);
+double EDimensionValue(Expr *e);
 
 Expr *EOfTwo(int op, Expr *e0, Expr *e1);
 #define EPlus(e0, e1)   EOfTwo(EXPR_PLUS, e0, e1)
@@ -62,14 +87,57 @@ Expr *EOfOne(int op, Expr *e0);
 
 double EEval(Expr *e);
 Expr *EEvalKnown(Expr *e);
+BOOL EKnownUnknowns(Expr *e, int *param, int max, int *n, double *v);
 Expr *EPartial(Expr *e, hParam param);
 BOOL EIndependentOf(Expr *e, hParam param);
 void EMark(Expr *e, int delta);
 
-BOOL EExprMarksTwoParamsEqual(Expr *e, hParam *pA, hParam *pB);
-void EReplaceParameter(Expr *e, hParam replacement, hParam toReplace);
+DWORD EHash(Expr *e);
+Expr *ECopy(Expr *e, Expr *(*alloc)(void));
+
+Expr *ESubstituteParameters(Expr *e, Expr **subst);
+BOOL ELinearInOne(Expr *e, int *slot, double *a, double *b);
+BOOL ELinearInTwo(Expr *e, int *slot0, double *a0, int *slot1, double *a1,
+                                                                    Expr **c);
 
 void EPrint(const char *s, Expr *e);
 
+// A flattened form of one or more expressions, for fast repeated
+// evaluation. Each instruction writes its result to the register with
+// the same index as the instruction; operands refer to earlier registers,
+// and parameters are referenced by their index in SK->param[]. The values
+// of the parameters are read from value[], which is indexed the same way,
+// and which the caller must point somewhere before evaluating.
+typedef struct {
+    int             op;
+    int             a;
+    int             b;
+    double          v;
+} ExprInstr;
+
+typedef struct {
+    ExprInstr       *instr;
+    int             instrs;
+    double          *reg;
+
+    // The register that holds the value of each compiled expression.
+    int             *out;
+    int             outs;
+
+    // For forward-mode differentiation, the gradient of each register with
+    // respect to the unknowns, unknowns doubles per register. For reverse
+    // mode, the adjoint of each register, one double per register.
+    double          *grad;
+    int             unknowns;
+
+    double          *value;
+} ExprTape;
+
+void ECompileTape(ExprTape *t, Expr **e, int n);
+void EEvalTape(ExprTape *t, double *dest);
+void ETapeSetUnknowns(ExprTape *t, int *slot, int n);
+void EEvalTapeWithGradient(ExprTape *t, double *dest, double *grad);
+double EEvalTapeReverse(ExprTape *t);
+
 #endif
 
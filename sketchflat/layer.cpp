@@ -176,9 +176,12 @@ void ButtonDeleteLayer(void)
 
     // All entities (and in the process, constraints) on that layer must
     // be deleted before we can proceed.
-    static hEntity ToDelete[MAX_ENTITIES_IN_SKETCH];
+    static hEntity *ToDelete;
+    static int ToDeleteAlloc;
     int tdc = 0;
 
+    RESERVE(ToDelete, ToDeleteAlloc, SK->entities);
+
     int i;
     for(i = 0; i < SK->entities; i++) {
         SketchEntity *e = &(SK->entity[i]);
@@ -194,8 +197,11 @@ void ButtonDeleteLayer(void)
     // Any leftover constraints were malformed, because they constrained
     // only entities on different layers. They must still be deleted,
     // because there is otherwise no way to manipulate them anymore.
-    static hConstraint ConstraintToDelete[MAX_CONSTRAINTS_IN_SKETCH];
+    static hConstraint *ConstraintToDelete;
+    static int ConstraintToDeleteAlloc;
     tdc = 0;
+
+    RESERVE(ConstraintToDelete, ConstraintToDeleteAlloc, SK->constraints);
     for(i = 0; i < SK->constraints; i++) {
         SketchConstraint *c = &(SK->constraint[i]);
         if(c->layer == hl) {
@@ -25,6 +25,12 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
+// Files start with a version line. The first version had none, and gave
+// ten bits to the entity and sixteen to the index in its point, line and
+// param handles (see sketch.h), with the references at entity 1023; we
+// can still read those.
+#define SKF_VERSION     2
+
 typedef struct {
     const char    *str;
     int      type;
@@ -130,6 +136,24 @@ static void WriteLiteralString(FILE *f, char *s)
     fprintf(f, "\n");
 }
 
+//-----------------------------------------------------------------------------
+// Convert a point, line, or param handle from a version 1 file, which kept
+// the entity in bits 25:16 and the index in bits 15:0. The entity's line
+// in the file already checked that the index fits.
+//-----------------------------------------------------------------------------
+static hEntity EntityFromVersion1(hEntity he)
+{
+    return (he == 1023) ? REFERENCE_ENTITY : he;
+}
+static DWORD HandleFromVersion1(DWORD h)
+{
+    DWORD flags = h & 0xf0000000;
+    hEntity he = (h >> 16) & 1023;
+    DWORD k = h & 0xffff;
+
+    return flags | (EntityFromVersion1(he) << 12) | (k & 0xfff);
+}
+
 static BOOL ReadLiteralString(FILE *f, char *s, int n)
 {
     if(!fgets(s, n, f)) return FALSE;
@@ -148,8 +172,11 @@ BOOL SaveToFile(char *name)
         return FALSE;
     }
 
+    // First, the version, which says how to read the handles.
+    fprintf(f, "VERSION %d\n\n", SKF_VERSION);
+
     int i, j;
-    // First, the parameters
+    // Then the parameters
     for(i = 0; i < SK->params; i++) {
         fprintf(f, "PARAM %08x %.9f\n", SK->param[i].id, SK->param[i].v);
     }
@@ -272,8 +299,9 @@ static void RefreshAllGenerated(void)
 
 void NewEmptyProgram(void)
 {
-    memset(SK, 0, sizeof(*SK));
-    memset(RSp, 0, sizeof(*RSp));
+    ClearSketch();
+    RSp->sets = 0;
+    EraseAllPolys();
     memset(DL, 0, sizeof(*DL));
 
     RefreshAllGenerated();
@@ -286,11 +314,14 @@ BOOL LoadFromFile(char *name)
         return FALSE;
     }
 
-    memset(SK, 0, sizeof(*SK));
-    memset(RSp, 0, sizeof(*RSp));
+    ClearSketch();
+    RSp->sets = 0;
+    EraseAllPolys();
     memset(DL, 0, sizeof(*DL));
 
     char line[MAX_STRING];
+    // Until we see a version line, it's an old file.
+    int version = 1;
 
     while(fgets(line, sizeof(line), f)) {
         if(line[0] == '\0') return FALSE;
@@ -326,9 +357,13 @@ BOOL LoadFromFile(char *name)
         char derived[MAX_STRING];
         char displayName[MAX_STRING];
 
-        if(sscanf(line, "PARAM %x %lg", &hp, &v)==2) {
+        if(sscanf(line, "VERSION %d", &version)==1) {
+            if(version < 1 || version > SKF_VERSION) return FALSE;
+        } else if(sscanf(line, "PARAM %x %lg", &hp, &v)==2) {
+            if(version == 1) hp = HandleFromVersion1(hp);
+
             i = SK->params;
-            if(i >= arraylen(SK->param)) oops();
+            RESERVE(SK->param, SK->paramsAlloc, i + 1);
             SK->param[i].id = hp;
             SK->param[i].v = v;
             SK->params = i + 1;
@@ -336,8 +371,18 @@ BOOL LoadFromFile(char *name)
             &layer, &construction,
             &he, &points, &lines, &params)==7)
         {
+            // Else its points, lines, and params would have handles that
+            // collide with some other entity's.
+            if(he < 1 || he > MAX_ENTITY_ID) return FALSE;
+            if(points > MAX_POINTS_FOR_ENTITY ||
+               lines > MAX_POINTS_FOR_ENTITY ||
+               params > MAX_POINTS_FOR_ENTITY)
+            {
+                return FALSE;
+            }
+
             i = SK->entities;
-            if(i >= arraylen(SK->entity)) oops();
+            RESERVE(SK->entity, SK->entitiesAlloc, i + 1);
             SK->entity[i].layer = layer;
             SK->entity[i].construction = construction;
             SK->entity[i].id = he;
@@ -376,16 +421,29 @@ BOOL LoadFromFile(char *name)
                                 &(c.offset.x), &(c.offset.y)) == 14)
         {
             c.type = StringToConstraintType(constraint);
+            if(version == 1) {
+                c.ptA = HandleFromVersion1(c.ptA);
+                c.ptB = HandleFromVersion1(c.ptB);
+                c.paramA = HandleFromVersion1(c.paramA);
+                c.paramB = HandleFromVersion1(c.paramB);
+                c.lineA = HandleFromVersion1(c.lineA);
+                c.lineB = HandleFromVersion1(c.lineB);
+                c.entityA = EntityFromVersion1(c.entityA);
+                c.entityB = EntityFromVersion1(c.entityB);
+            }
             i = SK->constraints;
+            RESERVE(SK->constraint, SK->constraintsAlloc, i + 1);
             memcpy(&(SK->constraint[i]), &c, sizeof(c));
             SK->constraints = i + 1;
         } else if(strcmp(line, "REMEMBERED_SUBSET")==0) {
             int k = RSp->sets;
-            if(k >= MAX_REMEMBERED_SUBSYSTEMS) return FALSE;
+            RESERVE(RSp->set, RSp->setsAlloc, k + 1);
+            memset(&(RSp->set[k]), 0, sizeof(RSp->set[k]));
 
             fgets(line, sizeof(line), f);
             if(sscanf(line, "    param %08x", &hp)==1) {
                 // This step represents an assumption.
+                if(version == 1) hp = HandleFromVersion1(hp);
                 RSp->set[k].eqs = 0;
                 RSp->set[k].p = hp;
             } else {
@@ -443,6 +501,7 @@ BOOL LoadFromFile(char *name)
                 fgets(line, sizeof(line), f);
                 hPoint pt;
                 if(sscanf(line, "    point %08x", &pt) != 1) return FALSE;
+                if(version == 1) pt = HandleFromVersion1(pt);
                 DL->req[k].pt[a] = pt;
             }
 
@@ -25,174 +25,896 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-static struct {
-    double      num[MAX_UNKNOWNS_AT_ONCE];
-    Expr       *sym[MAX_UNKNOWNS_AT_ONCE];
-} Function;
+// We give up on a subsystem that hasn't converged after this many steps, or
+// once its steps are this small (relative to the unknowns themselves),
+// since there's no point iterating any further.
+#define NEWTON_MAX_ITERATIONS   50
+#define NEWTON_MIN_STEP         1e-12
 
-static struct {
-    double      num[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
-    Expr       *sym[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
-} Jacobian;
+// A function has converged once it's within DEFAULT_TOL of zero, scaled to
+// what the function measures (see NewtonScale()), plus this much of the
+// terms that cancel to make it, for the roundoff in those.
+#define NEWTON_RELATIVE_TOL     1e-12
 
-static hParam unkwn[MAX_UNKNOWNS_AT_ONCE];
-static double InitialGuess[MAX_UNKNOWNS_AT_ONCE];
+// The line search backs off from a Newton step until it reduces the
+// residual by at least this fraction of what the full step promised, for
+// at most this many halvings of the step.
+#define LINE_SEARCH_DECREASE    1e-4
+#define LINE_SEARCH_HALVINGS    8
 
-static double X[MAX_UNKNOWNS_AT_ONCE];
-static int N;
+//-----------------------------------------------------------------------------
+// The subsystems that we're about to solve. These get prepared one at a
+// time, and then iterated all at once. The caller guarantees that none of
+// them mentions another's unknowns, so each one writes only its own
+// unknowns in Value[], and reads only those and parameters that are known;
+// so they can be iterated in parallel, on different threads.
+//-----------------------------------------------------------------------------
+typedef struct {
+    int         N;
+    int        *eqn;
+    hParam     *unkwn;
+    int        *unkwnSlot;
+
+    // The functions and the Jacobian, compiled together to a single tape,
+    // with the N functions first and then the N*N Jacobian entries in row
+    // order; or just the functions, if we're differentiating on the tape.
+    // And the functions alone, for the iterations that don't need a new
+    // Jacobian.
+    BOOL        dual;
+    ExprTape    tape;
+    ExprTape    ftape;
+
+    // A subsystem that's too big to solve densely gets a sparse Jacobian
+    // instead, with just its structurally nonzero entries on the tape
+    // after the functions, in the order that sp wants them.
+    BOOL        sparse;
+    SparseLU   *sp;
+
+    // The functions, the step, and where the step started from, and
+    // everything evaluated on the tape.
+    double     *fnum;
+    double     *X;
+    double     *x0;
+    double     *tapeOut;
+
+    // How close to zero each function must get for us to call it
+    // converged, worked out from the Jacobian when we evaluate that.
+    double     *ftol;
+    double     *fscale;
+    double     *fmag;
+
+    BOOL        converged;
+
+    // How we got there, for the debug output: the residual at the start
+    // and after each step, and the work that it took.
+    int         iterations;
+    int         jacobians;
+    double      residual[NEWTON_MAX_ITERATIONS + 2];
+} NewtonSystem;
+
+// The dense numerical work, one of these per thread.
+typedef struct {
+    double      jnum[MAX_UNKNOWNS_AT_ONCE][MAX_UNKNOWNS_AT_ONCE];
+    int         perm[MAX_UNKNOWNS_AT_ONCE];
+    double      tapeGrad[MAX_NUMERICAL_UNKNOWNS*MAX_NUMERICAL_UNKNOWNS];
+} NewtonScratch;
+
+// Handing work to the other threads isn't free, so it's not worth it
+// unless the subsystems are big enough, counted in tape instructions.
+#define MIN_PARALLEL_INSTRS     2000
+
+// We keep stepping with an old Jacobian for as long as each step cuts the
+// residual by at least this factor; when one doesn't, we get a new one.
+#define CHORD_MIN_DECREASE      0.25
+
+// How we get the Jacobian: either by evaluating the symbolic partials, or by
+// forward-mode automatic differentiation of the functions. The symbolic
+// partials are cached across solves, so they're best when we're solving
+// the same equations again (e.g. while dragging). Otherwise we would have
+// to write N*N derivatives just to evaluate them a few times, and the
+// automatic differentiation is cheaper.
+int JacobianMethod = JACOBIAN_AUTOMATIC;
+
+//-----------------------------------------------------------------------------
+// A cache of symbolic partial derivatives of the equations, kept across
+// calls to Solve(). When the user drags a point, the equations don't
+// change, so there's no need to differentiate them all over again; we just
+// evaluate the same derivatives about a new point. The cache is keyed by
+// equation handle and parameter, and checked against a hash of the
+// equation, since some equations are written with numbers from the current
+// sketch baked in as constants. The derivatives are copied into memory of
+// our own, since the per-solve expressions are all freed when we finish.
+//-----------------------------------------------------------------------------
+#define PARTIAL_HASH            32749
+#define PARTIAL_CHUNK           4096
+#define MAX_PARTIAL_NODES       (1024*1024)
+typedef struct PartialChunkTag PartialChunk;
+struct PartialChunkTag {
+    PartialChunk    *next;
+    Expr             e[PARTIAL_CHUNK];
+};
+
+//-----------------------------------------------------------------------------
+// Our state, which belongs to the solver context; so a solve on one thread
+// doesn't touch what a solve on another is using.
+//-----------------------------------------------------------------------------
+struct NewtonStateTag {
+    // The symbolic functions and Jacobian, while we're preparing a
+    // subsystem.
+    Expr            **functionSym;
+    Expr *jacobianSym[MAX_NUMERICAL_UNKNOWNS][MAX_NUMERICAL_UNKNOWNS];
+    Expr            **tapeExprs;
+
+    // The values of all the parameters, which we iterate on, and copy back
+    // to the sketch only if we converge.
+    double          *value;
+    int             valueAlloc;
+
+    NewtonSystem    system[MAX_SUBSYSTEMS_AT_ONCE];
+    int             systems;
+
+    // The sparse factorizations, kept (with their memory) from one batch to
+    // the next; System[k] uses Sparse[k], if it needs one.
+    SparseLU        sparse[MAX_SUBSYSTEMS_AT_ONCE];
+
+    // While preparing a sparse subsystem, the column of the Jacobian for
+    // each parameter (or -1 if it's not one of our unknowns), and the last
+    // row in which we found each column.
+    int             *columnOfSlot;
+    int             columnOfSlotAlloc;
+    int             *columnSeen;
+    int             columnSeenAlloc;
+    struct {
+        int     row;
+        int     col;
+    }               *mention;
+    int             mentions;
+    int             mentionAlloc;
+
+    NewtonScratch   *scratch;
+    int             scratches;
+
+    // The cache of partials.
+    struct {
+        struct {
+            BOOL        used;
+            hEquation   he;
+            hParam      p;
+            DWORD       fingerprint;
+            Expr       *d;
+        }               entry[PARTIAL_HASH];
+        int             entries;
+
+        PartialChunk   *chunk;
+        int             inChunk;
+        int             nodes;
+    }               partials;
+
+    // The derivative of an equation with respect to a parameter that it
+    // doesn't mention.
+    Expr            partialZero;
+};
+#define FunctionSym         (SC->newton->functionSym)
+#define JacobianSym         (SC->newton->jacobianSym)
+#define TapeExprs           (SC->newton->tapeExprs)
+#define Value               (SC->newton->value)
+#define ValueAlloc          (SC->newton->valueAlloc)
+#define System              (SC->newton->system)
+#define Systems             (SC->newton->systems)
+#define Sparse              (SC->newton->sparse)
+#define ColumnOfSlot        (SC->newton->columnOfSlot)
+#define ColumnOfSlotAlloc   (SC->newton->columnOfSlotAlloc)
+#define ColumnSeen          (SC->newton->columnSeen)
+#define ColumnSeenAlloc     (SC->newton->columnSeenAlloc)
+#define Mention             (SC->newton->mention)
+#define Mentions            (SC->newton->mentions)
+#define MentionAlloc        (SC->newton->mentionAlloc)
+#define Scratch             (SC->newton->scratch)
+#define Scratches           (SC->newton->scratches)
+#define Partials            (SC->newton->partials)
+#define PartialZero         (SC->newton->partialZero)
+
+void NewtonAllocState(SolverContext *sc)
+{
+    sc->newton = (struct NewtonStateTag *)DAlloc(sizeof(*(sc->newton)));
+    if(!sc->newton) oops();
+    memset(sc->newton, 0, sizeof(*(sc->newton)));
+
+    sc->newton->partialZero.op = EXPR_CONSTANT;
+}
+
+void NewtonFreeState(SolverContext *sc)
+{
+    struct NewtonStateTag *n = sc->newton;
+
+    UNRESERVE(n->value, n->valueAlloc);
+    UNRESERVE(n->columnOfSlot, n->columnOfSlotAlloc);
+    UNRESERVE(n->columnSeen, n->columnSeenAlloc);
+    UNRESERVE(n->mention, n->mentionAlloc);
+    if(n->scratch) DFree(n->scratch);
+
+    int k;
+    for(k = 0; k < MAX_SUBSYSTEMS_AT_ONCE; k++) {
+        SparseFree(&(n->sparse[k]));
+    }
+
+    while(n->partials.chunk) {
+        PartialChunk *next = n->partials.chunk->next;
+        DFree(n->partials.chunk);
+        n->partials.chunk = next;
+    }
 
-static void pm(void)
+    DFree(n);
+    sc->newton = NULL;
+}
+
+static Expr *AllocPartialExpr(void)
+{
+    if(!Partials.chunk || Partials.inChunk >= PARTIAL_CHUNK) {
+        PartialChunk *c = (PartialChunk *)DAlloc(sizeof(PartialChunk));
+        if(!c) oops();
+        c->next = Partials.chunk;
+        Partials.chunk = c;
+        Partials.inChunk = 0;
+    }
+    Expr *e = &(Partials.chunk->e[Partials.inChunk]);
+    memset(e, 0, sizeof(*e));
+    (Partials.inChunk)++;
+    (Partials.nodes)++;
+
+    return e;
+}
+
+//-----------------------------------------------------------------------------
+// Discard the cached partials. We do that whenever the equations have been
+// changed by the user, or when the cache has filled up (because e.g. the
+// user keeps changing a dimension, and every value gives a new equation).
+//-----------------------------------------------------------------------------
+void ForgetPartials(BOOL always)
+{
+    if(!always && Partials.nodes < MAX_PARTIAL_NODES &&
+        Partials.entries < (PARTIAL_HASH*3)/4)
+    {
+        return;
+    }
+
+    while(Partials.chunk) {
+        PartialChunk *next = Partials.chunk->next;
+        DFree(Partials.chunk);
+        Partials.chunk = next;
+    }
+    Partials.inChunk = 0;
+    Partials.nodes = 0;
+
+    memset(Partials.entry, 0, sizeof(Partials.entry));
+    Partials.entries = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Return the symbolic partial derivative of EQ->eqn[eq] with respect to
+// the parameter p, from the cache if possible. Equations are not pruned
+// against the known parameters first; those just evaluate numerically.
+//-----------------------------------------------------------------------------
+Expr *PartialForEquation(int eq, hParam p)
+{
+    Expr *e = EQ->eqn[eq].e;
+    hEquation he = EQ->eqn[eq].he;
+
+    if(!EQ->eqn[eq].fingerprintValid) {
+        EQ->eqn[eq].fingerprint = EHash(e);
+        EQ->eqn[eq].fingerprintValid = TRUE;
+    }
+    DWORD fp = EQ->eqn[eq].fingerprint;
+
+    DWORD h = (he*31 + p) % PARTIAL_HASH;
+    while(Partials.entry[h].used) {
+        if(Partials.entry[h].he == he && Partials.entry[h].p == p) break;
+        h = (h + 1) % PARTIAL_HASH;
+    }
+    if(Partials.entry[h].used && Partials.entry[h].fingerprint == fp) {
+        return Partials.entry[h].d;
+    }
+
+    Expr *d;
+    if(EIndependentOf(e, p)) {
+        d = &PartialZero;
+    } else {
+        d = EPartial(e, p);
+    }
+
+    // If the cache is full, then just work from the per-solve copy, and
+    // we'll clear things out before we solve next time.
+    if(Partials.nodes >= MAX_PARTIAL_NODES) return d;
+    if(!Partials.entry[h].used && Partials.entries >= (PARTIAL_HASH*3)/4) {
+        return d;
+    }
+
+    if(d != &PartialZero) {
+        d = ECopy(d, AllocPartialExpr);
+    }
+    if(!Partials.entry[h].used) {
+        Partials.entry[h].used = TRUE;
+        Partials.entry[h].he = he;
+        Partials.entry[h].p = p;
+        (Partials.entries)++;
+    }
+    Partials.entry[h].fingerprint = fp;
+    Partials.entry[h].d = d;
+
+    return d;
+}
+
+static void pm(NewtonSystem *s, NewtonScratch *w, int n)
 {
     int i, j;
     
     char buf[1024];
-    for(i = 0; i < N; i++) {
+    for(i = 0; i < n; i++) {
         OutputDebugString("[ ");
-        for(j = 0; j < N; j++) {
-            sprintf(buf, "%3.3f ", Jacobian.num[i][j]);
+        for(j = 0; j < n; j++) {
+            sprintf(buf, "%3.3f ", w->jnum[i][j]);
             OutputDebugString(buf);
         }
-        sprintf(buf, "| %3.3f ]   [ %3.3f ]\n", Function.num[i], X[i]);
+        sprintf(buf, "| %3.3f ]   [ %3.3f ]\n", s->fnum[i], s->X[i]);
         OutputDebugString(buf);
     }
     OutputDebugString("\n");
 }
 
-static BOOL SolveJacobian(void)
+static int ByIndex(const void *av, const void *bv)
 {
-    return SolveLinearSystem(X, Jacobian.num, Function.num, N);
+    return *((const int *)av) - *((const int *)bv);
 }
 
-BOOL SolveNewton(int subSys)
+//-----------------------------------------------------------------------------
+// Start a new batch of subsystems to solve, from the current values of
+// the parameters. Each subsystem copies in the values that it reads when
+// it's prepared; a big sketch can take thousands of batches, so we mustn't
+// copy all of them each time.
+//-----------------------------------------------------------------------------
+void NewtonBegin(void)
 {
-    int i, j;
+    Systems = 0;
 
-    // First, count the number of equations to solve simultaneously.
-    N = 0;
-    for(i = 0; i < EQ->eqns; i++) {
-        if(EQ->eqn[i].subSys == subSys) {
-            if(N >= MAX_NUMERICAL_UNKNOWNS) oops();
+    RESERVE(Value, ValueAlloc, SK->params);
+}
 
-            Function.sym[N] = EEvalKnown(EQ->eqn[i].e);
+//-----------------------------------------------------------------------------
+// Record which of our unknowns the equation in row i of the Jacobian
+// mentions, once each.
+//-----------------------------------------------------------------------------
+static void NewtonMentions(Expr *e, int i)
+{
+    switch(e->op) {
+        case EXPR_PARAM: {
+            int j = ColumnOfSlot[EParamSlot(e)];
+            if(j < 0 || ColumnSeen[j] == i) return;
+            ColumnSeen[j] = i;
 
-            N++;
+            RESERVE(Mention, MentionAlloc, Mentions + 1);
+            Mention[Mentions].row = i;
+            Mention[Mentions].col = j;
+            Mentions++;
+            return;
         }
+
+        case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
+            return;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            NewtonMentions(e->e0, i);
+            NewtonMentions(e->e1, i);
+            return;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            NewtonMentions(e->e0, i);
+            return;
+
+        default:
+            oops();
     }
+}
+
+//-----------------------------------------------------------------------------
+// Compile a subsystem that's too big for a dense Jacobian. Each equation
+// mentions only a few of the unknowns, so we write only those partials,
+// column by column, and work out the order in which to factor them. That
+// depends only on which partials there are, so it's good for every
+// iteration.
+//-----------------------------------------------------------------------------
+static void NewtonPrepareSparse(NewtonSystem *s)
+{
+    int N = s->N;
+    int i, j, p;
 
-    // And make a list of unknowns that we're solving for.
-    int np = 0;
+    RESERVE(ColumnOfSlot, ColumnOfSlotAlloc, SK->params);
+    RESERVE(ColumnSeen, ColumnSeenAlloc, N);
     for(i = 0; i < SK->params; i++) {
-        if(SK->param[i].mark != 0) {
-            if(np >= MAX_NUMERICAL_UNKNOWNS) oops();
+        ColumnOfSlot[i] = -1;
+    }
+    for(j = 0; j < N; j++) {
+        ColumnOfSlot[s->unkwnSlot[j]] = j;
+        ColumnSeen[j] = -1;
+    }
+
+    // We differentiate the equations as written, not as pruned, so go by
+    // what those mention.
+    Mentions = 0;
+    for(i = 0; i < N; i++) {
+        NewtonMentions(EQ->eqn[s->eqn[i]].e, i);
+    }
 
-            unkwn[np] = SK->param[i].id;
-            InitialGuess[np] = SK->param[i].v;
+    // Sort those into columns; they're in order by row already.
+    int *colStart = (int *)EArenaAlloc((N + 1)*sizeof(int));
+    int *row = (int *)EArenaAlloc((Mentions + 1)*sizeof(int));
+    for(j = 0; j <= N; j++) {
+        colStart[j] = 0;
+    }
+    for(p = 0; p < Mentions; p++) {
+        (colStart[Mention[p].col + 1])++;
+    }
+    for(j = 0; j < N; j++) {
+        colStart[j+1] += colStart[j];
+    }
+    for(p = 0; p < Mentions; p++) {
+        row[(colStart[Mention[p].col])++] = Mention[p].row;
+    }
+    for(j = N; j > 0; j--) {
+        colStart[j] = colStart[j-1];
+    }
+    colStart[0] = 0;
 
-            np++;
+    int k = 0;
+    TapeExprs = (Expr **)EArenaAlloc((N + Mentions)*sizeof(Expr *));
+    for(i = 0; i < N; i++) {
+        TapeExprs[k++] = FunctionSym[i];
+    }
+    for(j = 0; j < N; j++) {
+        for(p = colStart[j]; p < colStart[j+1]; p++) {
+            TapeExprs[k++] = PartialForEquation(s->eqn[row[p]], s->unkwn[j]);
         }
     }
-    if(np != N) {
-        dbp("eqs=%d unknowns=%d", N, np);
+    ECompileTape(&(s->tape), TapeExprs, k);
+    ECompileTape(&(s->ftape), FunctionSym, N);
+
+    SparseAnalyze(s->sp, N, colStart, row);
+    dbp2("sparse: %d unknowns, %d nonzeros", N, Mentions);
+}
+
+//-----------------------------------------------------------------------------
+// Add a subsystem to the batch: the equations eqn[] (indices into EQ->eqn[])
+// in the unknowns param[] (indices into SK->param[]). This writes the
+// functions, pruned against the known parameters, and the Jacobian, and
+// compiles them. All of that's allocated on the expression arena, so it's
+// the caller's job to free it once the batch is solved. Subsystems with up
+// to MAX_NUMERICAL_UNKNOWNS unknowns get a dense Jacobian, and bigger ones
+// a sparse one.
+//-----------------------------------------------------------------------------
+void NewtonPrepare(int *eqn, int eqns, int *param, int params)
+{
+    int i, j;
+
+    if(Systems >= MAX_SUBSYSTEMS_AT_ONCE) oops();
+    NewtonSystem *s = &System[Systems];
+
+    if(eqns != params) {
+        dbp("eqs=%d unknowns=%d", eqns, params);
         oops();
     }
+    int N = eqns;
+    s->N = N;
+    s->eqn = (int *)EArenaAlloc(N*sizeof(int));
+    s->unkwn = (hParam *)EArenaAlloc(N*sizeof(hParam));
+    s->unkwnSlot = (int *)EArenaAlloc(N*sizeof(int));
+    FunctionSym = (Expr **)EArenaAlloc(N*sizeof(Expr *));
+
+    // Sort these into the order in which they appear in the sketch, so that
+    // we solve the same way however the subsystem was found.
+    memcpy(s->eqn, eqn, N*sizeof(int));
+    qsort(s->eqn, N, sizeof(int), ByIndex);
+    memcpy(s->unkwnSlot, param, N*sizeof(int));
+    qsort(s->unkwnSlot, N, sizeof(int), ByIndex);
 
-    // Now write the symbolic Jacobian, using the symbolic differentiation
-    // routines.
     for(i = 0; i < N; i++) {
-        for(j = 0; j < N; j++) {
-            Expr *p;
-            if(EIndependentOf(Function.sym[i], unkwn[j])) {
-                // A bit of optimisation.
-                p = EConstant(0);
-            } else {
-                p = EPartial(Function.sym[i], unkwn[j]);
-                p = EEvalKnown(p);
-            }
-            Jacobian.sym[i][j] = p;
-            EPrint("diff: ", Jacobian.sym[i][j]);
-        }
+        FunctionSym[i] = EEvalKnown(EQ->eqn[s->eqn[i]].e);
+        s->unkwn[i] = SK->param[s->unkwnSlot[i]].id;
+    }
+
+    s->sparse = (N > MAX_NUMERICAL_UNKNOWNS);
+    s->sp = &Sparse[Systems];
+    if(s->sparse) {
+        // The gradients on the tape are dense, so that's no good here.
+        s->dual = FALSE;
+    } else if(JacobianMethod == JACOBIAN_AUTOMATIC) {
+        s->dual = SK->eqnsDirty;
+    } else {
+        s->dual = (JacobianMethod == JACOBIAN_DUAL);
     }
 
     dbp2("");
     dbp2("solving for %d equations", N);
     for(i = 0; i < N; i++) {
-        EPrint("eq: ", Function.sym[i]);
+        EPrint("eq: ", FunctionSym[i]);
     }
 
-    // And iterate.
-    BOOL converged;
-    int iter = 0;
-    for(;;) {
-        // First, evaluate the functions given the current parameters.
+    int k = 0;
+    if(s->sparse) {
+        NewtonPrepareSparse(s);
+    } else if(s->dual) {
+        // We'll get the Jacobian along with the functions, so the tape
+        // needs just the functions.
+        ECompileTape(&(s->tape), FunctionSym, N);
+        ETapeSetUnknowns(&(s->tape), s->unkwnSlot, N);
+        s->ftape = s->tape;
+    } else {
+        // Now get the symbolic Jacobian. That's probably cached from last
+        // time we solved; if not, then it's written using the symbolic
+        // differentiation routines.
         for(i = 0; i < N; i++) {
-            Function.num[i] = EEval(Function.sym[i]);
-            dbp2("eqn[%d] is %.3f", i, Function.num[i]);
+            for(j = 0; j < N; j++) {
+                JacobianSym[i][j] = PartialForEquation(s->eqn[i], s->unkwn[j]);
+                EPrint("diff: ", JacobianSym[i][j]);
+            }
         }
 
-        // Now evaluate the Jacobian.
+        // Flatten everything that we'll evaluate in the loop, so that each
+        // iteration is one pass over the tape instead of N*(N+1) tree
+        // walks.
+        TapeExprs = (Expr **)EArenaAlloc(N*(N + 1)*sizeof(Expr *));
+        for(i = 0; i < N; i++) {
+            TapeExprs[k++] = FunctionSym[i];
+        }
         for(i = 0; i < N; i++) {
             for(j = 0; j < N; j++) {
-                Jacobian.num[i][j] = EEval(Jacobian.sym[i][j]);
-                dbp2("jacobian[%d][%d] is %.3f", i, j,
-                    Jacobian.num[i][j]);
+                TapeExprs[k++] = JacobianSym[i][j];
             }
         }
+        ECompileTape(&(s->tape), TapeExprs, k);
+        ECompileTape(&(s->ftape), FunctionSym, N);
+    }
+    s->tape.value = Value;
+    s->ftape.value = Value;
+    s->converged = FALSE;
 
-        if(SolveJacobian())  {
-            // The Newton step looks like
-            //      J(x_n) (x_{n+1} - x_n) = 0 - F(x_n)
-            for(i = 0; i < N; i++) {
-                hParam p = unkwn[i];
-                double v = EvalParam(p);
-                v -= 0.98*X[i];
-                ForceParam(p, v);
+    // The functions are on the tape too, so it reads everything that we'll
+    // ask of Value[], except for any unknown that dropped out of them.
+    for(i = 0; i < N; i++) {
+        Value[s->unkwnSlot[i]] = SK->param[s->unkwnSlot[i]].v;
+    }
+    for(i = 0; i < s->tape.instrs; i++) {
+        ExprInstr *in = &(s->tape.instr[i]);
+        if(in->op == EXPR_PARAM) Value[in->a] = SK->param[in->a].v;
+    }
+
+    s->fnum = (double *)EArenaAlloc((6*N + s->tape.outs)*sizeof(double));
+    s->X = s->fnum + N;
+    s->x0 = s->X + N;
+    s->ftol = s->x0 + N;
+    s->fscale = s->ftol + N;
+    s->fmag = s->fscale + N;
+    s->tapeOut = s->fmag + N;
+
+    Systems++;
+}
+
+//-----------------------------------------------------------------------------
+// The largest magnitude of any of a subsystem's functions, as evaluated
+// into tapeOut[].
+//-----------------------------------------------------------------------------
+static double NewtonResidual(NewtonSystem *s)
+{
+    int i;
+    double norm = 0;
+    for(i = 0; i < s->N; i++) {
+        if(fabs(s->tapeOut[i]) > norm) norm = fabs(s->tapeOut[i]);
+    }
+    return norm;
+}
+
+//-----------------------------------------------------------------------------
+// Move the unknowns to alpha of the way along the Newton step X[] from
+// where they were at the start of this iteration, and return the residual
+// there.
+//-----------------------------------------------------------------------------
+static double NewtonTryStep(NewtonSystem *s, double alpha)
+{
+    int i;
+    for(i = 0; i < s->N; i++) {
+        Value[s->unkwnSlot[i]] = s->x0[i] - alpha*(s->X[i]);
+    }
+    EEvalTape(&(s->ftape), s->tapeOut);
+    return NewtonResidual(s);
+}
+
+//-----------------------------------------------------------------------------
+// The partial of function i with respect to unknown j is d; so note how
+// that scales what counts as zero for function i. A function that's a
+// length is zero within DEFAULT_TOL, but the others might be squared
+// lengths, or angles, or whatever else. So we scale DEFAULT_TOL by the
+// most that the function changes for each unit that we move one of its
+// unknowns, which makes it the distance that we'd have to move them to
+// satisfy it. A line's angle isn't a length, though, and the function
+// changes with it in proportion to how far out the line is, which tells us
+// nothing; so we leave those out, and a function of angles alone is taken
+// as it stands.
+//
+// And the roundoff in a function is proportional to the terms that cancel
+// to make it, which are about d times the unknown for each unknown.
+//-----------------------------------------------------------------------------
+static void NewtonScale(NewtonSystem *s, int i, int j, double d)
+{
+    d = fabs(d);
+    if(!(s->unkwn[j] & THETA_FOR_LINE(0)) && d > s->fscale[i]) {
+        s->fscale[i] = d;
+    }
+    s->fmag[i] += d*fabs(Value[s->unkwnSlot[j]]);
+}
+static void NewtonTolerances(NewtonSystem *s)
+{
+    int i;
+    for(i = 0; i < s->N; i++) {
+        double scale = (s->fscale[i] > 0) ? s->fscale[i] : 1;
+        s->ftol[i] = DEFAULT_TOL*scale + NEWTON_RELATIVE_TOL*s->fmag[i];
+
+        s->fscale[i] = 0;
+        s->fmag[i] = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Run Newton's method on a prepared subsystem, using the given scratch
+// space. This touches nothing shared except for Value[], and so can run
+// on any thread.
+//
+// Most of the work is in evaluating and factoring the Jacobian, so we
+// don't do that every iteration. Once we've factored it, we keep stepping
+// with those factors (the chord method) for as long as that keeps cutting
+// the residual quickly, evaluating just the functions; and when it stops
+// doing that, we evaluate and factor the Jacobian at the current point.
+//
+// From a bad initial guess, the full Newton step can make things worse,
+// so with a new Jacobian we search back along the step for a point that
+// reduces the residual. Factors are only reused after a full step that
+// worked, since a stale Jacobian far from the solution can take us
+// somewhere that we don't come back from.
+//-----------------------------------------------------------------------------
+static void NewtonIterate(NewtonSystem *s, NewtonScratch *w)
+{
+    int N = s->N;
+    int i, j, k;
+
+    BOOL converged = FALSE;
+    BOOL reuse = FALSE, fresh, full;
+    double norm, trial, alpha, step, d;
+
+    s->iterations = 0;
+    s->jacobians = 0;
+    for(i = 0; i < N; i++) {
+        s->fscale[i] = 0;
+        s->fmag[i] = 0;
+    }
+
+    EEvalTape(&(s->ftape), s->tapeOut);
+    norm = NewtonResidual(s);
+    s->residual[0] = norm;
+
+    for(;;) {
+        if(!reuse) {
+            // Evaluate the functions and the Jacobian given the current
+            // parameters, and factor the Jacobian.
+            if(s->dual) {
+                EEvalTapeWithGradient(&(s->tape), s->tapeOut, w->tapeGrad);
+            } else {
+                EEvalTape(&(s->tape), s->tapeOut);
+            }
+
+            BOOL singular;
+            if(s->sparse) {
+                // The partials are on the tape in the order that the
+                // factorization wants them, which is by columns.
+                SparseLU *sp = s->sp;
+                for(j = 0; j < N; j++) {
+                    for(k = sp->colStart[j]; k < sp->colStart[j+1]; k++) {
+                        NewtonScale(s, sp->row[k], j, s->tapeOut[N + k]);
+                    }
+                }
+                NewtonTolerances(s);
+                singular = !SparseFactor(s->sp, s->tapeOut + N);
+            } else {
+                k = N;
+                for(i = 0; i < N; i++) {
+                    for(j = 0; j < N; j++) {
+                        if(s->dual) {
+                            w->jnum[i][j] = w->tapeGrad[i*N + j];
+                        } else {
+                            w->jnum[i][j] = s->tapeOut[k++];
+                        }
+                        NewtonScale(s, i, j, w->jnum[i][j]);
+                    }
+                }
+                NewtonTolerances(s);
+                singular = !FactorLinearSystem(w->jnum, w->perm, N);
+            }
+
+            (s->jacobians)++;
+            if(singular) {
+                s->converged = FALSE;
+                return;
             }
+            fresh = TRUE;
         } else {
-            dbp2("singular Jacobian");
-            goto failed;
+            // We'll reuse the factors, and we evaluated the functions here
+            // when we took the last step.
+            fresh = FALSE;
+        }
+        for(i = 0; i < N; i++) {
+            s->fnum[i] = s->tapeOut[i];
         }
 
-        // Now check if we've converged, and break if we have. We deliberately
-        // don't check for convergence until we've run at least one Newton
-        // iteration. This is because two linearly dependent constraints
-        // that happen to be satisfied right now are still bad; if we just
-        // checked for convergence, without checking for an invertible
-        // Jacobian, then the rest of the code would incorrectly treat those
-        // two constraints as restraining two degrees of freedom.
+        // Check if we've converged, but don't break yet. We deliberately
+        // don't stop until we've run at least one Newton iteration. This
+        // is because two linearly dependent constraints that happen to be
+        // satisfied right now are still bad; if we just checked for
+        // convergence, without checking for an invertible Jacobian, then
+        // the rest of the code would incorrectly treat those two
+        // constraints as restraining two degrees of freedom.
         converged = TRUE;
         for(i = 0; i < N; i++) {
-            if(!tol(Function.num[i], 0)) {
+            if(fabs(s->fnum[i]) >= s->ftol[i]) {
                 converged = FALSE;
             }
         }
+
+        // The Newton step looks like
+        //      J(x_n) (x_{n+1} - x_n) = 0 - F(x_n)
+        if(s->sparse) {
+            SparseSolve(s->sp, s->X, s->fnum);
+        } else {
+            SolveFactoredSystem(s->X, w->jnum, w->perm, s->fnum, N);
+        }
+        for(i = 0; i < N; i++) {
+            s->x0[i] = Value[s->unkwnSlot[i]];
+        }
+
+        alpha = 0.98;
+        trial = NewtonTryStep(s, alpha);
+        full = (trial <= (1 - LINE_SEARCH_DECREASE*alpha)*norm);
+        if(fresh && !full && !converged) {
+            for(k = 0; k < LINE_SEARCH_HALVINGS; k++) {
+                alpha /= 2;
+                trial = NewtonTryStep(s, alpha);
+                if(trial <= (1 - LINE_SEARCH_DECREASE*alpha)*norm) break;
+            }
+            if(k >= LINE_SEARCH_HALVINGS) {
+                // Nothing along this direction reduces the residual, so
+                // take the whole step anyway; Newton's method sometimes
+                // gets worse before it gets better.
+                alpha = 0.98;
+                trial = NewtonTryStep(s, alpha);
+            }
+        }
+
+        if(!fresh && !converged && trial > CHORD_MIN_DECREASE*norm) {
+            // The old Jacobian isn't good enough any more, so forget that
+            // step, and go round again to get a new one where we were.
+            for(i = 0; i < N; i++) {
+                Value[s->unkwnSlot[i]] = s->x0[i];
+            }
+            reuse = FALSE;
+            continue;
+        }
+
+        (s->iterations)++;
+        s->residual[s->iterations] = trial;
+        norm = trial;
+
         if(converged) break;
-        if(iter > 50) break;
-        iter++;
+        if(s->iterations > NEWTON_MAX_ITERATIONS) break;
+
+        // If we're not moving any more, then we're not going to converge.
+        step = 0;
+        for(i = 0; i < N; i++) {
+            d = fabs(alpha*(s->X[i]))/(1 + fabs(s->x0[i]));
+            if(d > step) step = d;
+        }
+        if(step < NEWTON_MIN_STEP) break;
+
+        if(fresh) reuse = full;
     }
-    dbp2("");
-    dbp2("");
 
-    if(!converged) {
-        dbp2("no convergence");
-        goto failed;
+    s->converged = converged;
+}
+
+static void NewtonJob(int job, int worker)
+{
+    NewtonIterate(&System[job], &Scratch[worker]);
+}
+
+//-----------------------------------------------------------------------------
+// Solve every subsystem in the batch, in parallel if there's enough work to
+// make that worthwhile. The ones that converge get their unknowns written
+// back to the sketch; if any doesn't, then we return FALSE. The others are
+// left where they were, since we probably made them worse rather than
+// better.
+//-----------------------------------------------------------------------------
+BOOL NewtonSolvePrepared(void)
+{
+    int i, k;
+
+    int workers = WorkerThreads();
+    if(Scratches < workers) {
+        DFree(Scratch);
+        Scratch = (NewtonScratch *)DAlloc(workers*sizeof(NewtonScratch));
+        if(!Scratch) oops();
+        Scratches = workers;
     }
-    return TRUE;
 
-failed:
-    // If we didn't converge, then we probably made our solution worse
-    // rather than better. We should therefore put the parameters back
-    // where they were.
-    np = 0;
-    for(i = 0; i < SK->params; i++) {
-        if(SK->param[i].mark != 0) {
-            if(np >= MAX_NUMERICAL_UNKNOWNS) oops();
+    int instrs = 0;
+    for(k = 0; k < Systems; k++) {
+        instrs += System[k].tape.instrs;
+    }
+    if(Systems > 1 && workers > 1 && instrs >= MIN_PARALLEL_INSTRS) {
+        RunInParallel(NewtonJob, Systems);
+    } else {
+        for(k = 0; k < Systems; k++) {
+            NewtonIterate(&System[k], &Scratch[0]);
+        }
+    }
 
-            SK->param[i].v = InitialGuess[np];
+    BOOL ok = TRUE;
+    for(k = 0; k < Systems; k++) {
+        NewtonSystem *s = &System[k];
 
-            np++;
+        SolverStats *st = &(SC->stats);
+        RESERVE(st->block, st->blockAlloc, st->blocks + 1);
+        RESERVE(st->residual, st->residualAlloc,
+                                        st->residuals + s->iterations + 1);
+        NewtonBlockStats *b = &(st->block[st->blocks]);
+        b->unknowns = s->N;
+        b->iterations = s->iterations;
+        b->jacobians = s->jacobians;
+        b->converged = s->converged;
+        b->residualStart = st->residuals;
+        for(i = 0; i <= s->iterations; i++) {
+            st->residual[(st->residuals)++] = s->residual[i];
+        }
+        (st->blocks)++;
+        st->iterations += s->iterations;
+        st->jacobians += s->jacobians;
+
+        if(!s->converged) {
+            dbp2("no convergence for subsystem %d of %d, residual %.3g",
+                k, Systems, s->residual[s->iterations]);
+            (st->failed)++;
+            ok = FALSE;
+            continue;
+        }
+        for(i = 0; i < s->N; i++) {
+            SK->param[s->unkwnSlot[i]].v = Value[s->unkwnSlot[i]];
         }
     }
-    if(np != N) oops();
+    return ok;
+}
 
-    return FALSE;
+//-----------------------------------------------------------------------------
+// Start counting the work of a new solve. The tables in SC->stats keep their
+// memory, since the next solve will probably want about as much.
+//-----------------------------------------------------------------------------
+void NewtonForgetStats(void)
+{
+    SolverStats *st = &(SC->stats);
+    st->blocks = 0;
+    st->residuals = 0;
+    st->iterations = 0;
+    st->jacobians = 0;
+    st->failed = 0;
+    st->time = 0;
 }
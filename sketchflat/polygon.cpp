@@ -24,11 +24,15 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-static DoublePoint PtBuf[MAX_PWLS_IN_SKETCH];
+// Scratch buffers; these grow to fit the biggest polygon that we've seen,
+// and are kept around between calls.
+static DoublePoint *PtBuf;
+static int PtBufAlloc;
 
-static SketchPwl AllBuf[MAX_PWLS_IN_SKETCH];
-static SketchPwl BrokenBuf[MAX_PWLS_IN_SKETCH];
+static SketchPwl *AllBuf;
+static SketchPwl *BrokenBuf;
 static int AllCnt, BrokenCnt;
+static int AllAlloc, BrokenAlloc;
 
 //-----------------------------------------------------------------------------
 // Does a given closed curve run clockwise or counterclockwise?
@@ -75,6 +79,10 @@ void PolygonAssemble(DPolygon *p, SketchPwl *src, int n,
 {
     *leftovers = FALSE;
 
+    // A closed curve can't use more than all of the pwls, plus the point
+    // that we started from.
+    RESERVE(PtBuf, PtBufAlloc, n + 1);
+
     int i;
     // Mark all the pwls on this layer as unused.
     for(i = 0; i < n; i++) {
@@ -154,7 +162,7 @@ void PolygonAssemble(DPolygon *p, SketchPwl *src, int n,
     
         // So we have a closed curve.
         i = p->curves;
-        if(i >= MAX_CLOSED_CURVES_IN_POLYGON) return;
+        RESERVE(p->curve, p->curvesAlloc, i + 1);
 
         p->curve[i].pts = pts;
         p->curve[i].pt = AllocPointsForClosedCurve(pts);
@@ -222,9 +230,8 @@ static void PwlsFromPolygon(DPolygon *p, int tag)
     for(i = 0; i < p->curves; i++) {
         int j;
         DClosedCurve *c = &(p->curve[i]);
+        RESERVE(AllBuf, AllAlloc, AllCnt + c->pts);
         for(j = 1; j < c->pts; j++) {
-            if(AllCnt >= arraylen(AllBuf)) break;
-
             AllBuf[AllCnt].x0 = c->pt[j-1].x;
             AllBuf[AllCnt].y0 = c->pt[j-1].y;
             AllBuf[AllCnt].x1 = c->pt[j].x;
@@ -326,10 +333,9 @@ static BOOL PolygonBoolean(DPolygon *dest, DPolygon *pa, DPolygon *pb,
         // Order the intersections, from first encountered to last.
         qsort(intersect, intersects, sizeof(intersect[0]), ByTi);
         // And generate the broken-apart line segment.
+        RESERVE(BrokenBuf, BrokenAlloc, BrokenCnt + intersects);
         int k;
         for(k = 1; k < intersects; k++) {
-            if(BrokenCnt >= arraylen(BrokenBuf)) break;
-
             double t0 = intersect[k-1].ti;
             double t1 = intersect[k].ti;
             BrokenBuf[BrokenCnt].x0 = x0 + dx*t0;
@@ -401,9 +407,8 @@ static void AppendToPolygon(DPolygon *dest, DPolygon *src,
                 double a, double b, double c, double d,
                 double dx, double dy)
 {
-    if(dest->curves + src->curves > MAX_CLOSED_CURVES_IN_POLYGON) return;
-
     int n = dest->curves;
+    RESERVE(dest->curve, dest->curvesAlloc, n + src->curves);
 
     int i;
     for(i = 0; i < src->curves; i++) {
@@ -428,8 +433,6 @@ static void AppendToPolygon(DPolygon *dest, DPolygon *src,
 
 BOOL PolygonSuperimpose(DPolygon *dest, DPolygon *pa, DPolygon *pb)
 {
-    if(pa->curves + pb->curves > MAX_CLOSED_CURVES_IN_POLYGON) return FALSE;
-
     dest->curves = 0;
     AppendToPolygon(dest, pa, 1, 0, 0, 1, 0, 0);
     AppendToPolygon(dest, pb, 1, 0, 0, 1, 0, 0);
@@ -525,11 +528,11 @@ BOOL PolygonMirror(DPolygon *dest, DPolygon *src,
 //-----------------------------------------------------------------------------
 static void WritePt(int *pts, double x, double y)
 {
-    if(*pts < MAX_PWLS_IN_SKETCH) {
-        PtBuf[*pts].x = x;
-        PtBuf[*pts].y = y;
-        (*pts)++;
-    }
+    RESERVE(PtBuf, PtBufAlloc, *pts + 1);
+
+    PtBuf[*pts].x = x;
+    PtBuf[*pts].y = y;
+    (*pts)++;
 }
 
 //-----------------------------------------------------------------------------
@@ -650,6 +653,8 @@ static void OffsetClosedCurve(DClosedCurve *dest, DClosedCurve *src,
 }
 BOOL PolygonOffset(DPolygon *dest, DPolygon *src, double radius)
 {
+    RESERVE(dest->curve, dest->curvesAlloc, src->curves);
+
     int i;
     for(i = 0; i < src->curves; i++) {
         BOOL inwards;
@@ -806,6 +811,8 @@ void RoundCornersForClosedCurve(DClosedCurve *dest, DClosedCurve *src,
 BOOL PolygonRoundCorners(DPolygon *dest, DPolygon *src, double radius, 
                                                         hPoint *pt, int pts)
 {
+    RESERVE(dest->curve, dest->curvesAlloc, src->curves);
+
     int i;
     for(i = 0; i < src->curves; i++) {
         RoundCornersForClosedCurve(&(dest->curve[i]), &(src->curve[i]),
@@ -875,11 +882,10 @@ BOOL PolygonPerforate(DPolygon *dest, DPolygon *src, double dash, double duty)
             pts = 0;
             WritePt(&pts, pwl->x0 + ti*dx, pwl->y0 + ti*dy);
             WritePt(&pts, pwl->x0 + tf*dx, pwl->y0 + tf*dy);
-            if(curves < MAX_CLOSED_CURVES_IN_POLYGON) {
-                dest->curve[curves].pts = pts;
-                dest->curve[curves].pt = AllocPointsForClosedCurve(pts);
-                curves++;
-            }
+            RESERVE(dest->curve, dest->curvesAlloc, curves + 1);
+            dest->curve[curves].pts = pts;
+            dest->curve[curves].pt = AllocPointsForClosedCurve(pts);
+            curves++;
         }
     }
 
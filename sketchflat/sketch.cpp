@@ -23,19 +23,110 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-static Sketch SKalloc;
-Sketch *SK = &SKalloc;
-
 typedef struct {
-    SketchParam param[MAX_PARAMETERS_IN_SKETCH];
+    SketchParam *param;
     int         params;
+    int         paramsAlloc;
 } SavedParams;
 
-static SavedParams Remembered;
-static SavedParams Good;
+// Along with the sketch itself, the solver context holds our saved copies of
+// its parameters.
+struct SketchStateTag {
+    SavedParams     remembered;
+    SavedParams     good;
+};
+#define Remembered  (SC->sketch->remembered)
+#define Good        (SC->sketch->good)
+
+void SketchAllocState(SolverContext *sc)
+{
+    sc->sketch = (struct SketchStateTag *)DAlloc(sizeof(*(sc->sketch)));
+    if(!sc->sketch) oops();
+    memset(sc->sketch, 0, sizeof(*(sc->sketch)));
+}
+
+void SketchFreeState(SolverContext *sc)
+{
+    Sketch *sk = &(sc->sk);
+    UNRESERVE(sk->entity, sk->entitiesAlloc);
+    UNRESERVE(sk->param, sk->paramsAlloc);
+    UNRESERVE(sk->line, sk->linesAlloc);
+    UNRESERVE(sk->point, sk->pointsAlloc);
+    UNRESERVE(sk->curve, sk->curvesAlloc);
+    UNRESERVE(sk->constraint, sk->constraintsAlloc);
+    UNRESERVE(sk->pwl, sk->pwlsAlloc);
+    UNRESERVE(sk->paramHash, sk->paramHashSize);
+
+    UNRESERVE(sc->sketch->remembered.param,
+                                    sc->sketch->remembered.paramsAlloc);
+    UNRESERVE(sc->sketch->good.param, sc->sketch->good.paramsAlloc);
+
+    DFree(sc->sketch);
+    sc->sketch = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Make the sketch in dest a copy of the one in src, for CopySolverContext()
+// or to hand to the background solver. The tables are left zeroed past their
+// ends, as ClearSketch() would leave them.
+//-----------------------------------------------------------------------------
+static void CopyTable(void **dest, int *destN, int *destAlloc,
+                                            void *src, int n, int elemSize)
+{
+    ReserveArray(dest, destAlloc, n, elemSize);
+
+    BYTE *d = (BYTE *)*dest;
+    if(n > 0) memcpy(d, src, n*elemSize);
+    if(d) memset(d + n*elemSize, 0, (*destAlloc - n)*elemSize);
+    *destN = n;
+}
+#define COPY_TABLE(d, s, a, n, alloc) \
+    CopyTable((void **)&((d)->a), &((d)->n), &((d)->alloc), \
+                                    (s)->a, (s)->n, sizeof((s)->a[0]))
+void CopySketchTables(Sketch *d, Sketch *s)
+{
+    COPY_TABLE(d, s, entity, entities, entitiesAlloc);
+    COPY_TABLE(d, s, param, params, paramsAlloc);
+    COPY_TABLE(d, s, line, lines, linesAlloc);
+    COPY_TABLE(d, s, point, points, pointsAlloc);
+    COPY_TABLE(d, s, curve, curves, curvesAlloc);
+    COPY_TABLE(d, s, constraint, constraints, constraintsAlloc);
+    COPY_TABLE(d, s, pwl, pwls, pwlsAlloc);
+
+    if(d->paramHashSize != s->paramHashSize) {
+        if(d->paramHash) DFree(d->paramHash);
+        d->paramHash = NULL;
+        d->paramHashSize = s->paramHashSize;
+        if(d->paramHashSize > 0) {
+            d->paramHash = (int *)DAlloc(d->paramHashSize*sizeof(int));
+            if(!d->paramHash) oops();
+        }
+    }
+    if(d->paramHashSize > 0) {
+        memcpy(d->paramHash, s->paramHash, d->paramHashSize*sizeof(int));
+    }
+
+    memcpy(&(d->layer), &(s->layer), sizeof(d->layer));
+
+    // The copy has no equations yet, whatever the original had.
+    d->eqnsDirty = TRUE;
+}
+void SketchCopyState(SolverContext *dest, SolverContext *src)
+{
+    CopySketchTables(&(dest->sk), &(src->sk));
+
+    COPY_TABLE(&(dest->sketch->good), &(src->sketch->good),
+                                                param, params, paramsAlloc);
+}
 
-static double FindRemembered(hParam p)
+static double FindRemembered(hParam p, int guess)
 {
+    // The parameters usually get regenerated in the same order, so try
+    // the same position first.
+    if(guess < Remembered.params && Remembered.param[guess].id == p) {
+        return Remembered.param[guess].v;
+    }
+
     int i;
     for(i = 0; i < Remembered.params; i++) {
         if(Remembered.param[i].id == p) {
@@ -56,6 +147,7 @@ void RestoreParamsToRemembered(void)
 
 void SaveGoodParams(void)
 {
+    RESERVE(Good.param, Good.paramsAlloc, SK->params);
     memcpy(Good.param, SK->param, (SK->params)*sizeof(SketchParam));
     Good.params = SK->params;
 }
@@ -68,32 +160,111 @@ void RestoreParamsToLastGood(void)
     }
 }
 
-double EvalParam(hParam p)
+//-----------------------------------------------------------------------------
+// Find the index of a parameter in SK->param[], or -1 if it doesn't exist.
+// The hash table gets filled in as we generate the parameters, but the
+// parameters can also get replaced wholesale (on load, or undo), so its
+// entries are just hints that we must check; if we miss then we search,
+// and remember what we found.
+//-----------------------------------------------------------------------------
+static int ParamSlotHashed(hParam p, int *h)
 {
-    unsigned int i;
+    int probes;
 
-    i = SK->paramHash[p % PARAM_HASH];
-    if(i < (unsigned)SK->params && SK->param[i].id == p) {
-        return SK->param[i].v;
+    if(SK->paramHashSize == 0) {
+        *h = -1;
+        return -1;
     }
 
-    for(i = 0; i < (unsigned)SK->params; i++) {
+    *h = p % SK->paramHashSize;
+    for(probes = 0; probes < SK->paramHashSize; probes++) {
+        int i = SK->paramHash[*h] - 1;
+        if(i < 0) return -1;
+        if(i < SK->params && SK->param[i].id == p) return i;
+
+        *h = (*h + 1) % SK->paramHashSize;
+    }
+    *h = -1;
+    return -1;
+}
+int ParamSlot(hParam p)
+{
+    int h;
+    int i = ParamSlotHashed(p, &h);
+    if(i >= 0) return i;
+
+    for(i = 0; i < SK->params; i++) {
         if(SK->param[i].id == p) {
-            SK->paramHash[p % PARAM_HASH] = i;
-            return SK->param[i].v;
+            if(h >= 0) SK->paramHash[h] = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Make the hash table big enough to hold n parameters while staying at most
+// half full, and fill it in with the ones that we have now.
+//-----------------------------------------------------------------------------
+static void GrowParamHash(int n)
+{
+    if(SK->paramHashSize >= n*2) return;
+
+    int size = (SK->paramHashSize > 0) ? SK->paramHashSize : PARAM_HASH;
+    while(size < n*2) {
+        // The next prime past twice the size.
+        size = size*2 + 1;
+        for(;;) {
+            int d;
+            for(d = 3; d*d <= size; d += 2) {
+                if(size % d == 0) break;
+            }
+            if(d*d > size) break;
+            size += 2;
         }
     }
+
+    DFree(SK->paramHash);
+    SK->paramHash = (int *)DAlloc(size*sizeof(int));
+    if(!SK->paramHash) oops();
+    memset(SK->paramHash, 0, size*sizeof(int));
+    SK->paramHashSize = size;
+
+    int i;
+    for(i = 0; i < SK->params; i++) {
+        int h = SK->param[i].id % size;
+        while(SK->paramHash[h]) h = (h + 1) % size;
+        SK->paramHash[h] = i + 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Copy the values of all the parameters into a contiguous vector, indexed
+// the same way as SK->param[], for the numerical code to work on.
+//-----------------------------------------------------------------------------
+void GetParamValues(double *v)
+{
+    int i;
+    for(i = 0; i < SK->params; i++) {
+        v[i] = SK->param[i].v;
+    }
+}
+
+double EvalParam(hParam p)
+{
+    int i = ParamSlot(p);
+    if(i >= 0) {
+        return SK->param[i].v;
+    }
     dbp("param=%08x", p);
     oops();
 }
 
 SketchParam *ParamById(hParam p)
 {
-    int i;
-    for(i = 0; i < SK->params; i++) {
-        if(SK->param[i].id == p) {
-            return &(SK->param[i]);
-        }
+    int i = ParamSlot(p);
+    if(i >= 0) {
+        return &(SK->param[i]);
     }
     return NULL;
 }
@@ -122,20 +293,11 @@ BOOL PointExistsInSketch(hPoint pt)
 //-----------------------------------------------------------------------------
 void ForceParam(hParam p, double v)
 {
-    unsigned int i;
-
-    i = SK->paramHash[p % PARAM_HASH];
-    if(i < (unsigned)SK->params && SK->param[i].id == p) {
+    int i = ParamSlot(p);
+    if(i >= 0) {
         SK->param[i].v = v;
         return;
     }
-
-    for(i = 0; i < (unsigned)SK->params; i++) {
-        if(SK->param[i].id == p) {
-            SK->param[i].v = v;
-            return;
-        }
-    }
     // A number of things can make us force a non-existent parameter, for
     // example if we recover to the last good remembered set of parameters,
     // and some sketch items have been deleted since the last time we
@@ -153,51 +315,51 @@ void ForcePoint(hPoint pt, double x, double y)
 
 static void AddParam(hParam p)
 {
-    int i;
-    // It should not exist already.
-    for(i = 0; i < SK->params; i++) {
-        if(SK->param[i].id == p) {
-            oopsnf();
-            return;
-        }
+    int i, h;
+    // It should not exist already. We're generating the parameters from
+    // scratch, so the hash table is complete, and a miss there is enough.
+    GrowParamHash(SK->params + 1);
+    if(ParamSlotHashed(p, &h) >= 0) {
+        oopsnf();
+        return;
     }
+    if(h < 0) oops();
 
     i = SK->params;
-    if(i >= arraylen(SK->param)) oops();
+    RESERVE(SK->param, SK->paramsAlloc, i + 1);
     SK->param[i].id = p;
-    SK->param[i].v = FindRemembered(p);
+    SK->param[i].v = FindRemembered(p, i);
+    SK->paramHash[h] = i + 1;
 
     SK->params = i + 1;
 }
 static void AddPoint(hPoint pt)
 {
-    int i;
-    // It should not exist already.
-    for(i = 0; i < SK->points; i++) {
-        if(SK->point[i] == pt) {
-            oopsnf();
-            return;
-        }
+    int i, h;
+    // It should not exist already. Its X coordinate would too, and the hash
+    // table is complete while we generate, so that's the quick check.
+    if(ParamSlotHashed(X_COORD_FOR_PT(pt), &h) >= 0) {
+        oopsnf();
+        return;
     }
 
     i = SK->points;
-    if(i >= arraylen(SK->point)) oops();
+    RESERVE(SK->point, SK->pointsAlloc, i + 1);
     SK->point[i] = pt;
     SK->points = i + 1;
 }
 static void AddLine(hLine ln)
 {
-    int i;
-    // It should not exist already.
-    for(i = 0; i < SK->lines; i++) {
-        if(SK->line[i] == ln) {
-            oopsnf();
-            return;
-        }
+    int i, h;
+    // It should not exist already. Its theta would too, and the hash
+    // table is complete while we generate, so that's the quick check.
+    if(ParamSlotHashed(THETA_FOR_LINE(ln), &h) >= 0) {
+        oopsnf();
+        return;
     }
 
     i = SK->lines;
-    if(i >= arraylen(SK->line)) oops();
+    RESERVE(SK->line, SK->linesAlloc, i + 1);
     SK->line[i] = ln;
     SK->lines = i + 1;
 }
@@ -234,12 +396,16 @@ void GenerateParametersPointsLines(void)
     // We'll be recreating the list, but don't forget numerical values,
     // since those are probably almost right (and for an underconstrained
     // sketch, our only indication of what this should look like).
+    RESERVE(Remembered.param, Remembered.paramsAlloc, SK->params);
     memcpy(Remembered.param, SK->param, SK->params*sizeof(SketchParam));
     Remembered.params = SK->params;
 
     SK->params = 0;
     SK->points = 0;
     SK->lines = 0;
+    if(SK->paramHash) {
+        memset(SK->paramHash, 0, SK->paramHashSize*sizeof(int));
+    }
 
     // First, generate the references. Our sketch must always contain
     // a datum point at the origin, and two datum lines, parallel to the
@@ -288,6 +454,47 @@ void GenerateParametersPointsLines(void)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Empty the sketch, as if we had just started. The tables keep their memory
+// for reuse, unless they're much bigger than they now need to be.
+//-----------------------------------------------------------------------------
+#define ZERO_TABLE(a, alloc) \
+    if(a) memset((a), 0, (alloc)*sizeof((a)[0]))
+void ClearSketch(void)
+{
+    SK->entities = 0;
+    SK->params = 0;
+    SK->lines = 0;
+    SK->points = 0;
+    SK->curves = 0;
+    SK->constraints = 0;
+    SK->pwls = 0;
+
+    SHRINK(SK->entity, SK->entitiesAlloc, 0);
+    SHRINK(SK->param, SK->paramsAlloc, 0);
+    SHRINK(SK->line, SK->linesAlloc, 0);
+    SHRINK(SK->point, SK->pointsAlloc, 0);
+    SHRINK(SK->curve, SK->curvesAlloc, 0);
+    SHRINK(SK->constraint, SK->constraintsAlloc, 0);
+    SHRINK(SK->pwl, SK->pwlsAlloc, 0);
+
+    // Whoever fills the tables back in expects to find them zeroed, as they
+    // were when the sketch was one static struct.
+    ZERO_TABLE(SK->entity, SK->entitiesAlloc);
+    ZERO_TABLE(SK->param, SK->paramsAlloc);
+    ZERO_TABLE(SK->line, SK->linesAlloc);
+    ZERO_TABLE(SK->point, SK->pointsAlloc);
+    ZERO_TABLE(SK->curve, SK->curvesAlloc);
+    ZERO_TABLE(SK->constraint, SK->constraintsAlloc);
+    ZERO_TABLE(SK->pwl, SK->pwlsAlloc);
+
+    if(SK->paramHash) {
+        memset(SK->paramHash, 0, SK->paramHashSize*sizeof(int));
+    }
+    memset(&(SK->layer), 0, sizeof(SK->layer));
+    SK->eqnsDirty = FALSE;
+}
+
 //-----------------------------------------------------------------------------
 // Delete an entity from the sketch. This is relatively straightforward;
 // once we regenerate the points, lines, and curves, its children will just
@@ -298,7 +505,8 @@ void SketchDeleteEntity(hEntity he)
     SK->eqnsDirty = TRUE;
 
     int i;
-    static hConstraint ToDelete[MAX_CONSTRAINTS_IN_SKETCH];
+    static hConstraint *ToDelete;
+    static int ToDeleteAlloc;
     int toDelete;
 
     // So that we can't accidentally get deleted later, remove ourselves
@@ -320,6 +528,7 @@ void SketchDeleteEntity(hEntity he)
     // reference it. Otherwise things will break when that constraint
     // tries to make its equations.
     toDelete = 0;
+    RESERVE(ToDelete, ToDeleteAlloc, SK->constraints);
     for(i = 0; i < SK->constraints; i++) {
         BOOL del = FALSE;
         SketchConstraint *c = &(SK->constraint[i]);
@@ -376,13 +585,11 @@ SketchEntity *EntityById(hEntity he)
 }
 
 //-----------------------------------------------------------------------------
-// Add an entity to the sketch; returns the ID of the newly inserted entity.
+// Add an entity to the sketch; returns the ID of the newly inserted entity,
+// or 0 if there's no ID left to give it.
 //-----------------------------------------------------------------------------
 static hEntity SketchAddEntityWorker(SketchEntity *e)
 {
-    SK->eqnsDirty = TRUE;
-    UndoRemember();
-
     int i;
     hEntity greatestId = 0;
 
@@ -392,8 +599,18 @@ static hEntity SketchAddEntityWorker(SketchEntity *e)
         }
     }
 
+    // IDs aren't re-used, so this can happen even if some entities have
+    // been deleted since.
+    if(greatestId + 1 > MAX_ENTITY_ID) {
+        uiError("Too many entities in sketch.");
+        return 0;
+    }
+
+    SK->eqnsDirty = TRUE;
+    UndoRemember();
+
     i = SK->entities;
-    if(i >= MAX_ENTITIES_IN_SKETCH) oops();
+    RESERVE(SK->entity, SK->entitiesAlloc, i + 1);
 
     memcpy(&(SK->entity[i]), e, sizeof(*e));
     SK->entity[i].id = greatestId + 1;
@@ -444,14 +661,24 @@ hEntity SketchAddEntity(int type)
     }
 
     hEntity he = SketchAddEntityWorker(&e);
+    if(!he) return 0;
     GenerateParametersPointsLines();
     return he;
 }
 
-void SketchAddPointToCubicSpline(hEntity he)
+//-----------------------------------------------------------------------------
+// Add another piecewise cubic segment to a spline; returns FALSE if its
+// points would no longer fit in the handles.
+//-----------------------------------------------------------------------------
+BOOL SketchAddPointToCubicSpline(hEntity he)
 {
     SketchEntity *e = EntityById(he);
 
     // Two extra points per piecewise cubic segment.
+    if(e->points + 2 > MAX_POINTS_FOR_ENTITY) {
+        uiError("Too many points in spline.");
+        return FALSE;
+    }
     (e->points) += 2;
+    return TRUE;
 }
@@ -37,29 +37,29 @@ typedef struct {
 // Definitions for the geometry of the sketch.
 
 // The entity table is the source of the other (curve, point, param)
-// tables. The entity ID is a number between 1 and 1022. It has the
+// tables. The entity ID is a number between 1 and 65534. It has the
 // following structure:
 //
-//          bits 31:10  -- all zero
-//          bits  9: 0  -- entity ID
+//          bits 31:16  -- all zero
+//          bits 15: 0  -- entity ID
 //
 typedef DWORD       hEntity;
-#define REFERENCE_ENTITY 1023
+#define REFERENCE_ENTITY 0xffff
 
 // The point and parameter tables are derived from the entity table. A
 // point ID associated with a given entity has the following structure:
 //
-//          bits 31:26  -- all zero
-//          bits 25:16  -- associated entity ID
-//          bits 15: 0  -- index (multiple pts associated with entity)
+//          bits 31:28  -- all zero
+//          bits 27:12  -- associated entity ID
+//          bits 11: 0  -- index (multiple pts associated with entity)
 //
 typedef DWORD       hPoint;
 
 // A line ID associated with a given entity has the following structure:
 //
-//          bits 31:26  -- all zero
-//          bits 25:16  -- associated entity ID
-//          bits 15: 0  -- index (multiple lines associated with entity)
+//          bits 31:28  -- all zero
+//          bits 27:12  -- associated entity ID
+//          bits 11: 0  -- index (multiple lines associated with entity)
 //
 typedef DWORD       hLine;
 
@@ -72,9 +72,9 @@ typedef DWORD       hLine;
 //          bit  28     -- 1 if param represents X for a point, else 0
 //                                  (only one of these four bits is set)
 //
-//          bits 25:16  -- associated entity ID
+//          bits 27:12  -- associated entity ID
 //
-//          bits 15: 0  -- if bit 31 or bit 30 is set: line index
+//          bits 11: 0  -- if bit 31 or bit 30 is set: line index
 //                      -- if bit 29 or bit 28 is set: point index
 //                      -- otherwise: parameter index
 //
@@ -98,20 +98,20 @@ typedef DWORD       hParam;
 #define A_FOR_LINE(hLn)             ((hParam)(hLn) | (1 << 31))
 
 // To get a point ID from an entity ID:
-#define POINT_FOR_ENTITY(hEnt, k)   ((hPoint)((k) | ((hEnt) << 16)))
+#define POINT_FOR_ENTITY(hEnt, k)   ((hPoint)((k) | ((hEnt) << 12)))
 // To get a line ID from an entity ID:
-#define LINE_FOR_ENTITY(hEnt, k)    ((hLine)((k) | ((hEnt) << 16)))
+#define LINE_FOR_ENTITY(hEnt, k)    ((hLine)((k) | ((hEnt) << 12)))
 // To get a parameter ID from an entity ID:
-#define PARAM_FOR_ENTITY(hEnt, k)   ((hParam)((k) | ((hEnt) << 16)))
+#define PARAM_FOR_ENTITY(hEnt, k)   ((hParam)((k) | ((hEnt) << 12)))
 
 // Given a point, what entity is associated with it?
-#define ENTITY_FROM_POINT(hPt)      ((hEntity)((hPt) >> 16))
+#define ENTITY_FROM_POINT(hPt)      ((hEntity)((hPt) >> 12))
 // Given a point, what was the k value?
-#define K_FROM_POINT(hPt)           ((int)((hPt) & 0xffff))
+#define K_FROM_POINT(hPt)           ((int)((hPt) & 0xfff))
 // Given a line, what entity is associated with it?
-#define ENTITY_FROM_LINE(hLn)       ((hEntity)((hLn) >> 16))
+#define ENTITY_FROM_LINE(hLn)       ((hEntity)((hLn) >> 12))
 // Given a parameter, what entity is associated with it?
-#define ENTITY_FROM_PARAM(hp)       ((hEntity)(((hp) >> 16) & 1023))
+#define ENTITY_FROM_PARAM(hp)       ((hEntity)(((hp) >> 12) & 0xffff))
 // Given a paramter that is either the X or Y coordinate for a point, what
 // is the ID for that point?
 #define POINT_FROM_PARAM(hp)        ((hPoint)((hp) & 0x0fffffff))
@@ -285,40 +285,51 @@ typedef struct {
     hLayer      layer;
 } SketchConstraint;
 
-#define MAX_ENTITIES_IN_SKETCH      128
-#define MAX_PARAMETERS_IN_SKETCH    512
-#define MAX_POINTS_IN_SKETCH        256
-#define MAX_LINES_IN_SKETCH         128
-#define MAX_CURVES_IN_SKETCH        1024
-#define MAX_CONSTRAINTS_IN_SKETCH   512
-#define MAX_PWLS_IN_SKETCH          65536
+// Entities are numbered from 1, and their IDs must fit in the sixteen bits
+// that the point, line, and parameter handles leave for them, below the
+// references. Those handles leave twelve bits for the index, which bounds
+// the points (or lines, or params) of any one entity.
+#define MAX_ENTITY_ID               (REFERENCE_ENTITY - 1)
+#define MAX_POINTS_FOR_ENTITY       4096
 
 // This hash table is used to speed up certain lookups; its size must
-// be a prime number, in order to avoid collisions.
+// be a prime number, in order to avoid collisions. It's open-addressed,
+// holding the index into param[] plus one, so that zero is empty, and it
+// grows (to a bigger prime) to stay at most half full.
 #define PARAM_HASH 2129
 
+// The tables are growable, allocated with ReserveArray(); each has a count
+// of elements in use, and a count of elements allocated.
 typedef struct {
-    SketchEntity        entity[MAX_ENTITIES_IN_SKETCH];
+    SketchEntity        *entity;
     int                 entities;
+    int                 entitiesAlloc;
 
-    SketchParam         param[MAX_PARAMETERS_IN_SKETCH];
+    SketchParam         *param;
     int                 params;
-    int                 paramHash[PARAM_HASH];
+    int                 paramsAlloc;
+    int                 *paramHash;
+    int                 paramHashSize;
 
-    hLine               line[MAX_LINES_IN_SKETCH];
+    hLine               *line;
     int                 lines;
+    int                 linesAlloc;
 
-    hPoint              point[MAX_POINTS_IN_SKETCH];
+    hPoint              *point;
     int                 points;
+    int                 pointsAlloc;
 
-    SketchCurve         curve[MAX_CURVES_IN_SKETCH];
+    SketchCurve         *curve;
     int                 curves;
+    int                 curvesAlloc;
 
-    SketchConstraint    constraint[MAX_CONSTRAINTS_IN_SKETCH];
+    SketchConstraint    *constraint;
     int                 constraints;
+    int                 constraintsAlloc;
 
-    SketchPwl           pwl[MAX_PWLS_IN_SKETCH];
+    SketchPwl           *pwl;
     int                 pwls;
+    int                 pwlsAlloc;
 
     struct {
         struct {
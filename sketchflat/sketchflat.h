@@ -133,6 +133,8 @@ extern int SolvingState;
 #define GET_LABEL_LOCATION          2
 double ForDrawnConstraint(int op, SketchConstraint *c, double *x, double *y);
 BOOL ConstraintHasLabelAssociated(SketchConstraint *c);
+BOOL ConstraintValueFromString(SketchConstraint *c, char *str, double *v);
+int ConstraintValueSteps(double cv0, double nv);
 void ChangeConstraintValue(SketchConstraint *c, char *newVal);
 
 //--------------------------------------------
@@ -158,17 +160,21 @@ typedef DWORD hEquation;
 #define EQUATION_FOR_CONSTRAINT(eq, k)      (((eq) << 4) | (k))
 #define CONSTRAINT_FOR_EQUATION(eq)         ((eq) >> 4)
 #define CONSTRAINT_FOR_ENTITY(he)           ((hConstraint)((he) | 0x800000))
-#define MAX_EQUATIONS (MAX_CONSTRAINTS_IN_SKETCH*2)
 typedef struct {
     int eqns;
+    int eqnsAlloc;
     struct {
         hEquation       he;
         Expr            *e;
 
         int             subSys;
-    }   eqn[MAX_EQUATIONS];
+
+        // A hash of e, computed when first needed; used to check that a
+        // cached partial derivative still applies to this equation.
+        DWORD           fingerprint;
+        BOOL            fingerprintValid;
+    }   *eqn;
 } Equations;
-extern Equations *EQ;
 
 void MenuConstrain(int id);
 void ConstrainCoincident(hPoint a, hPoint b);
@@ -185,6 +191,9 @@ void UpdateMeasurements(void);
 //--------------------------------------------
 // in sketch.cpp
 double EvalParam(hParam p);
+int ParamSlot(hParam p);
+void GetParamValues(double *v);
+void ClearSketch(void);
 void EvalPoint(hPoint pt, double *x, double *y);
 BOOL PointExistsInSketch(hPoint pt);
 void ForcePoint(hPoint pt, double x, double y);
@@ -198,8 +207,8 @@ SketchParam *ParamById(hParam p);
 SketchEntity *EntityById(hEntity he);
 void SketchDeleteEntity(hEntity he);
 hEntity SketchAddEntity(int type);
-void SketchAddPointToCubicSpline(hEntity he);
-extern Sketch *SK;
+BOOL SketchAddPointToCubicSpline(hEntity he);
+void CopySketchTables(Sketch *dest, Sketch *src);
 
 //--------------------------------------------
 // in curves.cpp
@@ -239,6 +248,7 @@ BOOL PolygonPerforate(DPolygon *dest, DPolygon *src, double len, double duty);
 //--------------------------------------------
 // in derive.cpp
 void GenerateDeriveds(void);
+void EraseAllPolys(void);
 
 // Called by GUI code.
 void SwitchToDeriveMode(void);
@@ -258,7 +268,101 @@ void DerivedMouseMoved(int x, int y,
 // in newton.cpp
 #define MAX_NUMERICAL_UNKNOWNS 40
 #define MAX_UNKNOWNS_AT_ONCE   128
-BOOL SolveNewton(int subSys);
+// The most subsystems that we'll solve at the same time.
+#define MAX_SUBSYSTEMS_AT_ONCE 64
+void NewtonBegin(void);
+void NewtonPrepare(int *eqn, int eqns, int *param, int params);
+BOOL NewtonSolvePrepared(void);
+// How Newton's method did on each subsystem that it solved, in the order
+// that it solved them. The residual (the largest magnitude of any function)
+// before the first iteration and after each is kept for every subsystem;
+// those for block k start at residual[block[k].residualStart], and there
+// are block[k].iterations + 1 of them.
+typedef struct {
+    int         unknowns;
+    int         iterations;
+    int         jacobians;
+    BOOL        converged;
+    int         residualStart;
+} NewtonBlockStats;
+typedef struct {
+    NewtonBlockStats    *block;
+    int                 blocks;
+    int                 blockAlloc;
+    double              *residual;
+    int                 residuals;
+    int                 residualAlloc;
+
+    // And the totals over all of them, plus the time that the whole solve
+    // took, in milliseconds.
+    int                 iterations;
+    int                 jacobians;
+    int                 failed;
+    int                 time;
+} SolverStats;
+void NewtonForgetStats(void);
+#define JACOBIAN_AUTOMATIC      0
+#define JACOBIAN_SYMBOLIC       1
+#define JACOBIAN_DUAL           2
+extern int JacobianMethod;
+Expr *PartialForEquation(int eq, hParam p);
+void ForgetPartials(BOOL always);
+
+//--------------------------------------------
+// in sparse.cpp
+typedef struct {
+    int     n;
+    // The pattern of the matrix, by columns.
+    int     nonzeros;
+    int    *colStart;
+    int    *row;
+
+    // The order in which we eliminate the columns.
+    int    *q;
+
+    // The factors, by columns in elimination order. Column k of L starts
+    // with its pivot row (with a 1), and column k of U ends with its
+    // pivot. L's entries are numbered by rows of the matrix, and U's by
+    // step of the elimination; pinv[] and prow[] convert between them.
+    BOOL    factored;
+    int    *lStart;
+    int    *lRow;
+    double *lVal;
+    int    *uStart;
+    int    *uRow;
+    double *uVal;
+    int    *pinv;
+    int    *prow;
+
+    // Workspace.
+    double *x;
+    double *z;
+    int    *xi;
+    int    *stack;
+    int    *mark;
+    int     stamp;
+
+    int     colStartAlloc;
+    int     rowAlloc;
+    int     qAlloc;
+    int     lStartAlloc;
+    int     lRowAlloc;
+    int     lValAlloc;
+    int     uStartAlloc;
+    int     uRowAlloc;
+    int     uValAlloc;
+    int     pinvAlloc;
+    int     prowAlloc;
+    int     xAlloc;
+    int     zAlloc;
+    int     xiAlloc;
+    int     stackAlloc;
+    int     markAlloc;
+} SparseLU;
+void SparseAnalyze(SparseLU *lu, int n, int *colStart, int *row);
+BOOL SparseFactor(SparseLU *lu, double *val);
+void SparseSolve(SparseLU *lu, double *X, double *B);
+void SparseFree(SparseLU *lu);
 
 //--------------------------------------------
 // in assume.cpp
@@ -267,19 +371,26 @@ BOOL Assume(int *assumed);
 // from the GUI code.
 void HighlightAssumption(char *str);
 void HighlightConstraint(char *str);
+void ShowSolverReport(struct SolverReportTag *r);
 
 //--------------------------------------------
 // in solve.cpp
 void SatisfyCoincidenceConstraints(hPoint pt);
 void MarkUnknowns(void);
 void GenerateEquationsToSolve(void);
-void Solve(void);
+BOOL Solve(void);
+BOOL SolveDragged(void);
+void ForgetDragPlan(void);
+int EquationIndexById(hEquation he);
+BOOL ParamAppearsInUnsolvedEquation(int i);
+BOOL SolveInBackground(BOOL dragging);
+void BackgroundSolveDone(void);
+void ReportStopSolving(void);
 
 // State that tells us how to partiion the equations in order to solve
 // them. We want to remember this, because it's expensive to generate
 // by brute force. Ideally, we will build this up slowly as the user
 // draws their sketch, and never have to generate it from scratch.
-#define MAX_REMEMBERED_SUBSYSTEMS 256
 typedef struct {
     struct {
         // We should either try assuming a parameter
@@ -289,13 +400,94 @@ typedef struct {
         int         eqs;
         // and this set has not been discarded as useless.
         BOOL        use;
-    } set[MAX_REMEMBERED_SUBSYSTEMS];
+    } *set;
     int     sets;
+    int     setsAlloc;
 } RememberedSubsystems;
-// These have to be extern because they are saved to the .skf file, since
-// they're so expensive to regenerate.
-extern RememberedSubsystems *RSt;
-extern RememberedSubsystems *RSp;
+
+// What a solve found that the user should hear about. The sketch in the
+// window tells them as it goes; a solve of a copy in the background writes
+// it here instead, for the window to show once it's done.
+typedef struct SolverReportTag {
+    const char  *status;
+    int         statusBk;
+
+    // TRUE if the equations were new, so the list of assumptions starts
+    // again; and TRUE if the sketch was inconsistent, so that the list of
+    // constraints to remove does.
+    BOOL        newLists;
+    BOOL        inconsistent;
+    hParam      *assumed;
+    int         assumeds;
+    int         assumedAlloc;
+    hConstraint *removable;
+    int         removables;
+    int         removableAlloc;
+
+    // TRUE if we should stop solving automatically, as after a problem.
+    BOOL        stop;
+
+    // How much work the solve took; this belongs to the context that did
+    // it, so it's good until that context solves again.
+    const SolverStats *stats;
+} SolverReport;
+
+// Everything that the solver reads or writes: the sketch, its equations,
+// and the scratch of each module that works on them. The UI's sketch is
+// in one of these, but we can make more, and solve other sketches (or
+// copies of this one) on other threads at the same time. Each thread
+// works on whichever context it's made current; the worker threads get
+// the context of whoever handed them the work.
+typedef struct SolverContextTag {
+    Sketch                  sk;
+    Equations               eq;
+
+    // The lists of remembered subsystems; rst is the one that we are
+    // building up during this call to the solver, and rsp the one that we
+    // built during the last successful call, which we solve from. These
+    // are saved to the .skf file, since they're so expensive to regenerate.
+    RememberedSubsystems    rs[2];
+    RememberedSubsystems    *rst;
+    RememberedSubsystems    *rsp;
+
+    // TRUE if this is the sketch in the window, whose solves should show
+    // their results there.
+    BOOL                    ui;
+    // Where to report what we found instead, or NULL if nobody's listening.
+    SolverReport            *report;
+    // Set from another thread when the solve in progress is no longer
+    // wanted; we give up as though we'd run out of time.
+    volatile BOOL           cancel;
+    // How the last call to Solve() or SolveDragged() went, numerically.
+    SolverStats             stats;
+
+    // The rest is private to the module that uses it.
+    struct SketchStateTag   *sketch;
+    struct ExprStateTag     *expr;
+    struct NewtonStateTag   *newton;
+    struct AssumeStateTag   *assume;
+    struct SolveStateTag    *solve;
+} SolverContext;
+extern __declspec(thread) SolverContext *SC;
+#define SK      (&(SC->sk))
+#define EQ      (&(SC->eq))
+#define RSt     (SC->rst)
+#define RSp     (SC->rsp)
+
+SolverContext *NewSolverContext(void);
+void FreeSolverContext(SolverContext *sc);
+void CopySolverContext(SolverContext *dest, SolverContext *src);
+SolverContext *UseSolverContext(SolverContext *sc);
+// And each module's part of it.
+void SketchAllocState(SolverContext *sc);
+void SketchFreeState(SolverContext *sc);
+void SketchCopyState(SolverContext *dest, SolverContext *src);
+void ExprAllocState(SolverContext *sc);
+void ExprFreeState(SolverContext *sc);
+void NewtonAllocState(SolverContext *sc);
+void NewtonFreeState(SolverContext *sc);
+void AssumeAllocState(SolverContext *sc);
+void AssumeFreeState(SolverContext *sc);
 
 //--------------------------------------------
 // in loadsave.cpp
@@ -338,6 +530,20 @@ BOOL told(double a, double b);
 BOOL tola(double a, double b);
 BOOL SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS_AT_ONCE], 
                                                         double B[], int n);
+BOOL FactorLinearSystem(double A[][MAX_UNKNOWNS_AT_ONCE], int perm[], int n);
+void SolveFactoredSystem(double X[], double A[][MAX_UNKNOWNS_AT_ONCE],
+                                        int perm[], double B[], int n);
+void VecSubScaled(double *y, double a, double *x, int n);
+double VecDot(double *x, double *y, int n);
+void ReserveArray(void **p, int *alloc, int n, int elemSize);
+void ShrinkArray(void **p, int *alloc, int n, int elemSize);
+void FreeArray(void **p, int *alloc);
+#define RESERVE(a, alloc, n) \
+    ReserveArray((void **)&(a), &(alloc), (n), sizeof((a)[0]))
+#define SHRINK(a, alloc, n) \
+    ShrinkArray((void **)&(a), &(alloc), (n), sizeof((a)[0]))
+#define UNRESERVE(a, alloc) \
+    FreeArray((void **)&(a), &(alloc))
 
 void LineOrLineSegment(hLine ln, hEntity e,
                             double *x0, double *y0, double *dx, double *dy);
@@ -385,6 +591,7 @@ void GroupSelection(GroupedSelection *g);
 //--------------------------------------------
 // in export.cpp
 void MenuExport(int id);
+int ExportDesignTable(char *table);
 
 //--------------------------------------------
 // in win32util.cpp
@@ -414,6 +621,14 @@ void Exit(void);
 void DFree(void *p);
 void *DAlloc(int bytes);
 
+int WorkerThreads(void);
+void RunInParallel(void (*fn)(int job, int worker), int jobs);
+
+BOOL StartBackgroundThread(void (*job)(void));
+void WakeBackgroundThread(void);
+// Posted to the main window when the background thread has finished a job.
+#define WM_BACKGROUND_DONE  (WM_APP + 0)
+
 //--------------------------------------------
 // in win32main_window.cpp
 void uiSetStatusBarText(char *solving, BOOL red, char *x, char *y, char *msg);
@@ -26,24 +26,92 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
-static int SolutionStartTime;
+// The solver context that this thread is working on.
+__declspec(thread) SolverContext *SC;
+
+//-----------------------------------------------------------------------------
+// Our state belongs to the solver context, so that a solve on one thread
+// doesn't touch what a solve on another is using. The tables are declared
+// below, next to the code that uses them.
+//-----------------------------------------------------------------------------
+struct SolveStateTag {
+    int                         solutionStartTime;
+    BOOL                        cursorIsHourglass;
+
+    struct IncidenceTag         *ix;
+    int                         *paramStamp;
+    int                         paramStampAlloc;
+    int                         paramStampNow;
+    int                         *incidenceCursor;
+    int                         incidenceCursorAlloc;
+
+    int                         *substSlot;
+    int                         substSlotAlloc;
+    double                      *substScale;
+    int                         substScaleAlloc;
+    Expr                        **substOffset;
+    int                         substOffsetAlloc;
+    int                         *substPath;
+    int                         substPathAlloc;
+    Expr                        **substitute;
+    int                         substituteAlloc;
+
+    struct SubsystemTag         *sub;
+    struct {
+        int     unknowns;
+        int     eqns;
+    }                           left;
+    int                         *unknown;
+    int                         unknownAlloc;
+
+    hEquation                   *solved;
+    int                         solvedAlloc;
+    int                         *solvedStart;
+    int                         solvedStartAlloc;
+
+    struct BlockTriangularTag   *bt;
+    struct WaveTag              *wave;
+    struct DragPlanTag          *drag;
+
+    int                         *presolve;
+    int                         presolveAlloc;
+    BOOL                        *presolveQueued;
+    int                         presolveQueuedAlloc;
+
+    double                      *stepFrom;
+    int                         stepFromAlloc;
+    double                      *stepTo;
+    int                         stepToAlloc;
+};
+
+#define SolutionStartTime   (SC->solve->solutionStartTime)
 // In milliseconds; we should give up if we're taking too long.
 #define MAX_SOLUTION_TIME 3000
 // And the time before we'll show an hourglass
 #define MAX_SOLUTION_TIME_BEFORE_HOURGLASS 200
-static BOOL CursorIsHourglass;
-
-#define MAX_PARTITIONED_UNKNOWNS 5
+#define CursorIsHourglass   (SC->solve->cursorIsHourglass)
 
-static RememberedSubsystems RSallocA;
-static RememberedSubsystems RSallocB;
-
-// The list of remembered subsystems that we are building up during this
-// call to the solve routines (i.e., an output from the solver).
-RememberedSubsystems *RSt = &RSallocA;
-// The list of remembered subsystems that we built up during the most recent
-// previous successful call to the solver (i.e., an input to the solver).
-RememberedSubsystems *RSp = &RSallocB;
+//-----------------------------------------------------------------------------
+// Tell the user how the solve went, if this is the sketch that they're
+// looking at; or if it's a copy of that sketch, then report it for later.
+//-----------------------------------------------------------------------------
+static void SetStatus(const char *str, int bk)
+{
+    if(SC->ui) {
+        uiSetConsistencyStatusText(str, bk);
+    } else if(SC->report) {
+        SC->report->status = str;
+        SC->report->statusBk = bk;
+    }
+}
+void ReportStopSolving(void)
+{
+    if(SC->ui) {
+        StopSolving();
+    } else if(SC->report) {
+        SC->report->stop = TRUE;
+    }
+}
 
 //-----------------------------------------------------------------------------
 // This trivial-solver exists mostly to make dragging points work like
@@ -115,6 +183,156 @@ void SatisfyCoincidenceConstraints(hPoint pt)
 }
 
 
+//-----------------------------------------------------------------------------
+// An index of which parameters appear in which equations, and the reverse,
+// so that the partitioning code can work from an equation to its neighbours
+// without scanning the whole sketch. This gets rebuilt along with the
+// equations (and after forward substitution rewrites them); all indices
+// are into EQ->eqn[] and SK->param[]. Like the rest of the solver's
+// scratch tables, the arrays grow to fit the biggest sketch that we've
+// seen, and then stay allocated.
+//-----------------------------------------------------------------------------
+struct IncidenceTag {
+    // The parameters in equation i are
+    // eqParam[eqParamStart[i]] through eqParam[eqParamStart[i+1]-1].
+    int     *eqParamStart;
+    int     *eqParam;
+    // And the equations that mention parameter i, likewise.
+    int     *paramEqStart;
+    int     *paramEq;
+    int     incidences;
+
+    // Open-addressed table from handle to index plus one, so that zero
+    // marks an empty slot. Kept no more than half full.
+    int     *eqnSlot;
+    int     eqnSlots;
+
+    int     eqParamStartAlloc;
+    int     eqParamAlloc;
+    int     paramEqStartAlloc;
+    int     paramEqAlloc;
+    int     eqnSlotAlloc;
+};
+#define IX                      (*(SC->solve->ix))
+#define ParamStamp              (SC->solve->paramStamp)
+#define ParamStampAlloc         (SC->solve->paramStampAlloc)
+#define ParamStampNow           (SC->solve->paramStampNow)
+
+int EquationIndexById(hEquation he)
+{
+    if(IX.eqnSlots == 0) return -1;
+
+    int h = he % IX.eqnSlots;
+    while(IX.eqnSlot[h]) {
+        int i = IX.eqnSlot[h] - 1;
+        if(i < EQ->eqns && EQ->eqn[i].he == he) return i;
+        h = (h + 1) % IX.eqnSlots;
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// TRUE if parameter i appears in any equation that's still to be solved.
+//-----------------------------------------------------------------------------
+BOOL ParamAppearsInUnsolvedEquation(int i)
+{
+    int k;
+    for(k = IX.paramEqStart[i]; k < IX.paramEqStart[i+1]; k++) {
+        if(EQ->eqn[IX.paramEq[k]].subSys < 0) return TRUE;
+    }
+    return FALSE;
+}
+
+static void IncidenceAddParams(Expr *e, int *n)
+{
+    switch(e->op) {
+        case EXPR_PARAM: {
+            int p = EParamSlot(e);
+            if(ParamStamp[p] == ParamStampNow) return;
+            ParamStamp[p] = ParamStampNow;
+
+            RESERVE(IX.eqParam, IX.eqParamAlloc, *n + 1);
+            IX.eqParam[*n] = p;
+            (*n)++;
+            return;
+        }
+
+        case EXPR_CONSTANT:
+        case EXPR_DIMENSION:
+            return;
+
+        case EXPR_PLUS:
+        case EXPR_MINUS:
+        case EXPR_TIMES:
+        case EXPR_DIV:
+            IncidenceAddParams(e->e0, n);
+            IncidenceAddParams(e->e1, n);
+            return;
+
+        case EXPR_SQRT:
+        case EXPR_SQUARE:
+        case EXPR_NEGATE:
+        case EXPR_SIN:
+        case EXPR_COS:
+            IncidenceAddParams(e->e0, n);
+            return;
+
+        default:
+            oops();
+    }
+}
+
+#define IncidenceCursor         (SC->solve->incidenceCursor)
+#define IncidenceCursorAlloc    (SC->solve->incidenceCursorAlloc)
+static void BuildIncidence(void)
+{
+    int i, k;
+
+    RESERVE(IX.eqParamStart, IX.eqParamStartAlloc, EQ->eqns + 1);
+    RESERVE(IX.paramEqStart, IX.paramEqStartAlloc, SK->params + 1);
+    RESERVE(ParamStamp, ParamStampAlloc, SK->params);
+    RESERVE(IncidenceCursor, IncidenceCursorAlloc, SK->params);
+
+    // Odd sizes are good enough for linear probing; we only need to keep
+    // it sparse.
+    IX.eqnSlots = (2*EQ->eqns + 1) | 1;
+    RESERVE(IX.eqnSlot, IX.eqnSlotAlloc, IX.eqnSlots);
+    memset(IX.eqnSlot, 0, IX.eqnSlots*sizeof(int));
+    for(i = 0; i < EQ->eqns; i++) {
+        int h = EQ->eqn[i].he % IX.eqnSlots;
+        while(IX.eqnSlot[h]) h = (h + 1) % IX.eqnSlots;
+        IX.eqnSlot[h] = i + 1;
+    }
+
+    // Equations to parameters, by walking each equation once.
+    int n = 0;
+    for(i = 0; i < EQ->eqns; i++) {
+        IX.eqParamStart[i] = n;
+        ParamStampNow++;
+        IncidenceAddParams(EQ->eqn[i].e, &n);
+    }
+    IX.eqParamStart[EQ->eqns] = n;
+    IX.incidences = n;
+    RESERVE(IX.paramEq, IX.paramEqAlloc, n);
+
+    // And transpose that, to get parameters to equations.
+    for(i = 0; i <= SK->params; i++) {
+        IX.paramEqStart[i] = 0;
+    }
+    for(k = 0; k < n; k++) {
+        (IX.paramEqStart[IX.eqParam[k] + 1])++;
+    }
+    for(i = 0; i < SK->params; i++) {
+        IX.paramEqStart[i+1] += IX.paramEqStart[i];
+    }
+    memcpy(IncidenceCursor, IX.paramEqStart, SK->params*sizeof(int));
+    for(i = 0; i < EQ->eqns; i++) {
+        for(k = IX.eqParamStart[i]; k < IX.eqParamStart[i+1]; k++) {
+            IX.paramEq[(IncidenceCursor[IX.eqParam[k]])++] = i;
+        }
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Given the sketched entities and constraints, write a system of equations
 // that the parameters ought to satisfy. These equations are kept in
@@ -152,7 +370,7 @@ void GenerateEquationsToSolve(void)
     for(i = 0; i < EQ->eqns; i++) {
         EQ->eqn[i].subSys = -1;
     }
-
+    BuildIncidence();
 
     dbp2("have %d equations", EQ->eqns);
     for(i = 0; i < EQ->eqns; i++) {
@@ -196,89 +414,177 @@ void MarkUnknowns(void)
 //-----------------------------------------------------------------------------
 // The first stage of the solution is to forward-substitute certain
 // equations. If we have param0 - param1 = 0, then it doesn't make sense
-// to keep that equation and both parameters around; we'll replace param1
-// with param0 in the equations, wherever it might appear, and mark param1
-// as known. At the end, we can go back and set param1 := param0.
+// to keep that equation and both parameters around; we'll replace param0
+// with param1 in the equations, wherever it might appear, and mark param0
+// as known. At the end, we can go back and set param0 := param1. The same
+// goes for any a*param0 + b*param1 + c = 0, with numbers for a and b, like
+// param0 - param1 - c = 0 for a fixed offset; then param0 gets replaced
+// by -(b/a)*param1 - c/a.
+//
+// The parameters that get substituted form classes, which we keep as a
+// weighted union-find forest over SK->param[], with each class's
+// substitute at its root. Each parameter keeps how to get its value from
+// its parent's, as scale*parent + offset, and those compose along the way
+// to the root. So we can work out every substitution first, and then
+// rewrite the equations just once.
 //-----------------------------------------------------------------------------
+#define SubstSlot               (SC->solve->substSlot)
+#define SubstSlotAlloc          (SC->solve->substSlotAlloc)
+#define SubstScale              (SC->solve->substScale)
+#define SubstScaleAlloc         (SC->solve->substScaleAlloc)
+#define SubstOffset             (SC->solve->substOffset)
+#define SubstOffsetAlloc        (SC->solve->substOffsetAlloc)
+#define SubstPath               (SC->solve->substPath)
+#define SubstPathAlloc          (SC->solve->substPathAlloc)
+#define Substitute              (SC->solve->substitute)
+#define SubstituteAlloc         (SC->solve->substituteAlloc)
+
+// The expression k*e + off, where a NULL is zero.
+static Expr *SubstAffine(double k, Expr *e, Expr *off)
+{
+    Expr *r = NULL;
+    if(e && k != 0) {
+        if(e->op == EXPR_CONSTANT) {
+            r = EConstant(k*e->v);
+        } else {
+            r = (k == 1) ? e : ETimes(EConstant(k), e);
+        }
+    }
+    if(!r) return off;
+    if(!off) return r;
+    if(r->op == EXPR_CONSTANT && off->op == EXPR_CONSTANT) {
+        return EConstant(r->v + off->v);
+    }
+    return EPlus(r, off);
+}
+
+static int SubstRoot(int i)
+{
+    int r = i, n = 0;
+    while(SubstSlot[r] != r) {
+        SubstPath[n++] = r;
+        r = SubstSlot[r];
+    }
+    // Point everything on the way straight at the root, so that we don't
+    // walk that path again. That goes from the root down, so that each
+    // parameter's parent is already in terms of the root.
+    int k;
+    for(k = n - 2; k >= 0; k--) {
+        int j = SubstPath[k];
+        int q = SubstSlot[j];
+        SubstOffset[j] = SubstAffine(SubstScale[j], SubstOffset[q],
+                                                            SubstOffset[j]);
+        SubstScale[j] *= SubstScale[q];
+        SubstSlot[j] = r;
+    }
+    return r;
+}
 static void SolveByForwardSubstitution(void)
 {
 #define SUBSYS_SOLVED_BY_SUBSTITUTION       65535
     
     int i, j;
+    BOOL rewrote = FALSE;
+
+    RESERVE(SubstSlot, SubstSlotAlloc, SK->params);
+    RESERVE(SubstScale, SubstScaleAlloc, SK->params);
+    RESERVE(SubstOffset, SubstOffsetAlloc, SK->params);
+    RESERVE(SubstPath, SubstPathAlloc, SK->params);
+    RESERVE(Substitute, SubstituteAlloc, SK->params);
+    for(j = 0; j < SK->params; j++) {
+        SubstSlot[j] = j;
+        SubstScale[j] = 1;
+        SubstOffset[j] = NULL;
+        Substitute[j] = NULL;
+    }
     
     for(i = 0; i < EQ->eqns; i++) {
-        hParam toReplace, replacement;
-        if(EExprMarksTwoParamsEqual(EQ->eqn[i].e, &toReplace, &replacement)) {
-
-            dbp2("equation just marks two paramters equal:");
-            EPrint("this: ", EQ->eqn[i].e);
-            dbp2("we think %08x and %08x", toReplace, replacement);
-
-            if(toReplace == replacement) {
-                // This might happen if e.g. we marked a line as horizontal
-                // twice, or if we constrained two horizontal points to lie
-                // on top of two other horizontal points. It's an error, but
-                // we should ignore it and go blindly ahead, and let the
-                // assumption code find it.
-                continue;
-            }
+        int a, b;
+        double ka, kb;
+        if(!ELinearInTwo(EQ->eqn[i].e, &a, &ka, &b, &kb, NULL)) continue;
+
+        dbp2("equation is linear in two parameters:");
+        EPrint("this: ", EQ->eqn[i].e);
+
+        // The equation's parameters might have been substituted by
+        // earlier equations, so it's really about their substitutes.
+        int toReplace = SubstRoot(a);
+        int replacement = SubstRoot(b);
+        dbp2("we think %08x and %08x", SK->param[toReplace].id,
+                                       SK->param[replacement].id);
+
+        if(toReplace == replacement) {
+            // This might happen if e.g. we marked a line as horizontal
+            // twice, or if we constrained two horizontal points to lie
+            // on top of two other horizontal points. It's an error, or
+            // an equation in one unknown; either way we should go blindly
+            // ahead, and let the later stages deal with it.
+            continue;
+        }
 
-            if(ParamById(toReplace)->known) {
-                // This must be one of the references; it's okay to constrain
-                // against that, but we want the references to stay where
-                // they are, so they should become the replacment.
-                hParam t;
-                t = toReplace;
-                toReplace = replacement;
-                replacement = t;
-            }
+        if(SK->param[toReplace].known && SK->param[replacement].known) {
+            // Between two references, which stay where they are.
+            continue;
+        }
 
-            // Sanity check, that our replacement hasn't been substituted
-            // already.
-            if(ParamById(replacement)->substd) {
-                // This shouldn't have happened! If we made it here
-                // then pA appeared in an equation, but if pA is
-                // already substituted, then pA should have already
-                // been replaced with its substitute.
-                oopsnf();
-                continue;
-            }
+        // So in terms of those, it's A*toReplace + B*replacement + C = 0.
+        double A = ka*SubstScale[a], B = kb*SubstScale[b];
+        // Newton's method would call this singular, so leave it to that.
+        if(fabs(A) < 1e-10 || fabs(B) < 1e-10) continue;
 
-            // So now let's make the substitute. First, fix up the parameter
-            // record to reflect the substitution.
-            BOOL found = FALSE;
-            for(j = 0; j < SK->params; j++) {
-                // Substitute the parameter that this equation involves.
-                if(SK->param[j].id == toReplace) {
-                    if(SK->param[j].substd) oops();
-
-                    SK->param[j].substd = replacement;
-                    SK->param[j].known = TRUE;
-                    found = TRUE;
-                }
+        Expr *c;
+        ELinearInTwo(EQ->eqn[i].e, &a, &ka, &b, &kb, &c);
+        Expr *C = SubstAffine(ka, SubstOffset[a],
+                                SubstAffine(kb, SubstOffset[b], c));
 
-                // But toReplace might previously have been used as a
-                // replacement itself. So fix those up too.
-                if(SK->param[j].substd == toReplace) {
-                    SK->param[j].substd = replacement;
-                }
-            }
-            if(!found) {
-                oopsnf();
-                continue;
-            }
+        if(SK->param[toReplace].known ||
+            (!SK->param[replacement].known && fabs(B) > fabs(A)))
+        {
+            // If this is one of the references, then it's okay to
+            // constrain against that, but we want the references to stay
+            // where they are, so they should become the replacement.
+            // Otherwise divide by the bigger coefficient, to keep the
+            // scales of the substitutions no more than one.
+            int t = toReplace;
+            toReplace = replacement;
+            replacement = t;
+            double tk = A;
+            A = B;
+            B = tk;
+        }
 
-            // Then, reach in and fix all the equations (including this
-            // one, so that it becomes meaningless).
-            for(j = 0; j < EQ->eqns; j++) {
-                EReplaceParameter(EQ->eqn[j].e, replacement, toReplace);
-            }
+        // So now let's make the substitute; everything that was
+        // substituted by toReplace goes along with it.
+        SubstSlot[toReplace] = replacement;
+        SubstScale[toReplace] = -B/A;
+        SubstOffset[toReplace] = SubstAffine(-1/A, C, NULL);
+        SK->param[toReplace].known = TRUE;
+
+        // And mark this equation as already used. We've eliminated
+        // one equation and one unknown.
+        EQ->eqn[i].subSys = SUBSYS_SOLVED_BY_SUBSTITUTION;
+        rewrote = TRUE;
+    }
+
+    if(rewrote) {
+        // Fix up the parameter records to reflect the substitutions, and
+        // then reach in and fix all the equations (including the ones that
+        // we just used, so that they become meaningless).
+        for(j = 0; j < SK->params; j++) {
+            int r = SubstRoot(j);
+            if(r == j) continue;
 
-            // And mark this equation as already used. We've eliminated
-            // one equation and one unknown.
-            EQ->eqn[i].subSys = SUBSYS_SOLVED_BY_SUBSTITUTION;
+            SK->param[j].substd = SK->param[r].id;
+            Substitute[j] = SubstAffine(SubstScale[j],
+                                EParam(SK->param[r].id), SubstOffset[j]);
+        }
+        for(j = 0; j < EQ->eqns; j++) {
+            EQ->eqn[j].e = ESubstituteParameters(EQ->eqn[j].e, Substitute);
+            EQ->eqn[j].fingerprintValid = FALSE;
         }
     }
+    // The equations now mention different parameters.
+    if(rewrote) BuildIncidence();
 
     dbp2("");
     dbp2("");
@@ -300,409 +606,1269 @@ static void SolveByForwardSubstitution(void)
 }
 
 //-----------------------------------------------------------------------------
-// Some helper functions to get information on the subsystem currently under
-// construction: the number of equations, and the number of unknowns.
+// The subsystem currently under construction: its equations, and the
+// unknowns that they contain (once each, and in a bitset so that we can
+// test membership quickly). The unknowns also get SK->param[].mark set,
+// since that's how the numerical solver finds them; marks are kept zero
+// for every parameter that isn't in here.
 //-----------------------------------------------------------------------------
-static int EqnsInSubsys(int subSys)
-{
-    int c = 0;
+struct SubsystemTag {
+    int     eqns;
+    int     *eqn;
+    int     params;
+    int     *param;
+    DWORD   *marked;
+
+    int     eqnAlloc;
+    int     paramAlloc;
+    int     markedAlloc;
+};
+#define Sub                     (*(SC->solve->sub))
+
+// And how much of the system is left to solve, kept up to date as
+// subsystems get solved so that we needn't count.
+#define Left                    (SC->solve->left)
 
-    int i;
-    for(i = 0; i < EQ->eqns; i++) { 
-        if(EQ->eqn[i].subSys == subSys) {
-            c++;
+//-----------------------------------------------------------------------------
+// The unknowns of equation eq, counted in the context of those parameters
+// already known (as for EEvalKnown(), but without building anything). They
+// go in Unknown[], once or more each; returns how many.
+//-----------------------------------------------------------------------------
+#define Unknown                 (SC->solve->unknown)
+#define UnknownAlloc            (SC->solve->unknownAlloc)
+static int PrunedUnknowns(int eq)
+{
+    for(;;) {
+        int n = 0;
+        double v;
+        if(EKnownUnknowns(EQ->eqn[eq].e, Unknown, UnknownAlloc, &n, &v)) {
+            return 0;
         }
+        if(n <= UnknownAlloc) return n;
+        RESERVE(Unknown, UnknownAlloc, n);
     }
-    
-    return c;
 }
-static int ParamsMarked(void)
+
+//-----------------------------------------------------------------------------
+// Add equation eq to the subsystem. Unknowns must be counted in the context
+// of those parameters already known; the equation p1*p2 + p3 = 4 is
+// independent of p2 if p1 = 0.
+//-----------------------------------------------------------------------------
+static void SubAddEquation(int eq, int subSys)
 {
-    int c = 0;
+    int i, n;
+
+    EQ->eqn[eq].subSys = subSys;
+    Sub.eqn[(Sub.eqns)++] = eq;
+
+    n = PrunedUnknowns(eq);
+    for(i = 0; i < n; i++) {
+        int p = Unknown[i];
+        DWORD bit = 1u << (p & 31);
+        if(Sub.marked[p >> 5] & bit) continue;
+        Sub.marked[p >> 5] |= bit;
+        Sub.param[(Sub.params)++] = p;
+        SK->param[p].mark = 1;
+    }
+}
 
+//-----------------------------------------------------------------------------
+// Start a new, empty, subsystem. SubRelease also gives the equations back,
+// so that they're free to be partitioned later.
+//-----------------------------------------------------------------------------
+static void SubClear(void)
+{
     int i;
-    for(i = 0; i < SK->params; i++) {
-        if((!SK->param[i].known) && SK->param[i].mark > 0) {
-            c++;
-        }
+    for(i = 0; i < Sub.params; i++) {
+        int p = Sub.param[i];
+        Sub.marked[p >> 5] &= ~(1u << (p & 31));
+        // Left over from a previous solve, maybe of a bigger sketch.
+        if(p < SK->params) SK->param[p].mark = 0;
     }
-
-    return c;
+    Sub.params = 0;
+    Sub.eqns = 0;
+}
+static void SubRelease(void)
+{
+    int i;
+    for(i = 0; i < Sub.eqns; i++) {
+        EQ->eqn[Sub.eqn[i]].subSys = -1;
+    }
+    SubClear();
 }
 
 //-----------------------------------------------------------------------------
-// Try to partition off a subsystem of equations, of at most depth equations
-// (but fewer is better, if we can do it), using only those equations
-// appearing at position startAt or later in EQ->eqn[]. If we succeed, then
-// we will mark those equations with the provided subSys, and return EXACT.
-// If we reach maximum depth with no luck, then we will return UNDER. If
-// we find a single equation where all the parameters are known, then
-// return OVER.
+// Structural decomposition of the equations that remain to be solved. We
+// find a maximum matching between those equations and the unknowns that
+// they contain (Hopcroft-Karp), and then the strongly connected components
+// of the graph in which each equation points to the equations that are
+// matched to its unknowns (Tarjan). Those components are the smallest
+// subsystems that can be solved by themselves, and Tarjan's algorithm
+// produces them with each block after all of the blocks that it depends
+// upon; that's the block triangular form of Dulmage and Mendelsohn.
+//-----------------------------------------------------------------------------
+#define NOT_VISITED     (-1)
+struct BlockTriangularTag {
+    // The bipartite graph. eqn[g] is an index into EQ->eqn[], and the
+    // unknowns that it contains (after pruning known parameters) are
+    // param[start[g]] through param[start[g+1]-1], as indices into
+    // SK->param[].
+    int     eqns;
+    int     *eqn;
+    int     *start;
+    int     *param;
+
+    // The matching, and the breadth-first layers used to augment it.
+    int     *matchOfEqn;
+    int     *matchOfParam;
+    int     *dist;
+    int     *queue;
+    int     freeDist;
+
+    // Tarjan's bookkeeping.
+    int     *index;
+    int     *low;
+    BOOL    *onStack;
+    int     *stack;
+    int     stackDepth;
+    int     counter;
+
+    // The blocks, in the order that they should be solved. Block b is
+    // equations member[blockStart[b]] through member[blockStart[b+1]-1].
+    // A block that contains (or depends upon) an unmatched unknown is
+    // underdetermined, and can't be solved as a square system.
+    int     blocks;
+    int     *blockOf;
+    int     *member;
+    int     *blockStart;
+    BOOL    *underdetermined;
+    // Blocks before this one are solved already, so the searches for the
+    // next block to solve can start here.
+    int     solvedBlocks;
+
+    BOOL    valid;
+
+    // Allocated sizes of the above. Everything indexed by equation is
+    // sized together, since it all gets used together.
+    int     eqnAlloc;
+    int     paramAlloc;
+    int     matchOfParamAlloc;
+};
+#define BT                      (*(SC->solve->bt))
+
+//-----------------------------------------------------------------------------
+// Make room in BT for the current equations and parameters. The arrays
+// indexed by equation don't hold anything between decompositions, so
+// there's no need to copy them when they grow.
 //-----------------------------------------------------------------------------
-#define UNDER 0
-#define EXACT 1
-#define OVER  2
-static int SeekExactlyConstrained(int subSys, int depth, int startAt)
+static void BlockReserve(void)
 {
-    int i;
-    for(i = startAt; i < EQ->eqns; i++) {
-        // If an equation has already been used (either by a previously
-        // solved subsystem, or by the subsystem that we are working on),
-        // then we're not interested.
-        if(EQ->eqn[i].subSys >= 0) continue;
+    // An equation can't mention more unknowns than it mentions parameters.
+    RESERVE(BT.param, BT.paramAlloc, IX.incidences);
+    RESERVE(BT.matchOfParam, BT.matchOfParamAlloc, SK->params);
 
-        // So let's investigate what happens if add this equation to our
-        // subsystem under construction.
-        EQ->eqn[i].subSys = subSys;
+    if(EQ->eqns + 1 <= BT.eqnAlloc) return;
 
-        // Unknowns must be counted in the context of those parameters
-        // already known; the equation p1*p2 + p3 = 4 is independent of
-        // p2 if p1 = 0.
-        Expr *e = EQ->eqn[i].e;
-        Expr *pruned = EEvalKnown(e);
-    
-        EMark(pruned, 1);
-    
-        int eqs = EqnsInSubsys(subSys);
-        int unknowns = ParamsMarked();
-
-        if(eqs == unknowns) {
-            // What we want; we'll be solving this one. So return.
-            return EXACT;
-        } else if(eqs > unknowns) {
-            // When you add an equation to the system, you add one equation,
-            // and zero or more unknowns. You should not be able to move from
-            // underconstrained to overconstrained without passing through
-            // exactly constrained, so this is can't happen.
-            //
-            // The exception is the degenerate case: an equation that is
-            // inconsistent by itself. That might happen if all of that
-            // equation's parameters have been solved for already.
-            //
-            // In that case, the system is clearly inconsistent.
-            return OVER;
-        } else if(eqs < unknowns) {
-            // We're underconstrained, but perhaps we can fix that by
-            // adding another equation.
-
-            if(depth > 1) {
-                // Of course, it's hopeless if we have more free variables
-                // than we have equations left to fix them, so check that.
-                if(unknowns - eqs <= depth) {
-                    switch(SeekExactlyConstrained(subSys, depth - 1, i + 1)) {
-                        case EXACT:
-                            return EXACT;
-
-                        case OVER:
-                            return OVER;
-
-                        case UNDER:
-                            // Keep looking
-                            break;
-                    }
-                }
-            }
-            // And if it didn't return, then we keep going.
-        }
+    int n = EQ->eqns + 1;
+    if(n < 2*BT.eqnAlloc) n = 2*BT.eqnAlloc;
 
-        // Didn't go, put this one back and try another.
-        EMark(pruned, -1);
-        EQ->eqn[i].subSys = -1;
+    int **tables[] = { &BT.eqn, &BT.start, &BT.matchOfEqn, &BT.dist,
+        &BT.queue, &BT.index, &BT.low, &BT.onStack, &BT.stack, &BT.blockOf,
+        &BT.member, &BT.blockStart, &BT.underdetermined };
+    int i;
+    for(i = 0; i < arraylen(tables); i++) {
+        if(*tables[i]) DFree(*tables[i]);
+        *tables[i] = (int *)DAlloc(n*sizeof(int));
+        if(!*tables[i]) oops();
     }
-
-    return UNDER;
+    BT.eqnAlloc = n;
 }
 
 //-----------------------------------------------------------------------------
-// Try to pick off a subsytem of equations that is possibly consistent (i.e.,
-// n equations in n unknowns). Then, try to solve that subsystem. If we
-// succeed, then check if we still have unknowns. If no, then we're done,
-// so return TRUE. If yes, then call SolveSubSystemsStartingFrom(subSys + 1)
-// recursively.
-//
-// If we can't find a possibly consistent subsystem, then perhaps we are
-// underdetermined, and should make assumptions. In that case, make an
-// assumption, and call SolveSubSystemsStartingFrom(subSys). If that
-// succeeds, then we're done and can return TRUE. If it fails, then we try
-// all available assumptions, until we run out and must return FALSE.
-//
-// The major observation to make is that this function returns FALSE only
-// when the subsystem it tried to solve is inconsistent. This might be
-// because the given set of constraints really is inconsistent, or it
-// might be because we made a lousy assumption while solving an
-// underconstrained system.
+// Append the unknowns of equation eq to its incidence list, once each.
+// Returns FALSE if we've run out of space.
 //-----------------------------------------------------------------------------
-BOOL SolveSubSystemsStartingFrom(int subSys)
-{   
-    int i, j;
-
-    // An equation is worth considering (because it might cause our
-    // system to become solvable immediately, or lead to a solution
-    // that does) if it contains at least one unknown parameter in
-    // common with the equations in our subsystem so far. That's a
-    // TODO, though, for now we look at all the combinations.
-
-    // If we're taking way too long then give up.
-    int now = GetTickCount();
-    if(now - SolutionStartTime > MAX_SOLUTION_TIME) {
-        return FALSE;
-    }
-    // If we're taking a little bit too long then show an hourglass.
-    if(now - SolutionStartTime > MAX_SOLUTION_TIME_BEFORE_HOURGLASS &&
-        !CursorIsHourglass)
-    {
-        uiSetCursorToHourglass();
-        CursorIsHourglass = TRUE;
+static BOOL BlockAddParams(int eq)
+{
+    int i, n;
+
+    n = PrunedUnknowns(eq);
+    for(i = 0; i < n; i++) {
+        int p = Unknown[i];
+        if(ParamStamp[p] == ParamStampNow) continue;
+        ParamStamp[p] = ParamStampNow;
+
+        int k = BT.start[BT.eqns+1];
+        if(k >= BT.paramAlloc) return FALSE;
+        BT.param[k] = p;
+        BT.start[BT.eqns+1] = k + 1;
     }
+    return TRUE;
+}
 
-    // First, let's count how many equations we have, and how many unknowns.
-    int unknowns = 0;
-    for(i = 0; i < SK->params; i++) {
-        SketchParam *p = &(SK->param[i]);
-        if(!p->known) {
-            unknowns++;
+//-----------------------------------------------------------------------------
+// The two halves of a Hopcroft-Karp phase. First, a breadth-first search
+// from the unmatched equations, along alternating paths, to find the length
+// of the shortest augmenting path; then a depth-first search that augments
+// along vertex-disjoint paths of exactly that length.
+//-----------------------------------------------------------------------------
+static BOOL BlockMatchingLayers(void)
+{
+    int *queue = BT.queue;
+    int head = 0, tail = 0;
+    int g, k;
+
+    for(g = 0; g < BT.eqns; g++) {
+        if(BT.matchOfEqn[g] < 0) {
+            BT.dist[g] = 0;
+            queue[tail++] = g;
+        } else {
+            BT.dist[g] = NOT_VISITED;
         }
     }
-    dbp2("unknowns: %d", unknowns);
-    int eqs = 0;
-    for(i = 0; i < EQ->eqns; i++) {
-        if(EQ->eqn[i].subSys < 0) {
-            eqs++;
+    BT.freeDist = NOT_VISITED;
+
+    while(head < tail) {
+        g = queue[head++];
+        if(BT.freeDist != NOT_VISITED && BT.dist[g] >= BT.freeDist) continue;
+
+        for(k = BT.start[g]; k < BT.start[g+1]; k++) {
+            int h = BT.matchOfParam[BT.param[k]];
+            if(h < 0) {
+                if(BT.freeDist == NOT_VISITED) BT.freeDist = BT.dist[g] + 1;
+            } else if(BT.dist[h] == NOT_VISITED) {
+                BT.dist[h] = BT.dist[g] + 1;
+                queue[tail++] = h;
+            }
         }
     }
-    dbp2("equations to be solved: %d", eqs);
 
-    // More equations than unknowns is an overdetermined system, certainly
-    // inconsistent or redundant.
-    if(eqs > unknowns) return FALSE;
-
-    // Zero unknowns (and zero equations, since the prevous check passed)
-    // is an empty system, which means that we solved successfully.
-    if(unknowns == 0) return TRUE;
-
-    // Before we start searching by brute force, let's see if we can
-    // reuse a partition from last time.
-    for(i = (RSp->sets - 1); i >= 0; i--) {
-        // They have a subsystem of equations that perhaps we should
-        // try. Start from an empty subset
-        for(j = 0; j < SK->params; j++) {
-            SK->param[j].mark = 0;
-        }
-        // Mark the unknowns in each equation of our remembered subset.
-        for(j = 0; j < RSp->set[i].eqs; j++) {
-            hEquation he = RSp->set[i].eq[j];
-            int k;
-            for(k = 0; k < EQ->eqns; k++) {
-                if(EQ->eqn[k].he == he) {
-                    // Don't try to grab the equation if it's already used.
-                    if(EQ->eqn[k].subSys < 0) {
-                        EQ->eqn[k].subSys = subSys;
-                        Expr *pruned = EEvalKnown(EQ->eqn[k].e);
-                        EMark(pruned, 1);
-                    }
-                }
-            }
+    return (BT.freeDist != NOT_VISITED);
+}
+static BOOL BlockAugment(int g)
+{
+    int k;
+    for(k = BT.start[g]; k < BT.start[g+1]; k++) {
+        int p = BT.param[k];
+        int h = BT.matchOfParam[p];
+
+        BOOL found;
+        if(h < 0) {
+            found = (BT.dist[g] + 1 == BT.freeDist);
+        } else {
+            found = (BT.dist[h] == BT.dist[g] + 1 && BlockAugment(h));
         }
-        int eqn = EqnsInSubsys(subSys);
-        int unkns = ParamsMarked();
-        if(eqn == unkns && eqn > 0) {
-            // This subsystem is ready to solve.
-            goto got_exact;
+        if(found) {
+            BT.matchOfParam[p] = g;
+            BT.matchOfEqn[g] = p;
+            return TRUE;
         }
-        // This subystem is not soluble, so those equations are free
-        // to be partitioned later.
-        for(j = 0; j < EQ->eqns; j++) {
-            if(EQ->eqn[j].subSys == subSys) {
-                EQ->eqn[j].subSys = -1;
-            }
+    }
+    BT.dist[g] = NOT_VISITED;
+    return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// Tarjan's algorithm, from equation g. A component gets emitted only after
+// every component reachable from it, so the blocks come out in the order
+// that they should be solved.
+//-----------------------------------------------------------------------------
+static void BlockStrongConnect(int g)
+{
+    int k;
+
+    BT.index[g] = BT.counter;
+    BT.low[g] = BT.counter;
+    BT.counter++;
+    BT.stack[BT.stackDepth++] = g;
+    BT.onStack[g] = TRUE;
+
+    for(k = BT.start[g]; k < BT.start[g+1]; k++) {
+        int h = BT.matchOfParam[BT.param[k]];
+        if(h < 0 || h == g) continue;
+
+        if(BT.index[h] == NOT_VISITED) {
+            BlockStrongConnect(h);
+            if(BT.low[h] < BT.low[g]) BT.low[g] = BT.low[h];
+        } else if(BT.onStack[h]) {
+            if(BT.index[h] < BT.low[g]) BT.low[g] = BT.index[h];
         }
-        // Subsystems are less dangerous than assumptions (i.e., the
-        // search paths they start terminate quicker) so we can keep
-        // it around to try later, even if it doesn't work now.
     }
 
-    // Right now we have a subsystem of zero equations, so that's in zero
-    // unknowns.
-    for(i = 0; i < SK->params; i++) {
-        SK->param[i].mark = 0;
+    if(BT.low[g] == BT.index[g]) {
+        int b = BT.blocks;
+        int n = BT.blockStart[b];
+        int h;
+        do {
+            h = BT.stack[--BT.stackDepth];
+            BT.onStack[h] = FALSE;
+            BT.blockOf[h] = b;
+            BT.member[n++] = h;
+        } while(h != g);
+
+        BT.blockStart[b+1] = n;
+        BT.blocks = b + 1;
     }
+}
 
-    // Now try to find a possibly-consistent susbsystem, in the smallest
-    // available number of unknowns.
-    int depth;
-    for(depth = 1; depth <= MAX_PARTITIONED_UNKNOWNS; depth++) {
-        switch(SeekExactlyConstrained(subSys, depth, 0)) {
-            case UNDER:
-                // Couldn't find a soluble subsystem at the current depth,
-                // so we have to look deeper.
-                break;
+//-----------------------------------------------------------------------------
+// Build the graph for the equations that haven't been assigned to a
+// subsystem yet, and decompose it into blocks. Returns FALSE if the
+// equations are structurally overdetermined (some equation can't be matched
+// to an unknown of its own), which means that they're inconsistent.
+//-----------------------------------------------------------------------------
+static BOOL BlockDecompose(void)
+{
+    int i, g, k, b;
 
-            case OVER:
-                // Single equation left where all the equations already
-                // solved for, bad. We must 
-                goto system_inconsistent;
+    BlockReserve();
 
-            case EXACT:
-                // What we're looking for.
-                goto got_exact;
+    BT.valid = FALSE;
+    BT.eqns = 0;
+    BT.blocks = 0;
+    BT.solvedBlocks = 0;
+    BT.start[0] = 0;
+    BT.blockStart[0] = 0;
+
+    for(i = 0; i < EQ->eqns; i++) {
+        if(EQ->eqn[i].subSys >= 0) continue;
+
+        ParamStampNow++;
+        BT.eqn[BT.eqns] = i;
+        BT.start[BT.eqns+1] = BT.start[BT.eqns];
+        if(!BlockAddParams(i)) {
+            // Too big to think about structurally; let the caller fall
+            // back to solving everything at once.
+            return TRUE;
         }
+        BT.matchOfEqn[BT.eqns] = -1;
+        BT.index[BT.eqns] = NOT_VISITED;
+        BT.onStack[BT.eqns] = FALSE;
+        (BT.eqns)++;
     }
-    // We give up; can't find a small subsystem to partition off and solve.
-    // Instead let's just solve the whole mess at once. The assumer was
-    // responsible for making the system exactly constrained, so as long
-    // as we don't have too many eqs to solve, we should be fine.
     for(i = 0; i < SK->params; i++) {
-        SK->param[i].mark = 0;
+        BT.matchOfParam[i] = -1;
     }
-    eqs = 0;
-    for(i = 0; i < EQ->eqns; i++) {
-        if(EQ->eqn[i].subSys < 0) {
-            eqs++;
-            EQ->eqn[i].subSys = subSys;
-            EMark(EQ->eqn[i].e, 1);
+
+    while(BlockMatchingLayers()) {
+        for(g = 0; g < BT.eqns; g++) {
+            if(BT.matchOfEqn[g] < 0) BlockAugment(g);
         }
     }
-    // Didn't want to waste time pruning our equations, so have to unmark
-    // those we already solved for.
-    for(i = 0; i < SK->params; i++) {
-        if(SK->param[i].known) {
-            SK->param[i].mark = 0;
+    for(g = 0; g < BT.eqns; g++) {
+        if(BT.matchOfEqn[g] < 0) {
+            dbp2("structurally overdetermined at eqn %08x",
+                EQ->eqn[BT.eqn[g]].he);
+            return FALSE;
         }
     }
-    unknowns = ParamsMarked();
-    if(eqs != unknowns) goto system_inconsistent; // Shouldn't happen anyways
-    if(eqs > MAX_NUMERICAL_UNKNOWNS) goto system_inconsistent;
-
-    // And now we solve, the same as if we had picked these off deliberately.
-    // This subsystem will get remembered, which might be good or bad;
-    // on the one hand that will save us from exhausting the search next
-    // time, but on the other, it will stop us from discovering a better
-    // partition if a change to the system permits that. Such a change
-    // seems unlikely, at least without breaking the remembered subsystem,
-    // so I'll leave it like this.
 
-got_exact:
-    // We picked off a possibly-consistent subsystem, which we can
-    // now solve numerically. Let us do so.
-    if(!SolveNewton(subSys)) {
-        // What does this mean? It means that our subsystem might have been
-        // consistent (n equations in n unknowns), but either it wasn't
-        // (some eqns linearly dependent, linearized about current guess).
-        // So give up, because this branch is now hopeless.
-        goto system_inconsistent;
-    }
-
-    // Our solution succeed; so mark the parameters that we were solving
-    // for as known. We must remember which parameters we marked as known;
-    // if the system turns out to be inconsistent, then we must replace
-    // them as unknown so that other solutions can be investigated.
-    for(i = 0; i < SK->params; i++) {
-        SketchParam *p = &(SK->param[i]);
-
-        if(p->known) {
-            // okay, nothing to do
-        } else if(p->mark != 0) {
-            // This is one of the unknowns that we just solved for.
-            p->known = TRUE;
-        }
+    BT.counter = 0;
+    BT.stackDepth = 0;
+    for(g = 0; g < BT.eqns; g++) {
+        if(BT.index[g] == NOT_VISITED) BlockStrongConnect(g);
     }
 
-    // And let's try to solve the next subsystem.
-    if(SolveSubSystemsStartingFrom(subSys + 1)) {
-        // Everything worked; we've solved the full system. Let's make a
-        // note of the subsystem we chose to use.
-        //
-        // Note that this list will get built in reverse order, because we
-        // can't be sure that we chose a good subsystem until we've
-        // confirmed that that leads to a consistent solution.
-        int k = RSt->sets;
-        if(k >= MAX_REMEMBERED_SUBSYSTEMS) oops();
-        RSt->set[k].p = 0;
-        RSt->set[k].eqs = 0;
-        for(i = 0; i < EQ->eqns; i++) {
-            if(EQ->eqn[i].subSys == subSys) {
-                j = RSt->set[k].eqs;
-                if(j >= MAX_NUMERICAL_UNKNOWNS) oops();
-                RSt->set[k].eq[j] = EQ->eqn[i].he;
-                RSt->set[k].eqs = (j + 1);
+    // Anything that touches an unmatched unknown could be satisfied by
+    // moving that unknown, and so could anything that depends on it.
+    for(b = 0; b < BT.blocks; b++) {
+        BT.underdetermined[b] = FALSE;
+        for(i = BT.blockStart[b]; i < BT.blockStart[b+1]; i++) {
+            g = BT.member[i];
+            for(k = BT.start[g]; k < BT.start[g+1]; k++) {
+                int h = BT.matchOfParam[BT.param[k]];
+                if(h < 0 || BT.underdetermined[BT.blockOf[h]]) {
+                    BT.underdetermined[b] = TRUE;
+                }
             }
         }
-        RSt->sets = (k + 1);
-        return TRUE;
-    } else {
-        goto system_inconsistent;
     }
-    
-system_inconsistent:
-    // Either this subsystem was inconsistent itself, or we later on became
-    // unable to make a consistent subsystem and yet still had unknowns
-    // that we hadn't solved for. It might not be hopeless, though; if we
-    // were called after an assumption was made, then maybe a different
-    // assumption will work better.
-    dbp2("so inconsistent");
 
-    return FALSE;
+    dbp2("%d equations in %d blocks", BT.eqns, BT.blocks);
+    BT.valid = TRUE;
+    return TRUE;
 }
 
 //-----------------------------------------------------------------------------
-// Change the parameters of the sketch in such a way as to make them satisfy
-// the provided constraints.
+// Pick the next block that's ready to solve, and mark its equations with
+// the given subSys and its unknowns in SK->param[].mark, the same way the
+// numerical solver expects. The decomposition is computed once and reused
+// as blocks get solved; if we find that it's gone stale (because some
+// other subsystem got solved, or because a newly known parameter pruned
+// an unknown out of an equation), then we recompute it.
 //-----------------------------------------------------------------------------
-void Solve(void)
+#define BLOCK_NONE  0
+#define BLOCK_FOUND 1
+#define BLOCK_OVER  2
+static void BlockSkipSolved(void)
 {
     int i;
-
-    CursorIsHourglass = FALSE;
-    SolutionStartTime = GetTickCount();
-   
-    if(SK->eqnsDirty) {
-        uiClearAssumptionsList();
-        uiClearConstraintsList();
+    while(BT.solvedBlocks < BT.blocks) {
+        int b = BT.solvedBlocks;
+        for(i = BT.blockStart[b]; i < BT.blockStart[b+1]; i++) {
+            if(EQ->eqn[BT.eqn[BT.member[i]]].subSys < 0) return;
+        }
+        (BT.solvedBlocks)++;
     }
+}
+static int PartitionNextBlock(int subSys)
+{
+    int attempt, b, i;
 
-    GenerateEquationsToSolve();
+    for(attempt = 0; attempt < 2; attempt++) {
+        if(!BT.valid) {
+            if(!BlockDecompose()) return BLOCK_OVER;
+            if(!BT.valid) return BLOCK_NONE;
+        }
 
-    // Our goal is to find the smallest solvable subsystem, and solve
-    // it. This means that some previously unknown parameters have become
-    // known; with luck, that has created another solvable subsystem,
-    // and we can keep going.
-    // 
-    // The process will go quicker if we solve in smallest chunks possible,
-    // and a practical sketch will tend to break down this way quite
-    // readily.  Each subsystem will be solved by a Newton's method.
+        BlockSkipSolved();
+        for(b = BT.solvedBlocks; b < BT.blocks; b++) {
+            if(BT.underdetermined[b]) continue;
 
-    // Mark all parameters except the references (x-axis, y-axis, origin)
-    // as unknown to start.
-    MarkUnknowns();
+            int n = BT.blockStart[b+1] - BT.blockStart[b];
+            int assigned = 0;
+            for(i = BT.blockStart[b]; i < BT.blockStart[b+1]; i++) {
+                if(EQ->eqn[BT.eqn[BT.member[i]]].subSys >= 0) assigned++;
+            }
+            if(assigned == n) continue;
+            if(assigned > 0) break;
 
-    // It's stupid to solve for an equation of the form p1 - p2 = 0 using
-    // the Newton's method, and such equations arise routinely, from
-    // things like coincidence constraints. Solve those by forward-
-    // substitution now.
-    SolveByForwardSubstitution();
+            SubClear();
+            for(i = BT.blockStart[b]; i < BT.blockStart[b+1]; i++) {
+                SubAddEquation(BT.eqn[BT.member[i]], subSys);
+            }
+            if(Sub.params == n) return BLOCK_FOUND;
 
-    // This is where we decide if any assumptions are needed, and make them
-    // if yes. If the system is provably inconsistent, then we give up now.
-    int assumedParameters = 0;
-    if(!Assume(&assumedParameters)) {
-        uiSetConsistencyStatusText(" Inconsistent constraints.", BK_VIOLET);
-        goto failed;
+            // Doesn't look like it did when we decomposed, so put it back.
+            SubRelease();
+            break;
+        }
+        if(b >= BT.blocks) return BLOCK_NONE;
+
+        BT.valid = FALSE;
     }
 
-    // Now let's count the unknowns, just to be sure.
-    int unknowns;
-    unknowns = 0;
-    for(i = 0; i < SK->params; i++) {
-        if(!SK->param[i].known) {
+    return BLOCK_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// The subsystems that we're solving together, numbered from the subSys that
+// we were called with. These are independent: none of them mentions (even
+// in a term that might get pruned) another's unknowns, so we can run their
+// Newton's methods at the same time, on different threads. To check that,
+// each unknown that a member mentions has touched[] set to the current wave.
+//-----------------------------------------------------------------------------
+struct WaveTag {
+    int     systems;
+    // Subsystem k is equations eqn[eqnStart[k]] through eqn[eqnStart[k+1]-1]
+    // in the unknowns param[paramStart[k]] through param[paramStart[k+1]-1].
+    int     eqnStart[MAX_SUBSYSTEMS_AT_ONCE+1];
+    int     *eqn;
+    int     paramStart[MAX_SUBSYSTEMS_AT_ONCE+1];
+    int     *param;
+
+    int     *touched;
+    int     now;
+
+    int     eqnAlloc;
+    int     paramAlloc;
+    int     touchedAlloc;
+};
+#define Wave                    (*(SC->solve->wave))
+
+// How many candidates we'll turn down before we stop looking for more
+// subsystems to solve alongside the first; otherwise a long chain of
+// dependent subsystems would cost quadratic time.
+#define MAX_WAVE_REJECTS    64
+
+//-----------------------------------------------------------------------------
+// Could these equations join the wave? They must be structurally square, by
+// their unpruned incidence, and mention no unknown that's mentioned by any
+// subsystem already in the wave. This is cheap, so we check it before we
+// go to the work of pruning them.
+//-----------------------------------------------------------------------------
+static BOOL WaveCandidate(int *eqn, int eqns)
+{
+    int i, k;
+    int unknowns = 0;
+
+    ParamStampNow++;
+    for(i = 0; i < eqns; i++) {
+        int eq = eqn[i];
+        for(k = IX.eqParamStart[eq]; k < IX.eqParamStart[eq+1]; k++) {
+            int p = IX.eqParam[k];
+            if(SK->param[p].known || ParamStamp[p] == ParamStampNow) continue;
+            ParamStamp[p] = ParamStampNow;
+
+            if(Wave.touched[p] == Wave.now) return FALSE;
             unknowns++;
         }
     }
-    // If everything's known at this point, then we're done.
-    if(unknowns == 0) goto trivial;
+    return (unknowns == eqns);
+}
 
-    
-    // If possible, instead of searching for the correct partition by
-    // brute force, we will use the previous partition. In order to do
+//-----------------------------------------------------------------------------
+// Add the subsystem in Sub to the wave, and prepare it for the Newton
+// solver. That leaves Sub empty, though its equations stay assigned.
+//-----------------------------------------------------------------------------
+static void WaveAdd(void)
+{
+    int i, k;
+    int w = Wave.systems;
+
+    for(i = 0; i < Sub.eqns; i++) {
+        int eq = Sub.eqn[i];
+        for(k = IX.eqParamStart[eq]; k < IX.eqParamStart[eq+1]; k++) {
+            int p = IX.eqParam[k];
+            if(!SK->param[p].known) Wave.touched[p] = Wave.now;
+        }
+    }
+
+    int ne = Wave.eqnStart[w], np = Wave.paramStart[w];
+    RESERVE(Wave.eqn, Wave.eqnAlloc, ne + Sub.eqns);
+    RESERVE(Wave.param, Wave.paramAlloc, np + Sub.params);
+    memcpy(&(Wave.eqn[ne]), Sub.eqn, Sub.eqns*sizeof(int));
+    memcpy(&(Wave.param[np]), Sub.param, Sub.params*sizeof(int));
+    Wave.eqnStart[w+1] = ne + Sub.eqns;
+    Wave.paramStart[w+1] = np + Sub.params;
+
+    NewtonPrepare(Sub.eqn, Sub.eqns, Sub.param, Sub.params);
+
+    Wave.systems = w + 1;
+    SubClear();
+}
+
+static void WaveTryAdd(int *eqn, int eqns, int subSys, int *rejects)
+{
+    int i;
+
+    if(!WaveCandidate(eqn, eqns)) {
+        (*rejects)++;
+        return;
+    }
+
+    SubClear();
+    for(i = 0; i < eqns; i++) {
+        SubAddEquation(eqn[i], subSys + Wave.systems);
+    }
+    if(Sub.eqns == Sub.params) {
+        WaveAdd();
+    } else {
+        // Pruning took away unknowns, so it's overdetermined now.
+        SubRelease();
+        (*rejects)++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Sub holds a subsystem that's ready to solve, as subSys. Make that the
+// first of a wave, and then look for more to add: first among the
+// subsystems that we remember from last time, and then among the blocks of
+// the decomposition, if we have one. These come from separate parts of the
+// sketch, or from parts that hang off the same already-solved geometry.
+// Only the first sets of the remembered subsystems might not be used up.
+//-----------------------------------------------------------------------------
+static void GatherWave(int subSys, int sets)
+{
+    int eqn[MAX_NUMERICAL_UNKNOWNS];
+    int i, j, b, eqns;
+    int rejects = 0;
+
+    RESERVE(Wave.touched, Wave.touchedAlloc, SK->params);
+    Wave.now++;
+    Wave.systems = 0;
+    Wave.eqnStart[0] = 0;
+    Wave.paramStart[0] = 0;
+
+    NewtonBegin();
+    WaveAdd();
+
+    for(i = (sets - 1); i >= 0; i--) {
+        if(Wave.systems >= MAX_SUBSYSTEMS_AT_ONCE) return;
+        if(rejects >= MAX_WAVE_REJECTS) return;
+
+        eqns = 0;
+        for(j = 0; j < RSp->set[i].eqs; j++) {
+            int k = EquationIndexById(RSp->set[i].eq[j]);
+            if(k >= 0 && EQ->eqn[k].subSys < 0) {
+                eqn[eqns++] = k;
+            }
+        }
+        if(eqns == 0) continue;
+
+        WaveTryAdd(eqn, eqns, subSys, &rejects);
+    }
+
+    if(!BT.valid) return;
+    for(b = BT.solvedBlocks; b < BT.blocks; b++) {
+        if(Wave.systems >= MAX_SUBSYSTEMS_AT_ONCE) return;
+        if(rejects >= MAX_WAVE_REJECTS) return;
+
+        if(BT.underdetermined[b]) continue;
+        // Big blocks get solved by themselves, when their turn comes.
+        int n = BT.blockStart[b+1] - BT.blockStart[b];
+        if(n > MAX_NUMERICAL_UNKNOWNS) continue;
+
+        // Skip blocks that are solved already, or partly assigned (so stale).
+        eqns = 0;
+        for(i = BT.blockStart[b]; i < BT.blockStart[b+1]; i++) {
+            int k = BT.eqn[BT.member[i]];
+            if(EQ->eqn[k].subSys >= 0) break;
+            eqn[eqns++] = k;
+        }
+        if(eqns < n) continue;
+
+        WaveTryAdd(eqn, eqns, subSys, &rejects);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// What we keep from the last full solve, so that we can solve again quickly
+// while the user drags something around: the subsystems (here, blocks) in
+// the order that we solved them, and which blocks read each parameter. When
+// a point moves, only the blocks downstream of it need to be solved again,
+// starting from where they were; everything else is still right. The
+// equations get copied out of the arena, since they have to outlive the
+// solve that wrote them.
+//-----------------------------------------------------------------------------
+#define DRAG_CHUNK              1024
+typedef struct DragChunkTag DragChunk;
+struct DragChunkTag {
+    DragChunk       *next;
+    Expr             e[DRAG_CHUNK];
+};
+struct DragPlanTag {
+    BOOL    valid;
+    int     params;
+
+    // Block b is equations eqn[eqnStart[b]] through eqn[eqnStart[b+1]-1]
+    // in the unknowns param[paramStart[b]] through param[paramStart[b+1]-1],
+    // as indices into EQ->eqn[] and SK->param[]. Blocks that were solved
+    // together are independent, and just come one after the other.
+    int     blocks;
+    int     *eqnStart;
+    int     *eqn;
+    int     *paramStart;
+    int     *param;
+
+    // For each parameter: the block that solved it, or -1 if it was known
+    // before we started on the blocks; its value when the blocks that read
+    // it were last solved; and if it's a coordinate of a point whose other
+    // coordinate was assumed, then that other coordinate, else -1.
+    int     *solvedBy;
+    double  *v;
+    int     *twin;
+
+    // The blocks that read parameter i, besides the one that solved it, are
+    // user[userStart[i]] through user[userStart[i+1]-1].
+    int     *userStart;
+    int     *user;
+
+    // The blocks still to be solved again, as a heap on the block index so
+    // that they come out in the original order.
+    int     *heap;
+    int     heapSize;
+    BOOL    *queued;
+
+    // The parameters as they were when we started, in case we fail.
+    double  *start;
+
+    // The value of each constraint when the blocks that read it were last
+    // solved, so that we can tell when a dimension has changed.
+    int     constraints;
+    double  *cv;
+
+    // How to evaluate each parameter that we substituted, or NULL.
+    Expr    **subst;
+
+    DragChunk   *chunk;
+    int         inChunk;
+
+    int     eqnStartAlloc;
+    int     eqnAlloc;
+    int     paramStartAlloc;
+    int     paramAlloc;
+    int     solvedByAlloc;
+    int     vAlloc;
+    int     twinAlloc;
+    int     userStartAlloc;
+    int     userAlloc;
+    int     heapAlloc;
+    int     queuedAlloc;
+    int     startAlloc;
+    int     cvAlloc;
+    int     substAlloc;
+};
+#define Drag                    (*(SC->solve->drag))
+
+static Expr *AllocDragExpr(void)
+{
+    if(!Drag.chunk || Drag.inChunk >= DRAG_CHUNK) {
+        DragChunk *c = (DragChunk *)DAlloc(sizeof(DragChunk));
+        if(!c) oops();
+        c->next = Drag.chunk;
+        Drag.chunk = c;
+        Drag.inChunk = 0;
+    }
+    Expr *e = &(Drag.chunk->e[Drag.inChunk]);
+    memset(e, 0, sizeof(*e));
+    (Drag.inChunk)++;
+
+    return e;
+}
+
+//-----------------------------------------------------------------------------
+// Forget the blocks, so that the next solve has to start from scratch. We
+// must do that whenever anything but the parameters might have changed.
+//-----------------------------------------------------------------------------
+void ForgetDragPlan(void)
+{
+    while(Drag.chunk) {
+        DragChunk *next = Drag.chunk->next;
+        DFree(Drag.chunk);
+        Drag.chunk = next;
+    }
+    Drag.inChunk = 0;
+    Drag.blocks = 0;
+    Drag.valid = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// Append the wave that we just solved to the blocks. If the solve fails
+// later then these are garbage, but the plan doesn't become valid until
+// DragRecord() so that's okay.
+//-----------------------------------------------------------------------------
+static void DragAppendWave(void)
+{
+    int j;
+    int ne = Drag.blocks ? Drag.eqnStart[Drag.blocks] : 0;
+    int np = Drag.blocks ? Drag.paramStart[Drag.blocks] : 0;
+
+    RESERVE(Drag.eqnStart, Drag.eqnStartAlloc, Drag.blocks + Wave.systems + 1);
+    RESERVE(Drag.paramStart, Drag.paramStartAlloc,
+                                            Drag.blocks + Wave.systems + 1);
+    RESERVE(Drag.eqn, Drag.eqnAlloc, ne + Wave.eqnStart[Wave.systems]);
+    RESERVE(Drag.param, Drag.paramAlloc, np + Wave.paramStart[Wave.systems]);
+
+    memcpy(&(Drag.eqn[ne]), Wave.eqn,
+                                Wave.eqnStart[Wave.systems]*sizeof(int));
+    memcpy(&(Drag.param[np]), Wave.param,
+                                Wave.paramStart[Wave.systems]*sizeof(int));
+    for(j = 0; j <= Wave.systems; j++) {
+        Drag.eqnStart[Drag.blocks + j] = ne + Wave.eqnStart[j];
+        Drag.paramStart[Drag.blocks + j] = np + Wave.paramStart[j];
+    }
+    Drag.blocks += Wave.systems;
+}
+
+//-----------------------------------------------------------------------------
+// Append a block of one equation in one unknown, that we solved without
+// bothering Newton's method.
+//-----------------------------------------------------------------------------
+static void DragAppendBlock(int eq, int p)
+{
+    int ne = Drag.blocks ? Drag.eqnStart[Drag.blocks] : 0;
+    int np = Drag.blocks ? Drag.paramStart[Drag.blocks] : 0;
+
+    RESERVE(Drag.eqnStart, Drag.eqnStartAlloc, Drag.blocks + 2);
+    RESERVE(Drag.paramStart, Drag.paramStartAlloc, Drag.blocks + 2);
+    RESERVE(Drag.eqn, Drag.eqnAlloc, ne + 1);
+    RESERVE(Drag.param, Drag.paramAlloc, np + 1);
+
+    Drag.eqn[ne] = eq;
+    Drag.param[np] = p;
+    Drag.eqnStart[Drag.blocks] = ne;
+    Drag.paramStart[Drag.blocks] = np;
+    Drag.eqnStart[Drag.blocks + 1] = ne + 1;
+    Drag.paramStart[Drag.blocks + 1] = np + 1;
+    (Drag.blocks)++;
+}
+
+//-----------------------------------------------------------------------------
+// After the forward substitution, solve every equation that's linear in a
+// single unknown: things like a dimension on a point that's otherwise
+// known, or a horizontal line from a known point. That's a division, so
+// there's no need to make the assumption code or Newton's method look at
+// it. Solving one such equation can leave another linear in one unknown
+// (the other end of a chain of horizontals and verticals, say), so we
+// keep going through the equations that mention what we just solved.
+//-----------------------------------------------------------------------------
+#define SUBSYS_SOLVED_BY_PRESOLVE           65534
+#define Presolve                (SC->solve->presolve)
+#define PresolveAlloc           (SC->solve->presolveAlloc)
+#define PresolveQueued          (SC->solve->presolveQueued)
+#define PresolveQueuedAlloc     (SC->solve->presolveQueuedAlloc)
+static void SolveLinearInOneUnknown(void)
+{
+    int i, k;
+    int n = 0, presolved = 0;
+
+    RESERVE(Presolve, PresolveAlloc, EQ->eqns);
+    RESERVE(PresolveQueued, PresolveQueuedAlloc, EQ->eqns);
+    for(i = EQ->eqns - 1; i >= 0; i--) {
+        PresolveQueued[i] = (EQ->eqn[i].subSys < 0);
+        if(PresolveQueued[i]) Presolve[n++] = i;
+    }
+
+    while(n > 0) {
+        int eq = Presolve[--n];
+        PresolveQueued[eq] = FALSE;
+        if(EQ->eqn[eq].subSys >= 0) continue;
+
+        int p;
+        double a, b;
+        if(!ELinearInOne(EQ->eqn[eq].e, &p, &a, &b)) continue;
+        // Newton's method would call this singular too, so leave it to that
+        // and the assumption code to complain about.
+        if(fabs(a) < 1e-10) continue;
+
+        SK->param[p].v = -b/a;
+        SK->param[p].known = TRUE;
+        EQ->eqn[eq].subSys = SUBSYS_SOLVED_BY_PRESOLVE;
+        // A block like any other, as far as dragging is concerned.
+        DragAppendBlock(eq, p);
+        presolved++;
+
+        for(k = IX.paramEqStart[p]; k < IX.paramEqStart[p+1]; k++) {
+            int other = IX.paramEq[k];
+            if(EQ->eqn[other].subSys >= 0 || PresolveQueued[other]) continue;
+            PresolveQueued[other] = TRUE;
+            Presolve[n++] = other;
+        }
+    }
+    dbp2("presolved %d equations linear in one unknown", presolved);
+}
+
+//-----------------------------------------------------------------------------
+// The full solve succeeded, with the blocks that we appended as we went; so
+// work out who reads what, and keep the equations. This must be called
+// while the incidence and the equations are still those of that solve.
+//-----------------------------------------------------------------------------
+static void DragRecord(void)
+{
+    int i, j, k, b;
+
+    RESERVE(Drag.solvedBy, Drag.solvedByAlloc, SK->params);
+    RESERVE(Drag.v, Drag.vAlloc, SK->params);
+    RESERVE(Drag.twin, Drag.twinAlloc, SK->params);
+    RESERVE(Drag.userStart, Drag.userStartAlloc, SK->params + 1);
+    RESERVE(Drag.start, Drag.startAlloc, SK->params);
+    RESERVE(Drag.cv, Drag.cvAlloc, SK->constraints);
+    RESERVE(Drag.heap, Drag.heapAlloc, Drag.blocks);
+    RESERVE(Drag.queued, Drag.queuedAlloc, Drag.blocks);
+    RESERVE(Drag.eqnStart, Drag.eqnStartAlloc, Drag.blocks + 1);
+    RESERVE(Drag.paramStart, Drag.paramStartAlloc, Drag.blocks + 1);
+    if(Drag.blocks == 0) {
+        Drag.eqnStart[0] = 0;
+        Drag.paramStart[0] = 0;
+    }
+
+    GetParamValues(Drag.v);
+    for(i = 0; i < SK->constraints; i++) {
+        Drag.cv[i] = SK->constraint[i].v;
+    }
+    for(i = 0; i < SK->params; i++) {
+        Drag.solvedBy[i] = -1;
+        Drag.twin[i] = -1;
+    }
+    for(b = 0; b < Drag.blocks; b++) {
+        Drag.queued[b] = FALSE;
+        for(j = Drag.paramStart[b]; j < Drag.paramStart[b+1]; j++) {
+            Drag.solvedBy[Drag.param[j]] = b;
+        }
+    }
+    Drag.heapSize = 0;
+
+    // The assumption code decides which coordinate of a point to assume by
+    // the sensitivities, so that choice might not last as the point moves.
+    for(i = 0; i < SK->points; i++) {
+        int x = ParamSlot(X_COORD_FOR_PT(SK->point[i]));
+        int y = ParamSlot(Y_COORD_FOR_PT(SK->point[i]));
+        if(x < 0 || y < 0) continue;
+
+        if(SK->param[x].assumed != NOT_ASSUMED && Drag.solvedBy[y] >= 0) {
+            Drag.twin[y] = x;
+        }
+        if(SK->param[y].assumed != NOT_ASSUMED && Drag.solvedBy[x] >= 0) {
+            Drag.twin[x] = y;
+        }
+    }
+
+    // The readers of each parameter; count them, and then fill them in.
+    for(i = 0; i <= SK->params; i++) {
+        Drag.userStart[i] = 0;
+    }
+    for(k = 0; k < 2; k++) {
+        for(b = 0; b < Drag.blocks; b++) {
+            ParamStampNow++;
+            for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+                int eq = Drag.eqn[i];
+                for(j = IX.eqParamStart[eq]; j < IX.eqParamStart[eq+1]; j++) {
+                    int p = IX.eqParam[j];
+                    if(Drag.solvedBy[p] == b) continue;
+                    if(ParamStamp[p] == ParamStampNow) continue;
+                    ParamStamp[p] = ParamStampNow;
+
+                    if(k == 0) {
+                        (Drag.userStart[p + 1])++;
+                    } else {
+                        Drag.user[(IncidenceCursor[p])++] = b;
+                    }
+                }
+            }
+        }
+        if(k == 0) {
+            for(i = 0; i < SK->params; i++) {
+                Drag.userStart[i+1] += Drag.userStart[i];
+            }
+            RESERVE(Drag.user, Drag.userAlloc, Drag.userStart[SK->params]);
+            memcpy(IncidenceCursor, Drag.userStart, SK->params*sizeof(int));
+        }
+    }
+
+    // And the equations themselves, which are otherwise freed when the
+    // solve finishes; and likewise the substitutes.
+    for(i = 0; i < Drag.eqnStart[Drag.blocks]; i++) {
+        int eq = Drag.eqn[i];
+        EQ->eqn[eq].e = ECopy(EQ->eqn[eq].e, AllocDragExpr);
+    }
+    RESERVE(Drag.subst, Drag.substAlloc, SK->params);
+    for(i = 0; i < SK->params; i++) {
+        Drag.subst[i] = NULL;
+        if(SK->param[i].substd) {
+            Drag.subst[i] = ECopy(Substitute[i], AllocDragExpr);
+        }
+    }
+
+    Drag.params = SK->params;
+    Drag.constraints = SK->constraints;
+    Drag.valid = TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// TRUE if every equation of remembered subsystem i is solved already (or
+// gone), so that there's nothing left to try there.
+//-----------------------------------------------------------------------------
+static BOOL RememberedUsedUp(int i)
+{
+    int j;
+    for(j = 0; j < RSp->set[i].eqs; j++) {
+        int k = EquationIndexById(RSp->set[i].eq[j]);
+        if(k >= 0 && EQ->eqn[k].subSys < 0) return FALSE;
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Try to pick off a subsytem of equations that is possibly consistent (i.e.,
+// n equations in n unknowns), and solve it, along with whatever else is
+// ready to solve at the same time. Then do that again, until we have no
+// unknowns left, and return TRUE. Any assumptions that we need have been
+// made already, so if we can't find such a subsystem, or the one we find
+// doesn't converge, then we return FALSE.
+//
+// The major observation to make is that this function returns FALSE only
+// when a subsystem it tried to solve is inconsistent. This might be
+// because the given set of constraints really is inconsistent, or it
+// might be because we made a lousy assumption while solving an
+// underconstrained system.
+//
+// A big sketch might take thousands of batches, so we loop instead of
+// recursing on what's left, and hold the subsystems that we've solved in
+// Solved[] until we know that we've solved them all.
+//-----------------------------------------------------------------------------
+#define Solved                  (SC->solve->solved)
+#define SolvedAlloc             (SC->solve->solvedAlloc)
+#define SolvedStart             (SC->solve->solvedStart)
+#define SolvedStartAlloc        (SC->solve->solvedStartAlloc)
+BOOL SolveSubSystemsStartingFrom(int subSys)
+{   
+    int i, j, k, n;
+    int systems;
+
+    // Subsystem s of those that we've solved is equations
+    // Solved[SolvedStart[s]] through Solved[SolvedStart[s+1]-1].
+    int solvedSystems = 0;
+    RESERVE(SolvedStart, SolvedStartAlloc, 1);
+    SolvedStart[0] = 0;
+
+    // The remembered subsystems from this one on are used up, since all
+    // their equations are solved.
+    int remembered = RSp->sets;
+
+    for(;;) {
+        // The pruned equations that we write while searching for a subsystem
+        // are garbage once we've found one, so free them then.
+        ExprArenaMark subSysMark = EArenaMark();
+
+        // If we're taking way too long then give up; likewise if nobody wants
+        // the answer any more.
+        int now = GetTickCount();
+        if(now - SolutionStartTime > MAX_SOLUTION_TIME || SC->cancel) {
+            return FALSE;
+        }
+        // If we're taking a little bit too long then show an hourglass.
+        if(now - SolutionStartTime > MAX_SOLUTION_TIME_BEFORE_HOURGLASS &&
+            SC->ui && !CursorIsHourglass)
+        {
+            uiSetCursorToHourglass();
+            CursorIsHourglass = TRUE;
+        }
+
+        // First, let's see how many equations we have, and how many unknowns.
+        int unknowns = Left.unknowns;
+        int eqs = Left.eqns;
+        dbp2("unknowns: %d", unknowns);
+        dbp2("equations to be solved: %d", eqs);
+
+        // More equations than unknowns is an overdetermined system, certainly
+        // inconsistent or redundant.
+        if(eqs > unknowns) return FALSE;
+
+        // Zero unknowns (and zero equations, since the prevous check passed)
+        // is an empty system, which means that we solved successfully.
+        if(unknowns == 0) break;
+
+        // Before we decompose the system, let's see if we can
+        // reuse a partition from last time.
+        while(remembered > 0 && RememberedUsedUp(remembered - 1)) {
+            remembered--;
+        }
+        for(i = (remembered - 1); i >= 0; i--) {
+            // They have a subsystem of equations that perhaps we should
+            // try. Start from an empty subset, and add each equation of our
+            // remembered subset.
+            SubClear();
+            for(j = 0; j < RSp->set[i].eqs; j++) {
+                int k = EquationIndexById(RSp->set[i].eq[j]);
+                // Don't try to grab the equation if it's already used.
+                if(k >= 0 && EQ->eqn[k].subSys < 0) {
+                    SubAddEquation(k, subSys);
+                }
+            }
+            if(Sub.eqns == Sub.params && Sub.eqns > 0) {
+                // This subsystem is ready to solve.
+                goto got_exact;
+            }
+            // This subystem is not soluble, so those equations are free
+            // to be partitioned later.
+            SubRelease();
+            // Subsystems are less dangerous than assumptions (i.e., the
+            // search paths they start terminate quicker) so we can keep
+            // it around to try later, even if it doesn't work now.
+        }
+
+        // Otherwise take the next block of the structural decomposition.
+        switch(PartitionNextBlock(subSys)) {
+            case BLOCK_NONE:
+                // Nothing square to solve by itself.
+                break;
+
+            case BLOCK_OVER:
+                // Some equation has no unknown left to determine it, bad.
+                goto system_inconsistent;
+
+            case BLOCK_FOUND:
+                // What we're looking for.
+                goto got_exact;
+        }
+        // We give up; can't find a block to partition off and solve.
+        // Instead let's just solve the whole mess at once. The assumer was
+        // responsible for making the system exactly constrained, so we should
+        // be fine; if it's big, then Newton's method goes sparse.
+        SubClear();
+        for(i = 0; i < EQ->eqns; i++) {
+            if(EQ->eqn[i].subSys < 0) {
+                SubAddEquation(i, subSys);
+            }
+        }
+        // Shouldn't happen
+        if(Sub.eqns != Sub.params) goto system_inconsistent;
+
+        // And now we solve, the same as if we had picked these off
+        // deliberately. This subsystem will get remembered, which might be
+        // good or bad; on the one hand that will save us from exhausting the
+        // search next time, but on the other, it will stop us from
+        // discovering a better partition if a change to the system permits
+        // that. Such a change seems unlikely, at least without breaking the
+        // remembered subsystem, so I'll leave it like this.
+
+got_exact:
+        EArenaRelease(subSysMark);
+
+        // We picked off a possibly-consistent subsystem, which we can now
+        // solve numerically. Anything else that's ready to solve, and doesn't
+        // depend on it, can be solved at the same time.
+        GatherWave(subSys, remembered);
+        systems = Wave.systems;
+        dbp2("solving %d subsystems at once", systems);
+
+        if(!NewtonSolvePrepared()) {
+            // What does this mean? It means that our subsystem might have been
+            // consistent (n equations in n unknowns), but either it wasn't
+            // (some eqns linearly dependent, linearized about current guess).
+            // So give up, because this branch is now hopeless.
+            goto system_inconsistent;
+        }
+        // The pruned equations and the tapes are garbage now.
+        EArenaRelease(subSysMark);
+        // If this all works out then we'll want these again while dragging.
+        DragAppendWave();
+
+        // Our solution succeed; so mark the parameters that we were solving
+        // for as known. We must remember which parameters we marked as known;
+        // if the system turns out to be inconsistent, then we must replace
+        // them as unknown so that other solutions can be investigated.
+        for(i = 0; i < Wave.paramStart[systems]; i++) {
+            // This is one of the unknowns that we just solved for.
+            SK->param[Wave.param[i]].known = TRUE;
+        }
+        Left.unknowns -= Wave.paramStart[systems];
+        Left.eqns -= Wave.eqnStart[systems];
+
+        // Keep our equations, until we know whether everything works out.
+        n = SolvedStart[solvedSystems];
+        RESERVE(Solved, SolvedAlloc, n + Wave.eqnStart[systems]);
+        RESERVE(SolvedStart, SolvedStartAlloc, solvedSystems + systems + 1);
+        for(j = 0; j < systems; j++) {
+            for(i = Wave.eqnStart[j]; i < Wave.eqnStart[j+1]; i++) {
+                Solved[n++] = EQ->eqn[Wave.eqn[i]].he;
+            }
+            SolvedStart[++solvedSystems] = n;
+        }
+
+        // And let's try to solve the next subsystem.
+        subSys += systems;
+        continue;
+
+system_inconsistent:
+        // Either this subsystem was inconsistent itself, or we earlier
+        // made an assumption that leaves it no consistent solution. It
+        // might not be hopeless, though; our caller might have a different
+        // assumption that works better.
+        dbp2("so inconsistent");
+
+        EArenaRelease(subSysMark);
+        return FALSE;
+    }
+
+    // Everything worked; we've solved the full system. Let's make a note of
+    // the subsystems we chose to use.
+    //
+    // Note that this list gets built in reverse order, so that the last
+    // subsystem that we solved gets tried first next time.
+    for(j = solvedSystems - 1; j >= 0; j--) {
+        // Too big to save, but the decomposition will find it again.
+        if(SolvedStart[j+1] - SolvedStart[j] > MAX_NUMERICAL_UNKNOWNS) {
+            continue;
+        }
+        k = RSt->sets;
+        RESERVE(RSt->set, RSt->setsAlloc, k + 1);
+        RSt->set[k].p = 0;
+        RSt->set[k].eqs = 0;
+        for(i = SolvedStart[j]; i < SolvedStart[j+1]; i++) {
+            RSt->set[k].eq[(RSt->set[k].eqs)++] = Solved[i];
+        }
+        RSt->sets = (k + 1);
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Change the parameters of the sketch in such a way as to make them satisfy
+// the provided constraints. Returns FALSE if we couldn't, in which case the
+// parameters are as they were.
+//-----------------------------------------------------------------------------
+BOOL Solve(void)
+{
+    int i;
+
+    // Everything that we allocate while solving gets freed when we're done.
+    ExprArenaMark solveMark = EArenaMark();
+
+    CursorIsHourglass = FALSE;
+    SolutionStartTime = GetTickCount();
+    NewtonForgetStats();
+   
+    if(SK->eqnsDirty) {
+        if(SC->ui) {
+            uiClearAssumptionsList();
+            uiClearConstraintsList();
+        } else if(SC->report) {
+            SC->report->newLists = TRUE;
+        }
+    }
+    // If the equations have changed, then anything that we remember about
+    // their derivatives is probably useless now.
+    ForgetPartials(SK->eqnsDirty);
+    // And we're about to write new equations, so the ones that we kept for
+    // dragging go too.
+    ForgetDragPlan();
+
+    GenerateEquationsToSolve();
+
+    // Our goal is to find the smallest solvable subsystem, and solve
+    // it. This means that some previously unknown parameters have become
+    // known; with luck, that has created another solvable subsystem,
+    // and we can keep going.
+    // 
+    // The process will go quicker if we solve in smallest chunks possible,
+    // and a practical sketch will tend to break down this way quite
+    // readily.  Each subsystem will be solved by a Newton's method.
+
+    // Mark all parameters except the references (x-axis, y-axis, origin)
+    // as unknown to start.
+    MarkUnknowns();
+
+    // It's stupid to solve for an equation of the form p1 - p2 = 0 using
+    // the Newton's method, and such equations arise routinely, from
+    // things like coincidence constraints. Solve those by forward-
+    // substitution now.
+    SolveByForwardSubstitution();
+
+    // And likewise for anything that's now linear in a single unknown, like
+    // the equations that fix a point where it was dimensioned.
+    SolveLinearInOneUnknown();
+
+    // This is where we decide if any assumptions are needed, and make them
+    // if yes. If the system is provably inconsistent, then we give up now.
+    int assumedParameters = 0;
+    if(!Assume(&assumedParameters)) {
+        SetStatus(" Inconsistent constraints.", BK_VIOLET);
+        goto failed;
+    }
+
+    // Now let's count the unknowns, just to be sure.
+    int unknowns;
+    unknowns = 0;
+    for(i = 0; i < SK->params; i++) {
+        if(!SK->param[i].known) {
+            unknowns++;
+        }
+    }
+    // If everything's known at this point, then we're done.
+    if(unknowns == 0) goto trivial;
+
+    // From here on we keep count as we go, and start with no subsystem
+    // under construction (so no marks).
+    Left.unknowns = unknowns;
+    Left.eqns = 0;
+    for(i = 0; i < EQ->eqns; i++) {
+        if(EQ->eqn[i].subSys < 0) {
+            (Left.eqns)++;
+        }
+    }
+    SubClear();
+    RESERVE(Sub.eqn, Sub.eqnAlloc, EQ->eqns);
+    RESERVE(Sub.param, Sub.paramAlloc, SK->params);
+    RESERVE(Sub.marked, Sub.markedAlloc, (SK->params + 31)/32);
+    for(i = 0; i < SK->params; i++) {
+        SK->param[i].mark = 0;
+    }
+
+    
+    // If possible, instead of decomposing the system from scratch, we
+    // will use the previous partition. In order to do
     // this, we must keep a record of the partition that we use as we
     // solve, so let's do that.
     RSt->sets = 0;
@@ -710,6 +1876,8 @@ void Solve(void)
     for(i = 0; i < RSp->sets; i++) {
         RSp->set[i].use = TRUE;
     }
+    // The structural decomposition gets computed when it's first needed.
+    BT.valid = FALSE;
 
     // Now start trying to make subsystems and solve them. This routine is
     // also responsible for identifying underconstrained situations, and
@@ -719,15 +1887,15 @@ void Solve(void)
     } else {
         // Not so good; we weren't able to pick off a set of subsystems
         // that all converged numerically.
-        uiSetConsistencyStatusText(" Can't solve; no convergence.", BK_VIOLET);
+        SetStatus(" Can't solve; no convergence.", BK_VIOLET);
         goto failed;
     }
 
 trivial:
     if(assumedParameters > 0) {
-        uiSetConsistencyStatusText(" Under-constrained system.", BK_YELLOW);
+        SetStatus(" Under-constrained system.", BK_YELLOW);
     } else {
-        uiSetConsistencyStatusText(" Exactly constrained system.", BK_GREEN);
+        SetStatus(" Exactly constrained system.", BK_GREEN);
     }
 
     // Those unknowns that were solved by forward substitution can be
@@ -736,7 +1904,7 @@ trivial:
         if(SK->param[i].substd) {
             dbp2("asign: src=%08x, dest=%08x", SK->param[i].substd,
                 SK->param[i].id);
-            SK->param[i].v = EvalParam(SK->param[i].substd);
+            SK->param[i].v = EEval(Substitute[i]);
         }
     }
 
@@ -746,43 +1914,746 @@ trivial:
         dbp2("   subsystem %d in %d equations", i, RSt->set[i].eqs);
     }
 
+    // Keep what we need to solve again quickly while dragging.
+    DragRecord();
+
     // We succeeded, so whatever partition we chose is worth remembering.
     RememberedSubsystems *rstemp;
     rstemp = RSp;
     RSp = RSt;
     RSt = rstemp;
 
-    FreeAll();
+    int bytes, nodes, peakBytes;
+    EArenaStats(&bytes, &nodes, &peakBytes);
+    dbp2("exprs: %d nodes in %d bytes (peak %d bytes)", nodes, bytes,
+        peakBytes);
+    dbp2("newton: %d subsystems in %d iterations, %d Jacobians, %d failed",
+        SC->stats.blocks, SC->stats.iterations, SC->stats.jacobians,
+        SC->stats.failed);
+
+    EArenaRelease(solveMark);
     SK->eqnsDirty = FALSE;
 
     if(CursorIsHourglass) uiRestoreCursor();
     int out;
     out = GetTickCount();
-    dbp2("time=%d", out - SolutionStartTime);
+    SC->stats.time = out - SolutionStartTime;
+    dbp2("time=%d", SC->stats.time);
 
     SaveGoodParams();
 
-    return;
+    return TRUE;
 
 failed:
     // It didn't work, probably due to a numerical problem. In that case
     // we should restore the previous parameter values, since the current
     // ones are probably screwed up.
     RestoreParamsToRemembered();
-    if(SolvingState == SOLVING_AUTOMATICALLY) {
+    if(!SC->ui || SolvingState == SOLVING_AUTOMATICALLY) {
         RestoreParamsToLastGood();
     }
 
-    FreeAll();
+    dbp2("newton: %d subsystems in %d iterations, %d Jacobians, %d failed",
+        SC->stats.blocks, SC->stats.iterations, SC->stats.jacobians,
+        SC->stats.failed);
+
+    EArenaRelease(solveMark);
     SK->eqnsDirty = FALSE;
 
     out = GetTickCount();
+    SC->stats.time = out - SolutionStartTime;
     if(out - SolutionStartTime > 200) {
         // If we just spent a noticeable time solving to an inconsistent
         // system, then we probably don't want to keep doing this
         // interactively.
-        StopSolving();
+        ReportStopSolving();
     }
 
     if(CursorIsHourglass) uiRestoreCursor();
+    return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// The heap of blocks waiting to be solved again. A block that's already
+// waiting doesn't get added twice.
+//-----------------------------------------------------------------------------
+static void DragQueue(int b)
+{
+    if(Drag.queued[b]) return;
+    Drag.queued[b] = TRUE;
+
+    int i = (Drag.heapSize)++;
+    while(i > 0 && Drag.heap[(i - 1)/2] > b) {
+        Drag.heap[i] = Drag.heap[(i - 1)/2];
+        i = (i - 1)/2;
+    }
+    Drag.heap[i] = b;
+}
+static int DragDequeue(void)
+{
+    int b = Drag.heap[0];
+    Drag.queued[b] = FALSE;
+
+    int last = Drag.heap[--(Drag.heapSize)];
+    int i = 0;
+    for(;;) {
+        int c = 2*i + 1;
+        if(c >= Drag.heapSize) break;
+        if(c + 1 < Drag.heapSize && Drag.heap[c+1] < Drag.heap[c]) c++;
+        if(last <= Drag.heap[c]) break;
+        Drag.heap[i] = Drag.heap[c];
+        i = c;
+    }
+    if(Drag.heapSize > 0) Drag.heap[i] = last;
+    return b;
+}
+static void DragQueueUsers(int p)
+{
+    int k;
+    for(k = Drag.userStart[p]; k < Drag.userStart[p+1]; k++) {
+        DragQueue(Drag.user[k]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// A dimension changed, so the blocks with equations from its constraint
+// have to be solved again. Returns FALSE if there aren't any, because then
+// the equation was redundant with the ones that we solved, and now it's
+// probably inconsistent with them; only the full solve can say. Likewise if
+// one of its equations was used up by substitution, since then the
+// dimension is in the substitute, which is in whatever equations read that.
+//-----------------------------------------------------------------------------
+static BOOL DragQueueDimension(hConstraint hc)
+{
+    int b, i;
+    BOOL found = FALSE;
+    for(i = 0; i < EQ->eqns; i++) {
+        if(EQ->eqn[i].subSys == SUBSYS_SOLVED_BY_SUBSTITUTION &&
+            CONSTRAINT_FOR_EQUATION(EQ->eqn[i].he) == hc)
+        {
+            return FALSE;
+        }
+    }
+    for(b = 0; b < Drag.blocks; b++) {
+        for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+            if(CONSTRAINT_FOR_EQUATION(EQ->eqn[Drag.eqn[i]].he) == hc) {
+                DragQueue(b);
+                found = TRUE;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+//-----------------------------------------------------------------------------
+// Does block b read anything with the current ParamStamp? That's how we
+// mark the unknowns of the blocks that are in the wave so far.
+//-----------------------------------------------------------------------------
+static BOOL DragBlockReadsStamped(int b)
+{
+    int i, k;
+    for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+        int eq = Drag.eqn[i];
+        for(k = IX.eqParamStart[eq]; k < IX.eqParamStart[eq+1]; k++) {
+            if(ParamStamp[IX.eqParam[k]] == ParamStampNow) return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// The unknowns of a block are counted after pruning against the known
+// parameters, so they depend on the values; the equation p1*p2 + p3 = 4
+// doesn't determine p2 when p1 = 0. So check that block b still has the
+// same unknowns, counting everything that was solved in it or after it as
+// unknown, the way the full solve would have seen it.
+//-----------------------------------------------------------------------------
+static BOOL DragBlockStillSquare(int b)
+{
+    int i, k;
+
+    for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+        int eq = Drag.eqn[i];
+        for(k = IX.eqParamStart[eq]; k < IX.eqParamStart[eq+1]; k++) {
+            int p = IX.eqParam[k];
+            if(Drag.solvedBy[p] >= b) SK->param[p].known = FALSE;
+        }
+    }
+
+    SubClear();
+    for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+        int eq = Drag.eqn[i];
+        SubAddEquation(eq, EQ->eqn[eq].subSys);
+    }
+    BOOL square = (Sub.params == Drag.paramStart[b+1] - Drag.paramStart[b]);
+    for(i = 0; i < Sub.params; i++) {
+        if(Drag.solvedBy[Sub.param[i]] != b) square = FALSE;
+    }
+    SubClear();
+
+    for(i = Drag.eqnStart[b]; i < Drag.eqnStart[b+1]; i++) {
+        int eq = Drag.eqn[i];
+        for(k = IX.eqParamStart[eq]; k < IX.eqParamStart[eq+1]; k++) {
+            SK->param[IX.eqParam[k]].known = TRUE;
+        }
+    }
+    return square;
+}
+
+//-----------------------------------------------------------------------------
+// Would the assumption code still assume the same coordinate of each point
+// that block b solves? That's decided by comparing the sum of the squared
+// partials of all the equations with respect to each coordinate, with the
+// same hysteresis as in MostSensitiveCoordinateFirst().
+//-----------------------------------------------------------------------------
+static double DragSensitivityTo(int p)
+{
+    int k;
+    double v = 0;
+    for(k = IX.paramEqStart[p]; k < IX.paramEqStart[p+1]; k++) {
+        int eq = IX.paramEq[k];
+        if(EQ->eqn[eq].subSys == SUBSYS_SOLVED_BY_SUBSTITUTION) continue;
+
+        double d = EEval(PartialForEquation(eq, SK->param[p].id));
+        v += d*d;
+    }
+    return v;
+}
+static BOOL DragAssumptionsStillGood(int b)
+{
+    int j;
+    for(j = Drag.paramStart[b]; j < Drag.paramStart[b+1]; j++) {
+        int s = Drag.param[j];
+        int a = Drag.twin[s];
+        if(a < 0) continue;
+
+        if(DragSensitivityTo(a) > 1.4*DragSensitivityTo(s)) return FALSE;
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Solve the sketch again after the user has moved some of the parameters,
+// or changed some dimensions, and nothing else. Rather than starting from
+// scratch, we re-use the blocks from the last full solve, and solve only
+// those downstream of whatever moved, starting from their last solution.
+// Returns FALSE if we couldn't, in which case the parameters are as they
+// were and the caller should do a full Solve().
+//-----------------------------------------------------------------------------
+BOOL SolveDragged(void)
+{
+    int i, j, b;
+    int wave[MAX_SUBSYSTEMS_AT_ONCE];
+    int waves = 0, solved = 0;
+
+    if(!Drag.valid || SK->eqnsDirty || SK->params != Drag.params ||
+        SK->constraints != Drag.constraints)
+    {
+        return FALSE;
+    }
+
+    ExprArenaMark solveMark = EArenaMark();
+    int dragStartTime = GetTickCount();
+    NewtonForgetStats();
+
+    // Find what moved. If it's an assumption, then everything that reads
+    // it has to be solved again. If it was solved for, then whether it
+    // stays where the user put it depends on which parameters we assume,
+    // and that's decided numerically across the whole sketch, so we can't
+    // help. Substituted parameters just get written when we're done.
+    GetParamValues(Drag.start);
+    for(i = 0; i < SK->params; i++) {
+        SketchParam *p = &(SK->param[i]);
+        p->known = TRUE;
+
+        if(p->v == Drag.v[i] || p->substd) continue;
+
+        if(Drag.solvedBy[i] >= 0) {
+            dbp2("drag: moved %08x, which was solved for", p->id);
+            goto failed;
+        }
+        DragQueueUsers(i);
+        Drag.v[i] = p->v;
+    }
+    // The equations read the dimensions as they're evaluated, so those can
+    // change too; except that a zero distance gets written as two
+    // equations for coincidence, so that's a different system.
+    for(i = 0; i < SK->constraints; i++) {
+        SketchConstraint *c = &(SK->constraint[i]);
+        if(c->v == Drag.cv[i]) continue;
+
+        if(told(c->v, 0) != told(Drag.cv[i], 0) || !DragQueueDimension(c->id))
+        {
+            dbp2("drag: dimension %08x changes the system", c->id);
+            goto failed;
+        }
+        Drag.cv[i] = c->v;
+    }
+
+    while(Drag.heapSize > 0) {
+        ExprArenaMark waveMark = EArenaMark();
+
+        // As many as we can solve together; we stop at the first block that
+        // reads one of this wave's unknowns, since that needs their new
+        // values.
+        int n = 0;
+        ParamStampNow++;
+        NewtonBegin();
+        while(Drag.heapSize > 0 && n < MAX_SUBSYSTEMS_AT_ONCE) {
+            b = Drag.heap[0];
+            if(n > 0 && DragBlockReadsStamped(b)) break;
+            DragDequeue();
+
+            if(!DragBlockStillSquare(b) || !DragAssumptionsStillGood(b)) {
+                dbp2("drag: block %d changed, start from scratch", b);
+                goto failed;
+            }
+
+            for(j = Drag.paramStart[b]; j < Drag.paramStart[b+1]; j++) {
+                int p = Drag.param[j];
+                SK->param[p].known = FALSE;
+                ParamStamp[p] = ParamStampNow;
+            }
+            NewtonPrepare(&(Drag.eqn[Drag.eqnStart[b]]),
+                Drag.eqnStart[b+1] - Drag.eqnStart[b],
+                &(Drag.param[Drag.paramStart[b]]),
+                Drag.paramStart[b+1] - Drag.paramStart[b]);
+            wave[n++] = b;
+        }
+
+        if(!NewtonSolvePrepared()) {
+            dbp2("drag: no convergence, start from scratch");
+            goto failed;
+        }
+        EArenaRelease(waveMark);
+        waves++;
+        solved += n;
+
+        // Anything that reads a value that changed has to be solved again.
+        for(i = 0; i < n; i++) {
+            b = wave[i];
+            for(j = Drag.paramStart[b]; j < Drag.paramStart[b+1]; j++) {
+                int p = Drag.param[j];
+                SK->param[p].known = TRUE;
+                if(SK->param[p].v != Drag.v[p]) {
+                    Drag.v[p] = SK->param[p].v;
+                    DragQueueUsers(p);
+                }
+            }
+        }
+    }
+
+    for(i = 0; i < SK->params; i++) {
+        if(SK->param[i].substd) {
+            SK->param[i].v = EEval(Drag.subst[i]);
+        }
+    }
+    dbp2("drag: solved %d of %d blocks in %d waves", solved, Drag.blocks,
+        waves);
+    dbp2("drag: %d iterations, %d Jacobians", SC->stats.iterations,
+        SC->stats.jacobians);
+    SC->stats.time = GetTickCount() - dragStartTime;
+
+    EArenaRelease(solveMark);
+    SaveGoodParams();
+    return TRUE;
+
+failed:
+    // Whatever we solved so far is no good, and neither is the plan.
+    for(i = 0; i < SK->params; i++) {
+        SK->param[i].v = Drag.start[i];
+    }
+    for(b = 0; b < Drag.blocks; b++) {
+        Drag.queued[b] = FALSE;
+    }
+    Drag.heapSize = 0;
+    Drag.valid = FALSE;
+    SC->stats.time = GetTickCount() - dragStartTime;
+
+    EArenaRelease(solveMark);
+    return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// Solve again after the user has changed something, in the background. The
+// steps that ChangeConstraintValue() takes through a new dimension may all
+// arrive here as one, so any dimension that changed gets stepped there from
+// where we last solved it; then if it was just a drag we're done, else we
+// solve from scratch at the end, like SolvePerMode() would.
+//-----------------------------------------------------------------------------
+#define StepFrom                (SC->solve->stepFrom)
+#define StepFromAlloc           (SC->solve->stepFromAlloc)
+#define StepTo                  (SC->solve->stepTo)
+#define StepToAlloc             (SC->solve->stepToAlloc)
+static BOOL SolveInSteps(BOOL dragging)
+{
+    int i, step, steps = 0;
+    BOOL solved = FALSE;
+
+    if(Drag.valid && !SK->eqnsDirty && SK->constraints == Drag.constraints) {
+        for(i = 0; i < SK->constraints; i++) {
+            SketchConstraint *c = &(SK->constraint[i]);
+            if(c->v == Drag.cv[i]) continue;
+
+            int n = ConstraintValueSteps(Drag.cv[i], c->v);
+            if(n > steps) steps = n;
+        }
+    }
+
+    if(steps > 0) {
+        RESERVE(StepFrom, StepFromAlloc, SK->constraints);
+        RESERVE(StepTo, StepToAlloc, SK->constraints);
+        for(i = 0; i < SK->constraints; i++) {
+            StepFrom[i] = Drag.cv[i];
+            StepTo[i] = SK->constraint[i].v;
+        }
+        for(step = steps - 1; step >= 0 && !SC->cancel; step--) {
+            for(i = 0; i < SK->constraints; i++) {
+                SK->constraint[i].v = StepTo[i] +
+                                    (step*(StepFrom[i] - StepTo[i]))/steps;
+            }
+            solved = SolveDragged() || Solve();
+        }
+        for(i = 0; i < SK->constraints; i++) {
+            SK->constraint[i].v = StepTo[i];
+        }
+    }
+
+    if(SC->cancel) return FALSE;
+
+    if(dragging) {
+        // The last step was the drag itself.
+        if(steps > 0) return solved;
+        if(SolveDragged()) return TRUE;
+    }
+    return Solve();
+}
+
+//-----------------------------------------------------------------------------
+// Make a new solver context, with an empty sketch. The UI's sketch is in one
+// that gets made at startup; others can be made to solve other sketches, or
+// copies of that one, on other threads.
+//-----------------------------------------------------------------------------
+static void *AllocZeroed(int bytes)
+{
+    void *v = DAlloc(bytes);
+    if(!v) oops();
+    memset(v, 0, bytes);
+    return v;
+}
+SolverContext *NewSolverContext(void)
+{
+    SolverContext *sc = (SolverContext *)AllocZeroed(sizeof(*sc));
+    sc->rst = &(sc->rs[0]);
+    sc->rsp = &(sc->rs[1]);
+
+    SketchAllocState(sc);
+    ExprAllocState(sc);
+    NewtonAllocState(sc);
+    AssumeAllocState(sc);
+
+    struct SolveStateTag *st;
+    st = (struct SolveStateTag *)AllocZeroed(sizeof(*st));
+    st->ix = (struct IncidenceTag *)AllocZeroed(sizeof(*(st->ix)));
+    st->sub = (struct SubsystemTag *)AllocZeroed(sizeof(*(st->sub)));
+    st->bt = (struct BlockTriangularTag *)AllocZeroed(sizeof(*(st->bt)));
+    st->wave = (struct WaveTag *)AllocZeroed(sizeof(*(st->wave)));
+    st->drag = (struct DragPlanTag *)AllocZeroed(sizeof(*(st->drag)));
+    sc->solve = st;
+
+    return sc;
+}
+
+//-----------------------------------------------------------------------------
+// Give back everything that a solver context holds. It mustn't be in use on
+// any other thread; if it's current on this one, then nothing is after.
+//-----------------------------------------------------------------------------
+void FreeSolverContext(SolverContext *sc)
+{
+    int i;
+
+    // Our own tables are easiest to get at with the context current.
+    SolverContext *was = UseSolverContext(sc);
+
+    ForgetDragPlan();
+    UNRESERVE(Drag.eqnStart, Drag.eqnStartAlloc);
+    UNRESERVE(Drag.eqn, Drag.eqnAlloc);
+    UNRESERVE(Drag.paramStart, Drag.paramStartAlloc);
+    UNRESERVE(Drag.param, Drag.paramAlloc);
+    UNRESERVE(Drag.solvedBy, Drag.solvedByAlloc);
+    UNRESERVE(Drag.v, Drag.vAlloc);
+    UNRESERVE(Drag.twin, Drag.twinAlloc);
+    UNRESERVE(Drag.userStart, Drag.userStartAlloc);
+    UNRESERVE(Drag.user, Drag.userAlloc);
+    UNRESERVE(Drag.heap, Drag.heapAlloc);
+    UNRESERVE(Drag.queued, Drag.queuedAlloc);
+    UNRESERVE(Drag.start, Drag.startAlloc);
+    UNRESERVE(Drag.cv, Drag.cvAlloc);
+    UNRESERVE(Drag.subst, Drag.substAlloc);
+
+    UNRESERVE(IX.eqParamStart, IX.eqParamStartAlloc);
+    UNRESERVE(IX.eqParam, IX.eqParamAlloc);
+    UNRESERVE(IX.paramEqStart, IX.paramEqStartAlloc);
+    UNRESERVE(IX.paramEq, IX.paramEqAlloc);
+    UNRESERVE(IX.eqnSlot, IX.eqnSlotAlloc);
+    UNRESERVE(ParamStamp, ParamStampAlloc);
+    UNRESERVE(IncidenceCursor, IncidenceCursorAlloc);
+    UNRESERVE(SubstSlot, SubstSlotAlloc);
+    UNRESERVE(SubstScale, SubstScaleAlloc);
+    UNRESERVE(SubstOffset, SubstOffsetAlloc);
+    UNRESERVE(SubstPath, SubstPathAlloc);
+    UNRESERVE(Substitute, SubstituteAlloc);
+
+    UNRESERVE(Sub.eqn, Sub.eqnAlloc);
+    UNRESERVE(Sub.param, Sub.paramAlloc);
+    UNRESERVE(Sub.marked, Sub.markedAlloc);
+    UNRESERVE(Unknown, UnknownAlloc);
+
+    int **tables[] = { &BT.eqn, &BT.start, &BT.matchOfEqn, &BT.dist,
+        &BT.queue, &BT.index, &BT.low, &BT.onStack, &BT.stack, &BT.blockOf,
+        &BT.member, &BT.blockStart, &BT.underdetermined };
+    for(i = 0; i < arraylen(tables); i++) {
+        if(*tables[i]) DFree(*tables[i]);
+    }
+    UNRESERVE(BT.param, BT.paramAlloc);
+    UNRESERVE(BT.matchOfParam, BT.matchOfParamAlloc);
+
+    UNRESERVE(Wave.eqn, Wave.eqnAlloc);
+    UNRESERVE(Wave.param, Wave.paramAlloc);
+    UNRESERVE(Wave.touched, Wave.touchedAlloc);
+
+    UNRESERVE(Solved, SolvedAlloc);
+    UNRESERVE(SolvedStart, SolvedStartAlloc);
+
+    UNRESERVE(Presolve, PresolveAlloc);
+    UNRESERVE(PresolveQueued, PresolveQueuedAlloc);
+    UNRESERVE(StepFrom, StepFromAlloc);
+    UNRESERVE(StepTo, StepToAlloc);
+
+    UNRESERVE(sc->stats.block, sc->stats.blockAlloc);
+    UNRESERVE(sc->stats.residual, sc->stats.residualAlloc);
+
+    UseSolverContext((was == sc) ? NULL : was);
+
+    struct SolveStateTag *st = sc->solve;
+    DFree(st->ix);
+    DFree(st->sub);
+    DFree(st->bt);
+    DFree(st->wave);
+    DFree(st->drag);
+    DFree(st);
+
+    SketchFreeState(sc);
+    ExprFreeState(sc);
+    NewtonFreeState(sc);
+    AssumeFreeState(sc);
+
+    UNRESERVE(sc->eq.eqn, sc->eq.eqnsAlloc);
+    for(i = 0; i < arraylen(sc->rs); i++) {
+        UNRESERVE(sc->rs[i].set, sc->rs[i].setsAlloc);
+    }
+
+    DFree(sc);
+}
+
+//-----------------------------------------------------------------------------
+// Make the sketch in dest a copy of the one in src, which can then be changed
+// and solved without touching the original. The subsystems that solved the
+// original will solve the copy too, so those come along.
+//-----------------------------------------------------------------------------
+static void CopySubsystems(RememberedSubsystems *d, RememberedSubsystems *s)
+{
+    RESERVE(d->set, d->setsAlloc, s->sets);
+    memcpy(d->set, s->set, (s->sets)*sizeof(s->set[0]));
+    d->sets = s->sets;
+}
+void CopySolverContext(SolverContext *dest, SolverContext *src)
+{
+    SketchCopyState(dest, src);
+
+    CopySubsystems(dest->rsp, src->rsp);
+    dest->rst->sets = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Make sc the context that this thread works on, and return the one that it
+// was working on before.
+//-----------------------------------------------------------------------------
+SolverContext *UseSolverContext(SolverContext *sc)
+{
+    SolverContext *was = SC;
+    SC = sc;
+    return was;
+}
+
+//=============================================================================
+// Solving in the background, so that a slow solve doesn't hold up painting
+// or input. The window's sketch gets copied to a thread with a solver
+// context of its own, which solves the copy; meanwhile the window carries on
+// drawing the last solution that it had (plus whatever the user does to it),
+// and takes the new one when it's done. There's one job at a time. Anything
+// that's asked for while one is underway waits, and gets handed over with
+// everything else that's changed once that one is done, so that each copy
+// starts from the last solution, as though we'd solved here.
+//=============================================================================
+static struct {
+    SolverContext   *work;
+    SolverReport    report;
+    BOOL            noThread;
+
+    // TRUE while the thread has a job; until it's done, its context is
+    // none of our business (except to cancel it).
+    BOOL            busy;
+    BOOL            dragging;
+    BOOL            solved;
+    // The parameters that we handed over, so that we can tell what the user
+    // has moved since.
+    double          *from;
+    int             fromAlloc;
+
+    // What's been asked for since the last job was handed over: whether
+    // anything at all, whether the equations changed, and whether anything
+    // happened besides dragging.
+    BOOL            wanted;
+    BOOL            dirty;
+    BOOL            notDragging;
+} Bg;
+
+//-----------------------------------------------------------------------------
+// The job, on the background thread.
+//-----------------------------------------------------------------------------
+static void BackgroundJob(void)
+{
+    UseSolverContext(Bg.work);
+
+    SolverReport *r = &(Bg.report);
+    r->status = NULL;
+    r->newLists = FALSE;
+    r->inconsistent = FALSE;
+    r->assumeds = 0;
+    r->removables = 0;
+    r->stop = FALSE;
+    r->stats = &(SC->stats);
+
+    Bg.solved = SolveInSteps(Bg.dragging);
+}
+
+//-----------------------------------------------------------------------------
+// Copy the window's sketch to the background thread, and wake it up to
+// solve that.
+//-----------------------------------------------------------------------------
+static void HandOver(void)
+{
+    SolverContext *w = Bg.work;
+    int i;
+
+    CopySketchTables(&(w->sk), SK);
+    w->sk.eqnsDirty = Bg.dirty;
+    if(Bg.dirty) {
+        // The partition from the last solve here might be better than
+        // nothing, if e.g. we just loaded a file.
+        CopySubsystems(w->rsp, RSp);
+    }
+
+    RESERVE(Bg.from, Bg.fromAlloc, SK->params);
+    for(i = 0; i < SK->params; i++) {
+        Bg.from[i] = SK->param[i].v;
+    }
+
+    Bg.dragging = !Bg.notDragging;
+    Bg.wanted = FALSE;
+    Bg.dirty = FALSE;
+    Bg.notDragging = FALSE;
+
+    w->cancel = FALSE;
+    Bg.busy = TRUE;
+    WakeBackgroundThread();
+}
+
+//-----------------------------------------------------------------------------
+// Ask for the window's sketch to be solved in the background. Returns FALSE
+// if we can't, in which case the caller should solve it here.
+//-----------------------------------------------------------------------------
+BOOL SolveInBackground(BOOL dragging)
+{
+    if(!Bg.work) {
+        if(Bg.noThread) return FALSE;
+
+        Bg.work = NewSolverContext();
+        Bg.work->report = &(Bg.report);
+        if(!StartBackgroundThread(BackgroundJob)) {
+            FreeSolverContext(Bg.work);
+            Bg.work = NULL;
+            Bg.noThread = TRUE;
+            return FALSE;
+        }
+    }
+
+    // The new equations get generated over there, so whatever we knew
+    // about ours is no use now.
+    if(SK->eqnsDirty) {
+        Bg.dirty = TRUE;
+        SK->eqnsDirty = FALSE;
+        ForgetPartials(TRUE);
+        ForgetDragPlan();
+    }
+    if(!dragging) Bg.notDragging = TRUE;
+    Bg.wanted = TRUE;
+
+    if(!Bg.busy) {
+        HandOver();
+    } else if(Bg.dirty) {
+        // The job underway is for a sketch that's gone, so it may as well
+        // stop. Drags don't cancel; they just wait, since the solution
+        // that's coming is better than the one that we're drawing.
+        Bg.work->cancel = TRUE;
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Called on the main thread when the background thread has finished a job.
+// Take its solution, if that's still any use, and hand over the next one.
+//-----------------------------------------------------------------------------
+void BackgroundSolveDone(void)
+{
+    Sketch *out = &(Bg.work->sk);
+    int i, j;
+
+    Bg.busy = FALSE;
+
+    // If the equations changed since we handed it over, then that's a
+    // solution to some other sketch.
+    if(!Bg.work->cancel && !Bg.dirty && !SK->eqnsDirty) {
+        for(i = 0; i < SK->params; i++) {
+            SketchParam *p = &(SK->param[i]);
+
+            // The parameters are in the same order as we handed them over,
+            // unless something's gone very wrong.
+            j = i;
+            if(j >= out->params || out->param[j].id != p->id) {
+                for(j = 0; j < out->params; j++) {
+                    if(out->param[j].id == p->id) break;
+                }
+                if(j >= out->params) continue;
+            }
+
+            p->assumed = out->param[j].assumed;
+            // Anything that the user moved in the meantime stays where they
+            // put it, for the next job to solve.
+            if(p->v == Bg.from[j]) {
+                p->v = out->param[j].v;
+            }
+        }
+        CopySubsystems(RSp, Bg.work->rsp);
+        if(Bg.solved) SaveGoodParams();
+
+        ShowSolverReport(&(Bg.report));
+    }
+
+    if(Bg.wanted && SolvingState == SOLVING_AUTOMATICALLY) {
+        HandOver();
+    }
+    uiRepaint();
 }
@@ -0,0 +1,541 @@
+//-----------------------------------------------------------------------------
+// Copyright 2008 Jonathan Westhues
+//
+// This file is part of SketchFlat.
+//
+// SketchFlat is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SketchFlat is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SketchFlat.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// A sparse LU factorization, for the subsystems that are too big to solve
+// with a dense Jacobian. Each constraint equation mentions only a few of
+// the unknowns, so the Jacobian is mostly zeros, and most of the work in
+// a dense elimination would be spent subtracting zero from zero.
+//
+// The columns are eliminated in a fill-reducing (minimum degree) order,
+// which depends only on which entries are nonzero, so that gets computed
+// once per subsystem. Each column is then found by a sparse triangular
+// solve against the columns before it, with partial pivoting by rows. The
+// pivots and the pattern of the factors are kept, so that the next time
+// (with the same pattern, but new values) we can just redo the arithmetic.
+//-----------------------------------------------------------------------------
+#include "sketchflat.h"
+
+// When we factor again with the old pivots, each pivot must be at least
+// this fraction of the largest candidate in its column; otherwise we
+// pivot again from scratch.
+#define SPARSE_REFACTOR_TOL     0.1
+// A pivot smaller than this means a singular matrix, the same as for the
+// dense factorization.
+#define SPARSE_PIVOT_MIN        1e-10
+
+//-----------------------------------------------------------------------------
+// Choose the order in which to eliminate the columns, to keep the factors
+// sparse. Two columns interact if some row has entries in both (so that's
+// the pattern of A'*A), and eliminating a column makes all of the columns
+// that it interacts with interact with each other. So greedily eliminate
+// the column with the fewest interactions left, and then join up its
+// neighbours. That's the minimum degree ordering.
+//
+// Forming A'*A, or the fill, would take memory that goes as the square of
+// the size, so we work on the quotient graph instead, like COLAMD. The
+// graph is kept as elements, each a clique of columns: at first those are
+// the rows of A, and eliminating a column replaces the elements that it's
+// in with one new element, the union of theirs. That never takes more
+// memory than the elements that it replaces. The exact degree is too slow
+// to find, so we use the approximate degree of AMD, from the sizes of
+// the elements outside the new one; the columns are kept in buckets by
+// that, so the one to eliminate is quick to find. An element that the new
+// one contains is redundant, and gets absorbed into it. There's no
+// detection of supervariables (columns in the same elements, like the x
+// and y of a point often are), which would save time but not fill.
+//-----------------------------------------------------------------------------
+static void SparseOrder(SparseLU *lu)
+{
+    int n = lu->n;
+    int i, j, k, p, t, u;
+
+    // Elements 0 through n-1 are the rows of A, and element n+k is the
+    // one made when we eliminate the k-th column. An element that's been
+    // absorbed has eLen[] of -1. Each element's columns are in eVar[], and
+    // each column's elements in vElem[].
+    int *eStart = (int *)DAlloc(2*n*sizeof(int));
+    int *eLen = (int *)DAlloc(2*n*sizeof(int));
+    int *eSeen = (int *)DAlloc(2*n*sizeof(int));
+    int *eOut = (int *)DAlloc(2*n*sizeof(int));
+    int *vStart = (int *)DAlloc(n*sizeof(int));
+    int *vLen = (int *)DAlloc(n*sizeof(int));
+    int *vElem = (int *)DAlloc((lu->nonzeros + 1)*sizeof(int));
+    int *degree = (int *)DAlloc(n*sizeof(int));
+    int *head = (int *)DAlloc(n*sizeof(int));
+    int *next = (int *)DAlloc(n*sizeof(int));
+    int *prev = (int *)DAlloc(n*sizeof(int));
+    int *mark = (int *)DAlloc(n*sizeof(int));
+    if(!eStart || !eLen || !eSeen || !eOut || !vStart || !vLen || !vElem ||
+        !degree || !head || !next || !prev || !mark)
+    {
+        oops();
+    }
+    int *eVar = NULL;
+    int eVarAlloc = 0, eVars = lu->nonzeros;
+    RESERVE(eVar, eVarAlloc, eVars + 1);
+
+    // Get the columns in each row, by transposing the pattern.
+    for(i = 0; i < 2*n; i++) {
+        eLen[i] = 0;
+        eSeen[i] = -1;
+    }
+    for(p = 0; p < lu->nonzeros; p++) {
+        (eLen[lu->row[p]])++;
+    }
+    for(i = 0, t = 0; i < n; i++) {
+        eStart[i] = t;
+        t += eLen[i];
+        eLen[i] = 0;
+    }
+    for(j = 0; j < n; j++) {
+        vStart[j] = lu->colStart[j];
+        vLen[j] = lu->colStart[j+1] - lu->colStart[j];
+        for(p = lu->colStart[j]; p < lu->colStart[j+1]; p++) {
+            i = lu->row[p];
+            vElem[p] = i;
+            eVar[eStart[i] + (eLen[i])++] = j;
+        }
+    }
+
+    // A column's degree starts out as the sizes of its rows, which counts
+    // a column twice if they share two rows; but it's only a guess.
+    for(j = 0; j < n; j++) {
+        head[j] = -1;
+        mark[j] = -1;
+    }
+    int minDegree = n;
+    for(j = 0; j < n; j++) {
+        int d = 0;
+        for(t = 0; t < vLen[j]; t++) {
+            d += eLen[vElem[vStart[j] + t]] - 1;
+        }
+        if(d > n - 1) d = n - 1;
+        degree[j] = d;
+        next[j] = head[d];
+        prev[j] = -1;
+        if(head[d] >= 0) prev[head[d]] = j;
+        head[d] = j;
+        if(d < minDegree) minDegree = d;
+    }
+
+    for(k = 0; k < n; k++) {
+        while(head[minDegree] < 0) minDegree++;
+        int pivot = head[minDegree];
+        head[minDegree] = next[pivot];
+        if(next[pivot] >= 0) prev[next[pivot]] = -1;
+        lu->q[k] = pivot;
+        degree[pivot] = -1;
+        mark[pivot] = k;
+
+        // The new element is every column of the elements that the pivot
+        // was in; and they're absorbed into it.
+        int me = n + k;
+        int most = 0;
+        for(t = 0; t < vLen[pivot]; t++) {
+            int e = vElem[vStart[pivot] + t];
+            if(eLen[e] > 0) most += eLen[e];
+        }
+        if(eVars + most + 1 > eVarAlloc) {
+            // Squeeze out the elements that were absorbed. The ones left
+            // are in order by where they start, so they only move down.
+            eVars = 0;
+            for(i = 0; i < me; i++) {
+                if(eLen[i] <= 0) continue;
+                memmove(&eVar[eVars], &eVar[eStart[i]], eLen[i]*sizeof(int));
+                eStart[i] = eVars;
+                eVars += eLen[i];
+            }
+            RESERVE(eVar, eVarAlloc, eVars + most + 1);
+        }
+        eStart[me] = eVars;
+        for(t = 0; t < vLen[pivot]; t++) {
+            int e = vElem[vStart[pivot] + t];
+            if(eLen[e] < 0) continue;
+            for(u = 0; u < eLen[e]; u++) {
+                j = eVar[eStart[e] + u];
+                if(mark[j] == k || degree[j] < 0) continue;
+                mark[j] = k;
+                eVar[(eVars)++] = j;
+            }
+            eLen[e] = -1;
+        }
+        eLen[me] = eVars - eStart[me];
+        int *lp = &eVar[eStart[me]];
+
+        // For each other element, how much of it is outside the new one.
+        for(t = 0; t < eLen[me]; t++) {
+            i = lp[t];
+            for(u = 0; u < vLen[i]; u++) {
+                int e = vElem[vStart[i] + u];
+                if(eLen[e] < 0) continue;
+                if(eSeen[e] != k) {
+                    eSeen[e] = k;
+                    eOut[e] = eLen[e];
+                }
+                (eOut[e])--;
+            }
+        }
+
+        // And so the new degree of each column in the new element, which
+        // is now in that element instead of the ones that it absorbed. So
+        // its list of elements can't get longer.
+        for(t = 0; t < eLen[me]; t++) {
+            i = lp[t];
+            if(prev[i] >= 0) {
+                next[prev[i]] = next[i];
+            } else {
+                head[degree[i]] = next[i];
+            }
+            if(next[i] >= 0) prev[next[i]] = prev[i];
+
+            int outside = 0, len = 0;
+            for(u = 0; u < vLen[i]; u++) {
+                int e = vElem[vStart[i] + u];
+                if(eLen[e] < 0) continue;
+                if(eOut[e] == 0) {
+                    eLen[e] = -1;
+                    continue;
+                }
+                outside += eOut[e];
+                vElem[vStart[i] + len] = e;
+                len++;
+            }
+            vElem[vStart[i] + len] = me;
+            vLen[i] = len + 1;
+
+            int d = degree[i] + eLen[me] - 1;
+            if(outside + eLen[me] - 1 < d) d = outside + eLen[me] - 1;
+            if(n - k - 2 < d) d = n - k - 2;
+            if(d < 0) d = 0;
+
+            degree[i] = d;
+            next[i] = head[d];
+            prev[i] = -1;
+            if(head[d] >= 0) prev[head[d]] = i;
+            head[d] = i;
+            if(d < minDegree) minDegree = d;
+        }
+    }
+
+    DFree(eStart);
+    DFree(eLen);
+    DFree(eSeen);
+    DFree(eOut);
+    DFree(vStart);
+    DFree(vLen);
+    DFree(vElem);
+    DFree(degree);
+    DFree(head);
+    DFree(next);
+    DFree(prev);
+    DFree(mark);
+    UNRESERVE(eVar, eVarAlloc);
+}
+
+//-----------------------------------------------------------------------------
+// Set up to factor matrices with n rows and n columns, and the nonzero
+// entries in rows row[colStart[j]] through row[colStart[j+1]-1] of column
+// j. This works out the order in which to eliminate, which we can then
+// use to factor any number of matrices with that same pattern.
+//-----------------------------------------------------------------------------
+void SparseAnalyze(SparseLU *lu, int n, int *colStart, int *row)
+{
+    lu->n = n;
+    lu->nonzeros = colStart[n];
+
+    RESERVE(lu->colStart, lu->colStartAlloc, n + 1);
+    RESERVE(lu->row, lu->rowAlloc, lu->nonzeros);
+    memcpy(lu->colStart, colStart, (n + 1)*sizeof(int));
+    memcpy(lu->row, row, lu->nonzeros*sizeof(int));
+
+    RESERVE(lu->q, lu->qAlloc, n);
+    RESERVE(lu->pinv, lu->pinvAlloc, n);
+    RESERVE(lu->prow, lu->prowAlloc, n);
+    RESERVE(lu->lStart, lu->lStartAlloc, n + 1);
+    RESERVE(lu->uStart, lu->uStartAlloc, n + 1);
+    RESERVE(lu->x, lu->xAlloc, n);
+    RESERVE(lu->z, lu->zAlloc, n);
+    RESERVE(lu->xi, lu->xiAlloc, n);
+    RESERVE(lu->stack, lu->stackAlloc, n);
+    RESERVE(lu->mark, lu->markAlloc, n);
+    memset(lu->mark, 0, n*sizeof(int));
+    lu->stamp = 0;
+
+    SparseOrder(lu);
+    lu->factored = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// Find the rows that can be nonzero in the solution of L*x = A(:,col), for
+// the columns of L that we've got so far: that's any row of A(:,col), and
+// then anything in a column of L whose pivot row is already nonzero. Those
+// get written to xi[top] through xi[n-1], in an order that we can do the
+// triangular solve in, and we return top.
+//-----------------------------------------------------------------------------
+static int SparseReach(SparseLU *lu, int col)
+{
+    int n = lu->n;
+    int top = n;
+    int p;
+
+    (lu->stamp)++;
+    for(p = lu->colStart[col]; p < lu->colStart[col+1]; p++) {
+        int start = lu->row[p];
+        if(lu->mark[start] == lu->stamp) continue;
+
+        // A depth-first search, without recursion. The rows that we're in
+        // the middle of are on xi[0...head], and where we got to in each
+        // one's column of L is in stack[].
+        int head = 0;
+        lu->xi[0] = start;
+        while(head >= 0) {
+            int j = lu->xi[head];
+            int J = lu->pinv[j];
+            if(lu->mark[j] != lu->stamp) {
+                lu->mark[j] = lu->stamp;
+                lu->stack[head] = (J < 0) ? 0 : lu->lStart[J] + 1;
+            }
+            BOOL done = TRUE;
+            int end = (J < 0) ? 0 : lu->lStart[J+1];
+            int q;
+            for(q = lu->stack[head]; q < end; q++) {
+                int i = lu->lRow[q];
+                if(lu->mark[i] == lu->stamp) continue;
+                lu->stack[head] = q + 1;
+                lu->xi[++head] = i;
+                done = FALSE;
+                break;
+            }
+            if(done) {
+                head--;
+                lu->xi[--top] = j;
+            }
+        }
+    }
+    return top;
+}
+
+//-----------------------------------------------------------------------------
+// Factor from scratch, choosing the pivots as we go.
+//-----------------------------------------------------------------------------
+static BOOL SparseFactorPivoting(SparseLU *lu, double *val)
+{
+    int n = lu->n;
+    int i, k, p, q;
+    int lnz = 0, unz = 0;
+
+    for(i = 0; i < n; i++) {
+        lu->pinv[i] = -1;
+    }
+
+    for(k = 0; k < n; k++) {
+        // Each column adds at most n entries to each factor.
+        RESERVE(lu->lRow, lu->lRowAlloc, lnz + n);
+        RESERVE(lu->lVal, lu->lValAlloc, lnz + n);
+        RESERVE(lu->uRow, lu->uRowAlloc, unz + n);
+        RESERVE(lu->uVal, lu->uValAlloc, unz + n);
+        lu->lStart[k] = lnz;
+        lu->uStart[k] = unz;
+
+        int col = lu->q[k];
+        int top = SparseReach(lu, col);
+
+        // Solve L*x = A(:,col), over the rows that can be nonzero.
+        double *x = lu->x;
+        for(p = top; p < n; p++) {
+            x[lu->xi[p]] = 0;
+        }
+        for(p = lu->colStart[col]; p < lu->colStart[col+1]; p++) {
+            x[lu->row[p]] = val[p];
+        }
+        for(p = top; p < n; p++) {
+            int j = lu->xi[p];
+            int J = lu->pinv[j];
+            if(J < 0) continue;
+            for(q = lu->lStart[J] + 1; q < lu->lStart[J+1]; q++) {
+                x[lu->lRow[q]] -= lu->lVal[q]*x[j];
+            }
+        }
+
+        // The rows that are pivoted already go in U; pick the biggest of
+        // the others as our pivot.
+        int ipiv = -1;
+        double max = 0;
+        for(p = top; p < n; p++) {
+            i = lu->xi[p];
+            if(lu->pinv[i] < 0) {
+                if(fabs(x[i]) > max) {
+                    ipiv = i;
+                    max = fabs(x[i]);
+                }
+            } else {
+                lu->uRow[unz] = lu->pinv[i];
+                lu->uVal[unz++] = x[i];
+            }
+        }
+        if(ipiv < 0 || max < SPARSE_PIVOT_MIN) return FALSE;
+
+        double pivot = x[ipiv];
+        lu->uRow[unz] = k;
+        lu->uVal[unz++] = pivot;
+        lu->pinv[ipiv] = k;
+        lu->prow[k] = ipiv;
+
+        lu->lRow[lnz] = ipiv;
+        lu->lVal[lnz++] = 1;
+        for(p = top; p < n; p++) {
+            i = lu->xi[p];
+            if(lu->pinv[i] < 0) {
+                lu->lRow[lnz] = i;
+                lu->lVal[lnz++] = x[i]/pivot;
+            }
+        }
+    }
+    lu->lStart[n] = lnz;
+    lu->uStart[n] = unz;
+
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Factor again with the pivots and pattern from last time. This fails if
+// any of those pivots has become too small, relative to the other
+// candidates in its column.
+//-----------------------------------------------------------------------------
+static BOOL SparseRefactor(SparseLU *lu, double *val)
+{
+    int n = lu->n;
+    int k, p, q;
+    double *x = lu->x;
+
+    for(k = 0; k < n; k++) {
+        int col = lu->q[k];
+        int uEnd = lu->uStart[k+1] - 1;
+
+        for(p = lu->uStart[k]; p <= uEnd; p++) {
+            x[lu->prow[lu->uRow[p]]] = 0;
+        }
+        for(p = lu->lStart[k]; p < lu->lStart[k+1]; p++) {
+            x[lu->lRow[p]] = 0;
+        }
+        for(p = lu->colStart[col]; p < lu->colStart[col+1]; p++) {
+            x[lu->row[p]] = val[p];
+        }
+
+        // U's entries are in an order that we can do the triangular solve
+        // in, so that's the order that we stored them.
+        for(p = lu->uStart[k]; p < uEnd; p++) {
+            int J = lu->uRow[p];
+            double xj = x[lu->prow[J]];
+            lu->uVal[p] = xj;
+            for(q = lu->lStart[J] + 1; q < lu->lStart[J+1]; q++) {
+                x[lu->lRow[q]] -= lu->lVal[q]*xj;
+            }
+        }
+
+        double pivot = x[lu->prow[k]];
+        double max = fabs(pivot);
+        for(p = lu->lStart[k] + 1; p < lu->lStart[k+1]; p++) {
+            if(fabs(x[lu->lRow[p]]) > max) max = fabs(x[lu->lRow[p]]);
+        }
+        if(fabs(pivot) < SPARSE_PIVOT_MIN) return FALSE;
+        if(fabs(pivot) < SPARSE_REFACTOR_TOL*max) return FALSE;
+
+        lu->uVal[uEnd] = pivot;
+        for(p = lu->lStart[k] + 1; p < lu->lStart[k+1]; p++) {
+            lu->lVal[p] = x[lu->lRow[p]]/pivot;
+        }
+    }
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Factor the matrix with the pattern from SparseAnalyze(), and values val[]
+// in the same order. Returns FALSE if it's singular.
+//-----------------------------------------------------------------------------
+BOOL SparseFactor(SparseLU *lu, double *val)
+{
+    if(lu->factored && SparseRefactor(lu, val)) return TRUE;
+
+    lu->factored = SparseFactorPivoting(lu, val);
+    return lu->factored;
+}
+
+//-----------------------------------------------------------------------------
+// Solve A*X = B, given the factors of A. B is indexed by row and X by
+// column, and B is not changed.
+//-----------------------------------------------------------------------------
+void SparseSolve(SparseLU *lu, double *X, double *B)
+{
+    int n = lu->n;
+    int k, p;
+    double *y = lu->x;
+    double *z = lu->z;
+
+    // Forward-substitute with L, which has ones on its diagonal.
+    for(k = 0; k < n; k++) {
+        y[k] = B[k];
+    }
+    for(k = 0; k < n; k++) {
+        double yj = y[lu->prow[k]];
+        for(p = lu->lStart[k] + 1; p < lu->lStart[k+1]; p++) {
+            y[lu->lRow[p]] -= lu->lVal[p]*yj;
+        }
+        z[k] = yj;
+    }
+
+    // And back-substitute with U, which has its pivot last in each column.
+    for(k = n - 1; k >= 0; k--) {
+        int uEnd = lu->uStart[k+1] - 1;
+        z[k] /= lu->uVal[uEnd];
+        for(p = lu->uStart[k]; p < uEnd; p++) {
+            z[lu->uRow[p]] -= lu->uVal[p]*z[k];
+        }
+    }
+
+    for(k = 0; k < n; k++) {
+        X[lu->q[k]] = z[k];
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Give back all of the memory of a factorization, when it's going away.
+//-----------------------------------------------------------------------------
+void SparseFree(SparseLU *lu)
+{
+    UNRESERVE(lu->colStart, lu->colStartAlloc);
+    UNRESERVE(lu->row, lu->rowAlloc);
+    UNRESERVE(lu->q, lu->qAlloc);
+    UNRESERVE(lu->lStart, lu->lStartAlloc);
+    UNRESERVE(lu->lRow, lu->lRowAlloc);
+    UNRESERVE(lu->lVal, lu->lValAlloc);
+    UNRESERVE(lu->uStart, lu->uStartAlloc);
+    UNRESERVE(lu->uRow, lu->uRowAlloc);
+    UNRESERVE(lu->uVal, lu->uValAlloc);
+    UNRESERVE(lu->pinv, lu->pinvAlloc);
+    UNRESERVE(lu->prow, lu->prowAlloc);
+    UNRESERVE(lu->x, lu->xAlloc);
+    UNRESERVE(lu->z, lu->zAlloc);
+    UNRESERVE(lu->xi, lu->xiAlloc);
+    UNRESERVE(lu->stack, lu->stackAlloc);
+    UNRESERVE(lu->mark, lu->markAlloc);
+
+    lu->n = 0;
+    lu->factored = FALSE;
+}
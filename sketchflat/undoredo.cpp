@@ -28,9 +28,9 @@ BOOL ProgramChangedSinceSave;
 
 #define MAX_LEVELS_OF_UNDO      16
 static struct {
-    Sketch                  SK[MAX_LEVELS_OF_UNDO];
-    DerivedList             DL[MAX_LEVELS_OF_UNDO];
-    RememberedSubsystems    RSp[MAX_LEVELS_OF_UNDO];
+    Sketch                  sk[MAX_LEVELS_OF_UNDO];
+    DerivedList             dl[MAX_LEVELS_OF_UNDO];
+    RememberedSubsystems    rsp[MAX_LEVELS_OF_UNDO];
 
     int          write;         // Next position to write
     int          undoCount;     // Can move back by this many, still valid
@@ -50,6 +50,10 @@ static int Wrap(int k)
 
 static void CopySketch(Sketch *d, Sketch *s)
 {
+    RESERVE(d->param, d->paramsAlloc, s->params);
+    RESERVE(d->entity, d->entitiesAlloc, s->entities);
+    RESERVE(d->constraint, d->constraintsAlloc, s->constraints);
+
     memcpy(d->param, s->param, (s->params)*(sizeof(s->param[0])));
     d->params = s->params;
 
@@ -72,7 +76,9 @@ static void CopyDerivedList(DerivedList *d, DerivedList *s)
 static void CopyRememberedSubsystems(RememberedSubsystems *d,
                                             RememberedSubsystems *s)
 {
-    memcpy(d, s, sizeof(*d));
+    RESERVE(d->set, d->setsAlloc, s->sets);
+    memcpy(d->set, s->set, (s->sets)*sizeof(s->set[0]));
+    d->sets = s->sets;
 }
 static void SwapCurrentWith(int i)
 {
@@ -82,13 +88,13 @@ static void SwapCurrentWith(int i)
     CopyDerivedList(&DLtemp, DL);
     CopyRememberedSubsystems(&RSptemp, RSp);
     // Replace current with entry from list
-    CopySketch(SK, &Saved.SK[i]);
-    CopyDerivedList(DL, &Saved.DL[i]);
-    CopyRememberedSubsystems(RSp, &Saved.RSp[i]);
+    CopySketch(SK, &Saved.sk[i]);
+    CopyDerivedList(DL, &Saved.dl[i]);
+    CopyRememberedSubsystems(RSp, &Saved.rsp[i]);
     // Replace list entry with temporary buffer
-    CopySketch(&(Saved.SK[i]), &SKtemp);
-    CopyDerivedList(&(Saved.DL[i]), &DLtemp);
-    CopyRememberedSubsystems(&(Saved.RSp[i]), &RSptemp);
+    CopySketch(&(Saved.sk[i]), &SKtemp);
+    CopyDerivedList(&(Saved.dl[i]), &DLtemp);
+    CopyRememberedSubsystems(&(Saved.rsp[i]), &RSptemp);
 }
 
 static void UpdateMenus(void)
@@ -101,9 +107,9 @@ void UndoRemember(void)
 {
     ProgramChangedSinceSave = TRUE;
 
-    CopySketch(&(Saved.SK[Saved.write]), SK);
-    CopyDerivedList(&(Saved.DL[Saved.write]), DL);
-    CopyRememberedSubsystems(&(Saved.RSp[Saved.write]), RSp);
+    CopySketch(&(Saved.sk[Saved.write]), SK);
+    CopyDerivedList(&(Saved.dl[Saved.write]), DL);
+    CopyRememberedSubsystems(&(Saved.rsp[Saved.write]), RSp);
 
     Saved.redoCount = 0;
     if(Saved.undoCount == MAX_LEVELS_OF_UNDO) {
@@ -23,6 +23,12 @@
 //-----------------------------------------------------------------------------
 #include "sketchflat.h"
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+                                                        defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 BOOL told(double a, double b)
 {
     double d = a - b;
@@ -72,66 +78,150 @@ void UnitVector(double *x, double *y)
     }
 }
 
+//-----------------------------------------------------------------------------
+// The inner loops of the dense linear algebra: y -= a*x, and the dot
+// product of x and y, over n contiguous doubles. These use SSE2 when the
+// compiler targets it, which is every x64 build and the Win32 builds by
+// default. The update does the same arithmetic either way; the dot product
+// keeps separate partial sums, so it may round differently.
+//-----------------------------------------------------------------------------
+void VecSubScaled(double *y, double a, double *x, int n)
+{
+    int i = 0;
+#ifdef USE_SSE2
+    __m128d va = _mm_set1_pd(a);
+    for(; i + 4 <= n; i += 4) {
+        __m128d y0 = _mm_loadu_pd(y + i);
+        __m128d y1 = _mm_loadu_pd(y + i + 2);
+        y0 = _mm_sub_pd(y0, _mm_mul_pd(va, _mm_loadu_pd(x + i)));
+        y1 = _mm_sub_pd(y1, _mm_mul_pd(va, _mm_loadu_pd(x + i + 2)));
+        _mm_storeu_pd(y + i, y0);
+        _mm_storeu_pd(y + i + 2, y1);
+    }
+#endif
+    for(; i < n; i++) {
+        y[i] -= a*x[i];
+    }
+}
+
+double VecDot(double *x, double *y, int n)
+{
+    int i = 0;
+    double sum = 0;
+#ifdef USE_SSE2
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    for(; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0,
+                _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        s1 = _mm_add_pd(s1,
+                _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    double part[2];
+    _mm_storeu_pd(part, _mm_add_pd(s0, s1));
+    sum = part[0] + part[1];
+#endif
+    for(; i < n; i++) {
+        sum += x[i]*y[i];
+    }
+    return sum;
+}
+
 //-----------------------------------------------------------------------------
 // Solve a linear system, by Gaussian elimination to a triangular matrix
 // then back-substitution. Partial pivoting, returns TRUE for success, FALSE
-// for a singular matrix.
+// for a singular matrix. A is destroyed, B is not.
 //-----------------------------------------------------------------------------
 BOOL SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS_AT_ONCE], 
                                                         double B[], int N)
 {
-    // Gaussian elimination, with partial pivoting. It's an error if the
-    // matrix is singular, because that means two constraints are
-    // equivalent.
-    int i, j, ip, jp, imax;
+    int perm[MAX_UNKNOWNS_AT_ONCE];
+
+    if(!FactorLinearSystem(A, perm, N)) return FALSE;
+    SolveFactoredSystem(X, A, perm, B, N);
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// The elimination for SolveLinearSystem(), split in two, so that we can
+// factor a matrix once and then solve with it for many right-hand sides.
+// This leaves the factors in A, with the upper triangle U on and right of
+// the diagonal and the multipliers of L left of it, but with the rows in
+// pivot order: row i of the factors is row perm[i] of A. It's an error if
+// the matrix is singular, because that means two constraints are
+// equivalent.
+//-----------------------------------------------------------------------------
+BOOL FactorLinearSystem(double A[][MAX_UNKNOWNS_AT_ONCE], int perm[], int N)
+{
+    int i, ip, imax, r;
     double max, temp;
 
+    for(i = 0; i < N; i++) {
+        perm[i] = i;
+    }
+
     for(i = 0; i < N; i++) {
         // We are trying eliminate the term in column i, for rows i+1 and
         // greater. First, find a pivot (between rows i and N-1).
         max = 0;
         for(ip = i; ip < N; ip++) {
-            if(fabs(A[ip][i]) > max) {
+            if(fabs(A[perm[ip]][i]) > max) {
                 imax = ip;
-                max = fabs(A[ip][i]);
+                max = fabs(A[perm[ip]][i]);
             }
         }
         if(fabs(max) < 1e-12) return FALSE;
 
-        // Swap row imax with row i
-        for(jp = 0; jp < N; jp++) {
-            temp = A[i][jp];
-            A[i][jp] = A[imax][jp];
-            A[imax][jp] = temp;
-        }
-        temp = B[i];
-        B[i] = B[imax];
-        B[imax] = temp;
+        // Rather than moving the pivot row into place, just remember
+        // where it is.
+        r = perm[i];
+        perm[i] = perm[imax];
+        perm[imax] = r;
 
-        // For rows i+1 and greater, eliminate the term in column i.
+        // For rows i+1 and greater, eliminate the term in column i. Only
+        // the columns to the right of it change.
+        double *pivot = A[perm[i]];
         for(ip = i+1; ip < N; ip++) {
-            temp = A[ip][i]/A[i][i];
+            double *row = A[perm[ip]];
+            temp = row[i]/pivot[i];
+            row[i] = temp;
 
-            for(jp = 0; jp < N; jp++) {
-                A[ip][jp] -= temp*(A[i][jp]);
-            }
-            B[ip] -= temp*B[i];
+            if(temp == 0) continue;
+            VecSubScaled(row + i + 1, temp, pivot + i + 1, N - i - 1);
         }
     }
 
-    // We've put the matrix in upper triangular form, so at this point we
-    // can solve by back-substitution.
+    for(i = 0; i < N; i++) {
+        if(fabs(A[perm[i]][i]) < 1e-10) return FALSE;
+    }
+    return TRUE;
+}
+
+void SolveFactoredSystem(double X[], double A[][MAX_UNKNOWNS_AT_ONCE],
+                                        int perm[], double B[], int N)
+{
+    int i, j;
+    double temp;
+
+    // Forward-substitute with L (which has ones on its diagonal), then
+    // back-substitute with U.
+    for(i = 0; i < N; i++) {
+        X[i] = B[perm[i]];
+    }
+    for(i = 0; i < N; i++) {
+        for(j = i+1; j < N; j++) {
+            X[j] -= A[perm[j]][i]*X[i];
+        }
+    }
     for(i = N - 1; i >= 0; i--) {
-        if(fabs(A[i][i]) < 1e-10) return FALSE;
+        double *row = A[perm[i]];
 
-        temp = B[i];
+        temp = X[i];
         for(j = N - 1; j > i; j--) {
-            temp -= X[j]*A[i][j];
+            temp -= X[j]*row[j];
         }
-        X[i] = temp / A[i][i];
+        X[i] = temp / row[i];
     }
-
-    return TRUE;
 }
 
 //-----------------------------------------------------------------------------
@@ -539,3 +629,61 @@ void GroupSelection(GroupedSelection *gs)
         }
     }
 }
+
+//-----------------------------------------------------------------------------
+// Growable arrays. *p points to storage for *alloc elements of elemSize
+// bytes each (or is NULL, with *alloc zero). Make sure that there's room
+// for at least n elements, preserving what's there already and zeroing
+// the rest, like the static arrays that these replace. We grow
+// geometrically, so appending one element at a time is cheap.
+//-----------------------------------------------------------------------------
+void ReserveArray(void **p, int *alloc, int n, int elemSize)
+{
+    if(n <= *alloc) return;
+
+    int want = (*alloc < 16) ? 16 : *alloc;
+    while(want < n) want *= 2;
+
+    BYTE *np = (BYTE *)DAlloc(want*elemSize);
+    if(!np) oops();
+    if(*p) {
+        memcpy(np, *p, (*alloc)*elemSize);
+        DFree(*p);
+    }
+    memset(np + (*alloc)*elemSize, 0, (want - *alloc)*elemSize);
+
+    *p = np;
+    *alloc = want;
+}
+
+//-----------------------------------------------------------------------------
+// And the reverse; if an array now holds only n elements, and that's much
+// less than we've allocated, then give some memory back. This gets called
+// when a table gets emptied or rebuilt, not as it's being worked on.
+//-----------------------------------------------------------------------------
+void ShrinkArray(void **p, int *alloc, int n, int elemSize)
+{
+    if(*alloc <= 64 || n*4 > *alloc) return;
+
+    int want = (n < 8) ? 16 : n*2;
+
+    BYTE *np = (BYTE *)DAlloc(want*elemSize);
+    if(!np) oops();
+    memcpy(np, *p, n*elemSize);
+    memset(np + n*elemSize, 0, (want - n)*elemSize);
+    DFree(*p);
+
+    *p = np;
+    *alloc = want;
+}
+
+//-----------------------------------------------------------------------------
+// And give all of it back, when the table itself is going away.
+//-----------------------------------------------------------------------------
+void FreeArray(void **p, int *alloc)
+{
+    if(*p) DFree(*p);
+
+    *p = NULL;
+    *alloc = 0;
+}
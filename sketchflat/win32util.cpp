@@ -55,6 +55,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 
     // This sets up the heap on which we will allocate our dynamic memory.
     FreeAll();
+    // And the sketch that we'll be drawing, which has to exist before we
+    // first paint.
+    UseSolverContext(NewSolverContext());
+    SC->ui = TRUE;
 
     InitCommonControls();
     
@@ -66,20 +70,46 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     UseInches = FALSE; ThawDWORD(UseInches);
 
     MakeMainWindowControls();
-    ShowWindow(MainWindow, SW_SHOW);
-    UpdateMenusChecked();
 
-    // A file might be specified on the command line.
+    // A file might be specified on the command line; maybe after a design
+    // table, for a batch run like
+    //      sketchflat.exe /table variants.txt part.skf
     char loadFile[MAX_STRING] = "";
+    char tableFile[MAX_STRING] = "";
     if(strlen(lpCmdLine) < MAX_STRING) {
         char *s = lpCmdLine;
         while(isspace(*s)) s++;
+
+        if(strncmp(s, "/table", 6) == 0 && isspace(s[6])) {
+            s += 6;
+            while(isspace(*s)) s++;
+
+            char *d = tableFile;
+            if(*s == '"') {
+                s++;
+                while(*s && *s != '"') *d++ = *s++;
+                if(*s) s++;
+            } else {
+                while(*s && !isspace(*s)) *d++ = *s++;
+            }
+            *d = '\0';
+            while(isspace(*s)) s++;
+        }
         if(*s == '"') s++;
 
         strcpy(loadFile, s);
         s = strrchr(loadFile, '"');
         if(s) *s = '\0';
     }
+    if(*tableFile) {
+        // Nothing to show; just export every row, and report through the
+        // exit code whether they all worked.
+        Init(loadFile);
+        return (ExportDesignTable(tableFile) == 0) ? 0 : 1;
+    }
+
+    ShowWindow(MainWindow, SW_SHOW);
+    UpdateMenusChecked();
     Init(loadFile);
     
     MSG msg;
@@ -272,6 +302,184 @@ void *DAlloc(int bytes)
     return malloc(bytes);
 }
 
+//-----------------------------------------------------------------------------
+// A pool of worker threads, for the solver to hand out independent pieces
+// of numerical work. The threads are started the first time that we need
+// them, one per processor less the main thread (which works too), and then
+// sleep until there's another batch. Jobs get handed out in order from a
+// shared counter, so a thread that finishes early just takes the next one.
+// There's one batch at a time; if solves on two threads both have work,
+// then whoever comes second does theirs alone.
+//-----------------------------------------------------------------------------
+#define MAX_WORKER_THREADS 16
+static struct {
+    volatile BOOL   started;
+    volatile LONG   starting;
+    int             threads;
+    HANDLE          thread[MAX_WORKER_THREADS];
+    HANDLE          go[MAX_WORKER_THREADS];
+    HANDLE          done[MAX_WORKER_THREADS];
+
+    volatile LONG   busy;
+    void            (*fn)(int job, int worker);
+    int             jobs;
+    volatile LONG   next;
+    // The solver context of whoever handed out the batch, so that the
+    // workers see the same one.
+    SolverContext   *context;
+} Pool;
+
+static void PoolDrain(int worker)
+{
+    for(;;) {
+        int job = InterlockedIncrement(&Pool.next) - 1;
+        if(job >= Pool.jobs) break;
+        Pool.fn(job, worker);
+    }
+}
+
+static DWORD WINAPI PoolThread(LPVOID param)
+{
+    int worker = (int)(INT_PTR)param;
+
+    for(;;) {
+        WaitForSingleObject(Pool.go[worker - 1], INFINITE);
+        UseSolverContext(Pool.context);
+        PoolDrain(worker);
+        SetEvent(Pool.done[worker - 1]);
+    }
+    return 0;
+}
+
+static void PoolStart(void)
+{
+    // Two threads might both need the pool for the first time at once.
+    while(InterlockedExchange(&Pool.starting, 1)) {
+        Sleep(0);
+    }
+    if(Pool.started) {
+        InterlockedExchange(&Pool.starting, 0);
+        return;
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int n = (int)si.dwNumberOfProcessors - 1;
+    if(n > MAX_WORKER_THREADS) n = MAX_WORKER_THREADS;
+
+    int i;
+    for(i = 0; i < n; i++) {
+        Pool.go[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        Pool.done[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if(!Pool.go[i] || !Pool.done[i]) break;
+
+        DWORD id;
+        Pool.thread[i] = CreateThread(NULL, 0, PoolThread,
+            (LPVOID)(INT_PTR)(i + 1), 0, &id);
+        if(!Pool.thread[i]) break;
+    }
+    // If we couldn't get them all, then we'll make do with what we got.
+    Pool.threads = i;
+
+    Pool.started = TRUE;
+    InterlockedExchange(&Pool.starting, 0);
+}
+
+//-----------------------------------------------------------------------------
+// The number of threads that RunInParallel() might use, including the
+// calling thread; the worker numbers that it passes go from zero to one
+// less than this.
+//-----------------------------------------------------------------------------
+int WorkerThreads(void)
+{
+    if(!Pool.started) PoolStart();
+
+    return Pool.threads + 1;
+}
+
+//-----------------------------------------------------------------------------
+// Call fn(job, worker) for every job from zero to jobs-1, spread across the
+// worker threads, and return once they're all done. The jobs mustn't touch
+// anything that another job might write, and they mustn't allocate from
+// our (unserialized) heap.
+//-----------------------------------------------------------------------------
+void RunInParallel(void (*fn)(int job, int worker), int jobs)
+{
+    if(!Pool.started) PoolStart();
+
+    int wake = jobs - 1;
+    if(wake > Pool.threads) wake = Pool.threads;
+    if(wake > 0 && InterlockedExchange(&Pool.busy, 1)) {
+        // Someone else's batch has the threads.
+        wake = 0;
+    }
+    if(wake <= 0) {
+        int i;
+        for(i = 0; i < jobs; i++) {
+            fn(i, 0);
+        }
+        return;
+    }
+
+    Pool.fn = fn;
+    Pool.jobs = jobs;
+    Pool.next = 0;
+    Pool.context = SC;
+
+    int i;
+    for(i = 0; i < wake; i++) {
+        SetEvent(Pool.go[i]);
+    }
+    PoolDrain(0);
+    WaitForMultipleObjects(wake, Pool.done, TRUE, INFINITE);
+
+    InterlockedExchange(&Pool.busy, 0);
+}
+
+//-----------------------------------------------------------------------------
+// A thread for the solver to work on in the background. It sleeps until it's
+// woken, does its job, and then posts a message to the main window, so that
+// the result gets picked up on the main thread. Whoever wakes it mustn't do
+// that again until that message has arrived.
+//-----------------------------------------------------------------------------
+static struct {
+    HANDLE      thread;
+    HANDLE      wake;
+    void        (*job)(void);
+} Background;
+
+static DWORD WINAPI BackgroundThread(LPVOID param)
+{
+    for(;;) {
+        WaitForSingleObject(Background.wake, INFINITE);
+        Background.job();
+        PostMessage(MainWindow, WM_BACKGROUND_DONE, 0, 0);
+    }
+    return 0;
+}
+
+BOOL StartBackgroundThread(void (*job)(void))
+{
+    Background.job = job;
+    Background.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(!Background.wake) return FALSE;
+
+    DWORD id;
+    Background.thread = CreateThread(NULL, 0, BackgroundThread, NULL, 0,
+        &id);
+    if(!Background.thread) {
+        CloseHandle(Background.wake);
+        Background.wake = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void WakeBackgroundThread(void)
+{
+    SetEvent(Background.wake);
+}
+
 //-----------------------------------------------------------------------------
 // Routines to show and un-show the hourglass cursor. We use this when the
 // solution routines are slow.
@@ -1155,6 +1155,10 @@ static LRESULT CALLBACK
             break;
         }
 
+        case WM_BACKGROUND_DONE:
+            BackgroundSolveDone();
+            break;
+
         case WM_ERASEBKGND:
             return NULL;
 